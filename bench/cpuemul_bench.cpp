@@ -0,0 +1,404 @@
+#include <iostream>
+#include <format>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+
+#include "assembly.h"
+#include "assembler.h"
+#include "cpu.h"
+#include "data_reader.h"
+#include "optimizer.h"
+
+// Standalone throughput benchmark. Prints one JSON document on stdout so
+// results can be diffed between releases; everything it runs is built in,
+// so it needs neither CLI11 nor any input files.
+
+namespace{
+    constexpr uint32_t IMEM_SIZE = 1024;
+    constexpr uint32_t DMEM_SIZE = 1024;
+    using Machine = CPU<IMEM_SIZE, DMEM_SIZE>;
+    using Image = std::array<Machine::Instruction, IMEM_SIZE>;
+    using Clock = std::chrono::steady_clock;
+
+    constexpr size_t DEFAULT_REPETITIONS = 5;
+    constexpr size_t CLASS_BODY = 512;
+    constexpr size_t CLASS_ITERATIONS = 40000;
+    constexpr size_t ASSEMBLER_LINES = 50000;
+    constexpr size_t ASSEMBLER_PASSES = 8;
+    constexpr size_t DATA_PASSES = 200;
+    // Runs are repeated until this much wall time has passed, so closed-form
+    // loops that finish within the clock's resolution still get a time.
+    constexpr double MIN_SECONDS = 0.01;
+
+    struct Program{
+        std::string_view name;
+        std::string_view source;
+        std::string_view data;
+    };
+
+    // Canonical workloads. Each one halts on its own; the DMEM counters in
+    // `data` size them to a few tens of millions of steps.
+    constexpr std::array<Program, 4> CORPUS{{
+        {"count_loop", R"(
+            LOAD *0     # 0: ACC = iterations
+            DEC         # 1
+            JNZ 1       # 2
+            HLT         # 3
+        )", "0 20000000\n"},
+
+        {"memory_copy", R"(
+            LOAD 100    #  0: source pointer
+            STORE 0
+            LOAD 500    #  2: destination pointer
+            STORE 1
+            LOAD 400    #  4: words per pass
+            STORE 2
+            LOADI *0    #  6: ACC = DMEM[DMEM[0]]
+            STORE *1    #  7: DMEM[DMEM[1]] = ACC
+            LOAD *0
+            INC
+            STORE 0
+            LOAD *1
+            INC
+            STORE 1
+            LOAD *2
+            DEC
+            STORE 2
+            JNZ 6       # 17
+            LOAD *3     # 18: passes left
+            DEC
+            STORE 3
+            JNZ 0       # 21
+            HLT
+        )", "3 6000\n"},
+
+        {"shift_xor_hash", R"(
+            LOAD *1     #  0: xorshift32 on DMEM[1]
+            SHL 13
+            XOR *1
+            STORE 1
+            SHR 17
+            XOR *1
+            STORE 1
+            SHL 5
+            XOR *1
+            STORE 1
+            LOAD *0     # 10: iterations left
+            DEC
+            STORE 0
+            JNZ 0       # 13
+            HLT
+        )", "0 2000000\n1 2463534242\n"},
+
+        {"branch_heavy", R"(
+            LOAD *3     #  0: xorshift state in DMEM[3]
+            SHL 7
+            XOR *3
+            STORE 3
+            SHR 9
+            XOR *3
+            STORE 3
+            AND 1       #  7: branch on a pseudo-random bit
+            JZ 12
+            LOAD *2     #  9: odd
+            INC
+            JMP 14
+            LOAD *2     # 12: even
+            DEC
+            STORE 2     # 14
+            SHL 1
+            JC 18       # 16: second data-dependent branch
+            NOP
+            LOAD *0     # 18: iterations left
+            DEC
+            STORE 0
+            JNZ 0       # 21
+            HLT
+        )", "0 2000000\n3 12345\n"},
+    }};
+
+    // Instruction classes measured in isolation: CLASS_BODY copies of one
+    // instruction followed by a four-instruction counting loop, so the
+    // loop control is under 1% of the executed steps.
+    struct InstructionClass{
+        std::string_view name;
+        std::string_view instruction;
+    };
+
+    constexpr std::array<InstructionClass, 9> CLASSES{{
+        {"nop", "NOP"},
+        {"load_literal", "LOAD 7"},
+        {"load_memory", "LOAD *5"},
+        {"load_indirect", "LOADI *5"},
+        {"store", "STORE 6"},
+        {"alu", "ADD 1"},
+        {"shift", "SHL 1"},
+        {"branch_not_taken", "JZ 0"},
+        {"jump_taken", "JMP {next}"},
+    }};
+
+    enum class Engine{
+        INTERPRETER,
+        FUSION,
+        LOOPS,
+        JIT
+    };
+
+    constexpr std::string_view toStr(Engine engine){
+        switch (engine){
+            case Engine::INTERPRETER: return "interpreter";
+            case Engine::FUSION:      return "fusion";
+            case Engine::LOOPS:       return "loops";
+            case Engine::JIT:         return "jit";
+        }
+        return "unknown";
+    }
+
+    double seconds(Clock::duration duration){
+        return std::chrono::duration<double>(duration).count();
+    }
+
+    Image assemble(std::string_view name, std::string_view source){
+        auto assembly = Assembler{}.translate(std::string(source));
+        if (!assembly)
+            throw std::runtime_error(std::format("{}: {}", name, Assembler::toStr(assembly.error())));
+        return flashAssembly<IMEM_SIZE, DMEM_SIZE>(*assembly);
+    }
+
+    std::array<uint32_t, DMEM_SIZE> parse(std::string_view name, std::string_view data){
+        auto words = DataReader::parseData<DMEM_SIZE>(std::string(data));
+        if (!words)
+            throw std::runtime_error(std::format("{}: {} at line {}",
+                name, DataReader::toStr(words.error().code), words.error().line));
+        return *words;
+    }
+
+    std::string classSource(std::string_view instruction){
+        std::string source;
+        for (size_t i = 0; i < CLASS_BODY; ++i){
+            std::string line(instruction);
+            if (size_t at = line.find("{next}"); at != std::string::npos)
+                line.replace(at, 6, std::to_string(i + 1));
+            source += line + '\n';
+        }
+        source += "LOAD *0\nDEC\nSTORE 0\nJNZ 0\nHLT\n";
+        return source;
+    }
+
+    std::unique_ptr<Machine> makeMachine(Engine engine, const Image& image){
+        auto cpu = std::make_unique<Machine>();
+        if (engine == Engine::FUSION || engine == Engine::LOOPS)
+            cpu->enableFusion();
+        if (engine == Engine::LOOPS)
+            cpu->enableLoopAcceleration();
+        cpu->loadIMEM(image);
+        if (engine == Engine::JIT && !cpu->enableJit())
+            return nullptr;
+        return cpu;
+    }
+
+    struct RunResult{
+        size_t steps = 0;
+        double seconds = std::numeric_limits<double>::infinity();
+
+        // False when the clock never saw a run take any time.
+        bool isTimed() const{return seconds > 0;};
+    };
+
+    // Best of `repetitions` mean run times. Each repetition runs from a fresh
+    // DMEM until MIN_SECONDS have passed; only runFor is timed.
+    RunResult measure(Machine& cpu, const std::array<uint32_t, DMEM_SIZE>& data, size_t repetitions){
+        RunResult best;
+        for (size_t i = 0; i < repetitions; ++i){
+            double elapsed = 0;
+            size_t runs = 0;
+            auto batchBegin = Clock::now();
+            do{
+                cpu.reset();
+                cpu.loadDMEM(data);
+                cpu.start();
+                auto begin = Clock::now();
+                Simulator::RunStatus status = cpu.runFor(SIZE_MAX);
+                elapsed += seconds(Clock::now() - begin);
+                if (status != Simulator::RunStatus::HALTED)
+                    throw std::runtime_error("Benchmark program did not halt");
+                ++runs;
+            } while (seconds(Clock::now() - batchBegin) < MIN_SECONDS);
+            best.steps = cpu.getStep();
+            best.seconds = std::min(best.seconds, elapsed / runs);
+        }
+        return best;
+    }
+
+    std::vector<Engine> availableEngines(){
+        std::vector<Engine> engines{Engine::INTERPRETER, Engine::FUSION, Engine::LOOPS};
+        Machine probe;
+        if (probe.enableJit())
+            engines.push_back(Engine::JIT);
+        return engines;
+    }
+
+    std::string programsJson(const std::vector<Engine>& engines, size_t repetitions){
+        std::string json;
+        for (const Program& program : CORPUS){
+            Image image = assemble(program.name, program.source);
+            auto data = parse(program.name, program.data);
+            for (Engine engine : engines){
+                auto cpu = makeMachine(engine, image);
+                RunResult result = measure(*cpu, data, repetitions);
+                if (!json.empty())
+                    json += ",\n";
+                json += std::format(
+                    "    {{\"program\": \"{}\", \"engine\": \"{}\", \"steps\": {}, \"seconds\": {:.9f}, \"mips\": {}}}",
+                    program.name, toStr(engine), result.steps, result.seconds,
+                    result.isTimed() ? std::format("{:.2f}", result.steps / result.seconds / 1e6) : "null");
+            }
+        }
+        return json;
+    }
+
+    std::string classesJson(const std::vector<Engine>& engines, size_t repetitions){
+        auto data = parse("classes", std::format("0 {}\n5 5\n", CLASS_ITERATIONS));
+        std::string json;
+        for (const InstructionClass& instructionClass : CLASSES){
+            Image image = assemble(instructionClass.name, classSource(instructionClass.instruction));
+            for (Engine engine : engines){
+                auto cpu = makeMachine(engine, image);
+                RunResult result = measure(*cpu, data, repetitions);
+                if (!json.empty())
+                    json += ",\n";
+                json += std::format(
+                    "    {{\"class\": \"{}\", \"engine\": \"{}\", \"steps\": {}, \"ns_per_instruction\": {}}}",
+                    instructionClass.name, toStr(engine), result.steps,
+                    result.isTimed() ? std::format("{:.3f}", result.seconds * 1e9 / result.steps) : "null");
+            }
+        }
+        return json;
+    }
+
+    // Step counts are deterministic, so one interpreter run per side says how
+    // many emulated steps optimizeAssembly saves on each workload.
+    std::string optimizerJson(){
+        std::string json;
+        for (const Program& program : CORPUS){
+            auto assembly = Assembler{}.translate(std::string(program.source));
+            if (!assembly)
+                throw std::runtime_error(std::format("{}: {}", program.name, Assembler::toStr(assembly.error())));
+            auto optimized = *assembly;
+            OptimizationReport report = optimizeAssembly(optimized, DMEM_SIZE);
+            auto data = parse(program.name, program.data);
+
+            auto plain = makeMachine(Engine::INTERPRETER, flashAssembly<IMEM_SIZE, DMEM_SIZE>(*assembly));
+            auto fast = makeMachine(Engine::INTERPRETER, flashAssembly<IMEM_SIZE, DMEM_SIZE>(optimized));
+            size_t steps = measure(*plain, data, 1).steps;
+            size_t optimizedSteps = measure(*fast, data, 1).steps;
+            if (!json.empty())
+                json += ",\n";
+            json += std::format(
+                "    {{\"program\": \"{}\", \"instructions\": {}, \"optimized_instructions\": {}, "
+                "\"steps\": {}, \"optimized_steps\": {}, \"steps_saved\": {}}}",
+                program.name, report.before, report.after, steps, optimizedSteps, steps - optimizedSteps);
+        }
+        return json;
+    }
+
+    std::string assemblerJson(size_t repetitions){
+        static constexpr std::array<std::string_view, 8> LINES{
+            "LOAD *12",
+            "ADD 345 # running total",
+            "STORE 12",
+            "",
+            "# comment line",
+            "SHL 3",
+            "JNZ 17",
+            "HLT",
+        };
+        std::string source;
+        for (size_t i = 0; i < ASSEMBLER_LINES; ++i)
+            source += std::format("{}\n", LINES[i % LINES.size()]);
+
+        Assembler assembler;
+        double best = std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < repetitions; ++i){
+            auto begin = Clock::now();
+            for (size_t pass = 0; pass < ASSEMBLER_PASSES; ++pass){
+                if (!assembler.translate(source))
+                    throw std::runtime_error("Assembler benchmark source failed to translate");
+            }
+            best = std::min(best, seconds(Clock::now() - begin));
+        }
+        size_t lines = ASSEMBLER_LINES * ASSEMBLER_PASSES;
+        return std::format(
+            "{{\"lines\": {}, \"seconds\": {:.6f}, \"lines_per_second\": {:.0f}, \"mb_per_second\": {:.2f}}}",
+            lines, best, lines / best, source.size() * ASSEMBLER_PASSES / best / 1e6);
+    }
+
+    std::string dataReaderJson(size_t repetitions){
+        std::string source = "# benchmark data\n";
+        for (uint32_t address = 0; address < DMEM_SIZE; ++address)
+            source += std::format("{} {}\n", address, address * 2654435761u);
+
+        double best = std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < repetitions; ++i){
+            auto begin = Clock::now();
+            for (size_t pass = 0; pass < DATA_PASSES; ++pass){
+                if (!DataReader::parseData<DMEM_SIZE>(source))
+                    throw std::runtime_error("DataReader benchmark source failed to parse");
+            }
+            best = std::min(best, seconds(Clock::now() - begin));
+        }
+        size_t bytes = source.size() * DATA_PASSES;
+        return std::format(
+            "{{\"bytes\": {}, \"seconds\": {:.6f}, \"mb_per_second\": {:.2f}}}",
+            bytes, best, bytes / best / 1e6);
+    }
+
+    std::string dispatchName(){
+#if defined(CPUEMUL_DISPATCH_SWITCH)
+        return "switch";
+#else
+        return "threaded";
+#endif
+    }
+}
+
+int main(int argc, char** argv){
+    size_t repetitions = DEFAULT_REPETITIONS;
+    if (argc > 2 || (argc == 2 && (repetitions = std::strtoull(argv[1], nullptr, 10)) == 0)){
+        std::cerr << std::format("Usage: {} [REPETITIONS]\n", argv[0]);
+        return 1;
+    }
+
+    try{
+        std::vector<Engine> engines = availableEngines();
+        std::cout << std::format(
+            "{{\n"
+            "  \"version\": \"{}\",\n"
+            "  \"dispatch\": \"{}\",\n"
+            "  \"repetitions\": {},\n"
+            "  \"programs\": [\n{}\n  ],\n"
+            "  \"instruction_classes\": [\n{}\n  ],\n"
+            "  \"optimizer\": [\n{}\n  ],\n"
+            "  \"assembler\": {},\n"
+            "  \"data_reader\": {}\n"
+            "}}\n",
+            CPUEMUL_VERSION, dispatchName(), repetitions,
+            programsJson(engines, repetitions),
+            classesJson(engines, repetitions),
+            optimizerJson(),
+            assemblerJson(repetitions),
+            dataReaderJson(repetitions));
+    } catch (const std::exception& e){
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <expected>
 #include <optional>
@@ -8,6 +10,59 @@
 
 #include "assembly.h"
 
+namespace Asm {
+    struct Mnemonic{
+        std::string_view name;
+        uint16_t code;
+    };
+
+    constexpr std::array<Mnemonic, 20> MNEMONICS{{
+        {"NOP", NOP},
+        {"LOAD", LOAD},
+        {"STORE", STORE},
+        {"LOADI", LOADI},
+        {"ADD", ADD},
+        {"SUB", SUB},
+        {"INC", INC},
+        {"DEC", DEC},
+        {"AND", AND},
+        {"OR", OR},
+        {"XOR", XOR},
+        {"NOT", NOT},
+        {"SHL", SHL},
+        {"SHR", SHR},
+        {"JMP", JMP},
+        {"JZ", JZ},
+        {"JNZ", JNZ},
+        {"JC", JC},
+        {"JNC", JNC},
+        {"HLT", HLT},
+    }};
+
+    constexpr size_t MNEMONIC_MIN_LENGTH = 2;
+    constexpr size_t MNEMONIC_MAX_LENGTH = 5;
+    constexpr size_t MNEMONIC_SLOTS = 32;
+    constexpr uint8_t EMPTY_SLOT = 0xFF;
+
+    // Perfect hash over MNEMONICS; only valid for tokens of mnemonic length.
+    constexpr size_t mnemonicSlot(std::string_view token){
+        return (token[0] * 4u + token[1] * 11u + token.back() + token.size()) % MNEMONIC_SLOTS;
+    }
+
+    // Slot -> index into MNEMONICS. Fails to compile if two mnemonics collide.
+    constexpr std::array<uint8_t, MNEMONIC_SLOTS> MNEMONIC_TABLE = []{
+        std::array<uint8_t, MNEMONIC_SLOTS> table{};
+        table.fill(EMPTY_SLOT);
+        for (size_t i = 0; i < MNEMONICS.size(); ++i){
+            size_t slot = mnemonicSlot(MNEMONICS[i].name);
+            if (table[slot] != EMPTY_SLOT)
+                throw "Mnemonic hash collision";
+            table[slot] = i;
+        }
+        return table;
+    }();
+}
+
 class Assembler{
 public:
     struct TranslationError{
@@ -35,15 +90,171 @@ public:
     static std::string toStr(TranslationError::Code code) {return TranslationError::stringCodes[static_cast<uint64_t>(code)];};
     static std::string toStr(TranslationError error);
 
-    std::expected<std::vector<Assembly>, TranslationError> translate(const std::string& source) const;
+    // Usable in constant evaluation as long as the result does not outlive it.
+    constexpr std::expected<std::vector<Assembly>, TranslationError> translate(std::string_view source) const{
+        std::vector<Assembly> output;
+        output.reserve(calcLines(source) + 1);
+
+        size_t line_i = 0;
+        size_t begin = 0;
+        while (begin < source.size()){
+            size_t end = source.find('\n', begin);
+            if (end == std::string_view::npos)
+                end = source.size();
+            auto expectedAssembly = parseLine(source.substr(begin, end - begin));
+            begin = end + 1;
+            if (!expectedAssembly){
+                auto& error = expectedAssembly.error();
+                error.line = line_i;
+                return std::unexpected(error);
+            }
+            line_i++;
+            if (!(*expectedAssembly))
+                continue;
+            output.push_back(**expectedAssembly);
+        }
+
+        return output;
+    }
 private:
-    size_t calcLines(std::string_view source) const;
-    std::expected<uint16_t, TranslationError> parseInstructionToken(std::string_view token) const;
-    std::expected<std::optional<Assembly>, TranslationError> parseLine(std::string& token) const;
-    std::expected<uint16_t, TranslationError> parseValue(std::string_view token) const;
-    bool checkIsLiteralType(std::string_view line) const;
+    static constexpr size_t UNKNOWN_LINE = -1;
+
+    static constexpr size_t TOTAL_TOKENS[20] {
+        [Asm::NOP] = 1,
+        [Asm::LOAD] = 2,
+        [Asm::STORE] = 2,
+        [Asm::LOADI] = 2,
+
+        [Asm::ADD] = 2,
+        [Asm::SUB] = 2,
+        [Asm::INC] = 1,
+        [Asm::DEC] = 1,
+
+        [Asm::AND] = 2,
+        [Asm::OR] = 2,
+        [Asm::XOR] = 2,
+        [Asm::NOT] = 1,
+
+        [Asm::SHL] = 2,
+        [Asm::SHR] = 2,
+
+        [Asm::JMP] = 2,
+        [Asm::JZ] = 2,
+        [Asm::JNZ] = 2,
+        [Asm::JC] = 2,
+        [Asm::JNC] = 2,
+
+        [Asm::HLT] = 1,
+    };
+
+    static constexpr bool isSpace(char c){
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    // Returns the next whitespace-separated token of `rest` and drops it from
+    // `rest`; an empty view means the line is exhausted.
+    static constexpr std::string_view nextToken(std::string_view& rest){
+        size_t begin = 0;
+        while (begin < rest.size() && isSpace(rest[begin]))
+            ++begin;
+        size_t end = begin;
+        while (end < rest.size() && !isSpace(rest[end]))
+            ++end;
+        std::string_view token = rest.substr(begin, end - begin);
+        rest.remove_prefix(end);
+        return token;
+    }
+
+    constexpr size_t calcLines(std::string_view source) const{
+        return std::ranges::count(source, '\n');
+    }
+
+    constexpr std::expected<std::optional<Assembly>, TranslationError> parseLine(std::string_view line) const{
+        std::string_view token;
+
+        size_t word_i = 0;
+
+        Assembly result;
+
+        size_t expectedTokens = 1;
+
+        while (!(token = nextToken(line)).empty()) {
+            if (token[0] == '#')
+                break;
+            if (word_i == 0){
+                auto expectedInstruction = parseInstructionToken(token);
+                if (!expectedInstruction){
+                    return std::unexpected(expectedInstruction.error());
+                }
+                result.instructionCode = *expectedInstruction;
+                expectedTokens = totalTokensFor(result.instructionCode);
+            }
+            if (word_i == 1){
+                result.isLiteral = checkIsLiteralType(token);
+                std::string_view view(token);
+                if (!result.isLiteral)
+                    view = view.substr(1);
+                auto expectedValue = parseValue(view);
+                if (!expectedValue){
+                    return std::unexpected(expectedValue.error());
+                }
+                result.value = *expectedValue;
+            }
+            if (word_i >= expectedTokens){
+                return std::unexpected(TranslationError{TranslationError::Code::UnexpectedToken, UNKNOWN_LINE});
+            }
+            word_i++;
+        }
+        if (word_i == 0){
+            return std::nullopt;
+        }
+        if (word_i != expectedTokens){
+            return std::unexpected(TranslationError{TranslationError::Code::IncompleteLine, UNKNOWN_LINE});
+        }
+        return result;
+    }
+
+    constexpr std::expected<uint16_t, TranslationError> parseInstructionToken(std::string_view token) const{
+        if (token.size() >= Asm::MNEMONIC_MIN_LENGTH && token.size() <= Asm::MNEMONIC_MAX_LENGTH){
+            uint8_t index = Asm::MNEMONIC_TABLE[Asm::mnemonicSlot(token)];
+            if (index != Asm::EMPTY_SLOT && Asm::MNEMONICS[index].name == token)
+                return Asm::MNEMONICS[index].code;
+        }
+        return std::unexpected(TranslationError{TranslationError::Code::BadToken, UNKNOWN_LINE});
+    }
+
+    // Unsigned decimal, accepted exactly like std::from_chars, which is not
+    // constexpr here.
+    constexpr std::expected<uint16_t, TranslationError> parseValue(std::string_view token) const{
+        uint64_t result = 0;
+        bool valid = !token.empty();
+        for (char c : token){
+            if (c < '0' || c > '9' || result > (UINT64_MAX - (c - '0')) / 10){
+                valid = false;
+                break;
+            }
+            result = result * 10 + (c - '0');
+        }
+
+        if (valid){
+            uint64_t value_mask = ((static_cast<uint64_t>(1) << VALUE_BITS_COUNT) - 1);
+            if ((value_mask & result) != result){
+                return std::unexpected(TranslationError{TranslationError::Code::OutOfRange, UNKNOWN_LINE});
+            }
+            return value_mask & result;
+        }
+        return std::unexpected(TranslationError{TranslationError::Code::BadValue, UNKNOWN_LINE});
+    }
+
+    constexpr bool checkIsLiteralType(std::string_view line) const{
+        if (line[0] == '*')
+            return false;
+        return true;
+    }
 
-    size_t totalTokensFor(uint16_t token) const;
+    constexpr size_t totalTokensFor(uint16_t token) const{
+        return TOTAL_TOKENS[token];
+    }
 
     size_t VALUE_BITS_COUNT = 10;
 };
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <cstdint>
 #include <array>
+#include <vector>
+#include <stdexcept>
 
 #include <format>
 #include <string>
@@ -25,9 +27,12 @@ struct Assembly{
     std::string toString() const;
 };
 
-template <uint16_t IMEM_SIZE, uint16_t DMEM_SIZE>
-std::array<CPU<>::Instruction, IMEM_SIZE> flashAssembly(const std::vector<Assembly>& assembly){
-    std::array<CPU<>::Instruction, IMEM_SIZE> result;
+template <uint16_t IMEM_SIZE, uint32_t DMEM_SIZE>
+constexpr std::array<CPU<>::Instruction, IMEM_SIZE> flashAssembly(const std::vector<Assembly>& assembly){
+    std::array<CPU<>::Instruction, IMEM_SIZE> result{};
+
+    if (assembly.size() > IMEM_SIZE)
+        throw std::runtime_error(std::format("Program does not fit in IMEM: {} instructions", assembly.size()));
 
     size_t i = 0;
     for (const Assembly& instruction : assembly){
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "spsc_queue.h"
+
+// Renders frames on its own thread. The simulation thread only copies a frame
+// into a lock-free queue, so terminal I/O never stalls the emulated clock.
+//
+// Lossy mode never blocks the publisher: a full queue drops the new frame,
+// and the renderer skips to the newest frame it has. Lossless mode renders
+// every frame in order and makes the publisher wait while the queue is full.
+template<class Frame>
+class AsyncDisplay{
+public:
+    static constexpr size_t QUEUE_FRAMES = 1024;
+
+    // `flush` runs whenever the renderer has caught up with the publisher.
+    AsyncDisplay(std::function<void(const Frame&)> render, std::function<void()> flush, bool lossless)
+        : render(std::move(render)), flush(std::move(flush)), lossless(lossless){
+        thread = std::thread(&AsyncDisplay::renderLoop, this);
+    }
+    ~AsyncDisplay(){
+        finish();
+    }
+    AsyncDisplay(const AsyncDisplay&) = delete;
+    AsyncDisplay& operator=(const AsyncDisplay&) = delete;
+
+    void publish(const Frame& frame){
+        if (lossless){
+            queue.push(frame);
+        } else{
+            held = !queue.tryPush(frame);
+            if (held){
+                heldFrame = frame;
+                ++dropped;
+            }
+        }
+        events.fetch_add(1, std::memory_order_release);
+        events.notify_one();
+    }
+    // Renders what is still queued, including the last published frame even
+    // if it was dropped, and stops the render thread.
+    void finish(){
+        if (!thread.joinable())
+            return;
+        if (held){
+            queue.push(heldFrame);
+            held = false;
+            --dropped;
+        }
+        closing.store(true, std::memory_order_release);
+        events.fetch_add(1, std::memory_order_release);
+        events.notify_one();
+        thread.join();
+    }
+
+    size_t getDropped() const{return dropped + skipped.load(std::memory_order_relaxed);};
+
+private:
+    void renderLoop(){
+        while (true){
+            uint32_t seen = events.load(std::memory_order_acquire);
+            bool closed = closing.load(std::memory_order_acquire);
+            if (drain())
+                flush();
+            else if (closed)
+                return;
+            else
+                events.wait(seen, std::memory_order_acquire);
+        }
+    }
+    bool drain(){
+        Frame frame;
+        if (!queue.tryPop(frame))
+            return false;
+        if (lossless){
+            do
+                render(frame);
+            while (queue.tryPop(frame));
+        } else{
+            size_t behind = 0;
+            while (queue.tryPop(frame))
+                ++behind;
+            skipped.fetch_add(behind, std::memory_order_relaxed);
+            render(frame);
+        }
+        return true;
+    }
+
+    std::function<void(const Frame&)> render;
+    std::function<void()> flush;
+    bool lossless;
+    SpscQueue<Frame, QUEUE_FRAMES> queue;
+    std::atomic<uint32_t> events{0};
+    std::atomic<bool> closing{false};
+    size_t dropped = 0;
+    bool held = false;
+    Frame heldFrame{};
+    std::atomic<size_t> skipped{0};
+    std::thread thread;
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "lockstep.h"
+#include "image_cache.h"
+#include "loop_detector.h"
+
+class BatchRunner{
+public:
+    static constexpr uint32_t IMEM_SIZE = 1024;
+    static constexpr uint32_t DMEM_SIZE = 1024;
+    static constexpr size_t TIMEOUT_CHECK_STEPS = 1 << 16;
+    static constexpr size_t LOCKSTEP_LANES = 16;
+
+    using Machine = CPU<IMEM_SIZE, DMEM_SIZE>;
+    using Lockstep = LockstepCPU<IMEM_SIZE, DMEM_SIZE, LOCKSTEP_LANES>;
+    using Detector = LoopDetector<IMEM_SIZE, DMEM_SIZE>;
+
+    struct Job{
+        std::filesystem::path program;
+        std::filesystem::path data;
+        size_t budget = 0;
+    };
+
+    struct ManifestError{
+        enum class Code{
+            IncompleteLine,
+            UnexpectedToken,
+            BadBudget
+        };
+        static constexpr std::array<std::string, 3> stringCodes{
+            "IncompleteLine",
+            "UnexpectedToken",
+            "BadBudget"
+        };
+        Code code;
+        size_t line;
+    };
+
+    enum class JobStatus{
+        HALTED,
+        BUDGET_EXHAUSTED,
+        TIMEOUT,
+        LOOP,
+        ERROR
+    };
+
+    struct Summary{
+        size_t jobs = 0;
+        size_t halted = 0;
+        size_t failed = 0;
+        size_t loops = 0;
+        size_t steps = 0;
+    };
+
+    static std::string toStr(ManifestError error);
+    static std::string toStr(JobStatus status);
+
+    // Manifest lines are `PROGRAM DATAFILE [BUDGET]`; `#` starts a comment and
+    // relative paths are taken from `baseDir`.
+    static std::expected<std::vector<Job>, ManifestError> parseManifest(
+        const std::string& source, const std::filesystem::path& baseDir);
+    static std::vector<Job> jobsForDirectory(const std::filesystem::path& program, const std::filesystem::path& dataDir);
+
+    BatchRunner(size_t threadCount = 0);
+
+    void setStepBudget(size_t steps);
+    void setTimeout(std::chrono::milliseconds timeout);
+    void setFusion(bool enabled);
+    void setLoopAcceleration(bool enabled);
+    // Passes programs through optimizeAssembly. Results then report the
+    // optimized program's steps and PC.
+    void setOptimization(bool enabled);
+    // Runs jobs that share a program and a budget LOCKSTEP_LANES at a time
+    // on one LockstepCPU.
+    void setLockstep(bool enabled);
+    // Ends a job as LOOP once its state repeats. Jobs then run through a
+    // LoopDetector, which is slower than a plain run; lockstep units are
+    // not checked.
+    void setLoopDetection(bool enabled);
+    // Looks programs up in `cache` before assembling them; null disables it.
+    void setImageCache(std::shared_ptr<const ImageCache> cache);
+
+    size_t getThreadCount() const;
+
+    // Runs every job and streams one result line per job to `out` as jobs
+    // finish: index, status, steps, PC, ACC, Z, C, DMEM digest, program, data.
+    Summary run(const std::vector<Job>& jobs, std::ostream& out);
+
+private:
+    size_t threadCount;
+    size_t stepBudget = SIZE_MAX;
+    std::chrono::milliseconds timeout{0};
+    bool fusion = false;
+    bool loopAcceleration = false;
+    bool optimization = false;
+    bool lockstep = false;
+    bool loopDetection = false;
+    std::shared_ptr<const ImageCache> imageCache;
+};
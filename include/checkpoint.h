@@ -0,0 +1,255 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <expected>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cpu.h"
+
+// Checkpoints of a running CPU, so a long simulation survives a host
+// restart. A checkpoint file is a full image followed by deltas:
+//
+// Layout, all integers little-endian:
+//   header   magic "CPUCHKPT", version, IMEM size, DMEM size, words per page
+//   frames   u32 kind (0 full, 1 delta), u32 payload bytes, u64 FNV-1a of the
+//            payload, then the payload: u32 PC, u32 ACC, u16 IR, u8 flags
+//            (Z, C, running), u8 0, u64 step; a full frame adds the IMEM
+//            words (u16), padded to 4 bytes; then u32 page count and
+//            {u32 page index, u32 words...} per page.
+//
+// A full frame lists the pages holding a non-zero word and leaves the rest
+// zero; a delta lists the pages written since the frame before it. Every
+// frame is synced before the next is written, and a reader stops at the
+// first torn or corrupt frame, so a crash mid-write loses only that frame.
+namespace checkpoint{
+
+    enum class CheckpointError {
+        CannotOpen,
+        WriteError,
+        BadHeader,
+        SizeMismatch,
+        Truncated,
+        BadChecksum
+    };
+
+    static constexpr std::array<std::string, 6> checkpointErrorStringCodes{
+        "CannotOpen",
+        "WriteError",
+        "BadHeader",
+        "SizeMismatch",
+        "Truncated",
+        "BadChecksum"
+    };
+
+    inline std::string toStr(CheckpointError code) {return checkpointErrorStringCodes[static_cast<uint64_t>(code)];};
+
+    static constexpr uint32_t VERSION = 1;
+
+    struct Registers{
+        uint32_t PC = 0;
+        uint32_t ACC = 0;
+        bool Z = false;
+        bool C = false;
+        uint16_t IR = 0;
+        uint64_t step = 0;
+        bool running = false;
+    };
+
+    struct Page{
+        uint32_t index;
+        std::span<const uint32_t> words;
+    };
+
+    // The file layer. Each call writes one frame and syncs it.
+    class File{
+    public:
+        File(std::filesystem::path path, uint32_t imemSize, uint32_t dmemSize, uint32_t pageWords);
+        ~File();
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+
+        // Replaces the file with a header and one full frame: the new file
+        // is written beside it and renamed over it. Returns the file size.
+        std::expected<size_t, CheckpointError> writeFull(const Registers& registers,
+            std::span<const uint16_t> IMEM, std::span<const Page> pages);
+        // Appends a delta frame. Returns the bytes appended.
+        std::expected<size_t, CheckpointError> appendDelta(const Registers& registers, std::span<const Page> pages);
+
+    private:
+        std::filesystem::path path;
+        uint32_t imemSize;
+        uint32_t dmemSize;
+        uint32_t pageWords;
+        std::FILE* file = nullptr;
+    };
+
+    // The state of the last intact frame. DMEM holds only the non-zero words.
+    struct Loaded{
+        Registers registers;
+        std::vector<uint16_t> IMEM;
+        std::vector<std::pair<uint32_t, uint32_t>> DMEM;
+        size_t frames = 0;
+    };
+
+    std::expected<Loaded, CheckpointError> read(const std::filesystem::path& path,
+        uint32_t imemSize, uint32_t dmemSize);
+
+    // Writes checkpoints of a CPU on a background thread. submit() only takes
+    // a snapshot, whose DMEM pages stay shared with the CPU until it stores
+    // to them; that copy-on-write is also how the writer finds the pages
+    // written since its last frame, by comparing page pointers. A snapshot
+    // submitted while the previous one is still being written replaces any
+    // that is waiting, so a slow disk costs checkpoints, never steps. A new
+    // full image is written once the deltas since the last one outgrow it.
+    template<uint16_t IMEM_SIZE = 1024, uint32_t DMEM_SIZE = 1024, class Memory = PagedMemory<DMEM_SIZE>>
+    class Writer{
+    public:
+        using Machine = CPU<IMEM_SIZE, DMEM_SIZE, Memory>;
+        using Snapshot = typename Machine::Snapshot;
+
+        Writer(const std::filesystem::path& path, const Machine& cpu)
+            : file(path, IMEM_SIZE, DMEM_SIZE, Memory::PAGE_WORDS){
+            for (size_t i = 0; i < IMEM_SIZE; ++i)
+                IMEM[i] = cpu.readIMEM(i).raw;
+            thread = std::thread(&Writer::drain, this);
+        }
+        ~Writer(){
+            (void)close();
+        }
+
+        void submit(const Machine& cpu){
+            Snapshot snapshot = cpu.snapshot();
+            {
+                std::lock_guard lock(mutex);
+                pending = std::move(snapshot);
+                ++submitted;
+            }
+            wake.notify_all();
+        }
+        // Writes the snapshot still waiting, if any, and stops the thread.
+        std::expected<void, CheckpointError> close(){
+            if (thread.joinable()){
+                {
+                    std::lock_guard lock(mutex);
+                    closing = true;
+                }
+                wake.notify_all();
+                thread.join();
+            }
+            if (error)
+                return std::unexpected(*error);
+            return {};
+        }
+
+        // Only stable once close() has returned.
+        size_t getCheckpointCount() const{return written;};
+        size_t getSkippedCount() const{return submitted - written;};
+        size_t getBytesWritten() const{return bytesWritten;};
+
+    private:
+        static constexpr size_t PAGE_COUNT = Memory::PAGE_COUNT;
+        static constexpr size_t PAGE_WORDS = Memory::PAGE_WORDS;
+
+        File file;
+        std::array<uint16_t, IMEM_SIZE> IMEM;
+        std::optional<Snapshot> pending;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool closing = false;
+        std::optional<CheckpointError> error;
+        size_t submitted = 0;
+        size_t written = 0;
+        size_t bytesWritten = 0;
+        std::thread thread;
+
+        static std::span<const uint32_t> pageWords(const Snapshot& snapshot, size_t page){
+            size_t begin = page * PAGE_WORDS;
+            return std::span<const uint32_t>(snapshot.DMEM.page(page), std::min(PAGE_WORDS, DMEM_SIZE - begin));
+        }
+
+        void drain(){
+            std::optional<Snapshot> last;
+            size_t fullBytes = 0;
+            size_t deltaBytes = 0;
+            std::vector<Page> pages;
+            while (true){
+                std::optional<Snapshot> current;
+                {
+                    std::unique_lock lock(mutex);
+                    wake.wait(lock, [this]{return pending || closing;});
+                    if (!pending)
+                        return;
+                    current = std::move(pending);
+                    pending.reset();
+                }
+                if (error)
+                    continue;
+
+                const Snapshot& snapshot = *current;
+                Registers registers{snapshot.PC, snapshot.ACC, snapshot.Z, snapshot.C, snapshot.IR.raw,
+                    snapshot.step, snapshot.state == Simulator::State::RUNNING};
+                bool full = !last || deltaBytes > fullBytes;
+                pages.clear();
+                for (size_t page = 0; page < PAGE_COUNT; ++page){
+                    std::span<const uint32_t> words = pageWords(snapshot, page);
+                    bool changed = full
+                        ? std::ranges::any_of(words, [](uint32_t word){return word != 0;})
+                        : snapshot.DMEM.page(page) != last->DMEM.page(page);
+                    if (changed)
+                        pages.push_back(Page{static_cast<uint32_t>(page), words});
+                }
+
+                auto bytes = full ? file.writeFull(registers, IMEM, pages) : file.appendDelta(registers, pages);
+                if (!bytes){
+                    error = bytes.error();
+                    continue;
+                }
+                if (full){
+                    fullBytes = *bytes;
+                    deltaBytes = 0;
+                } else{
+                    deltaBytes += *bytes;
+                }
+                bytesWritten += *bytes;
+                ++written;
+                last = std::move(current);
+            }
+        }
+    };
+
+    // Loads the program and machine state of a checkpoint into a stopped
+    // CPU, which then carries on from the step it was saved at.
+    template<uint16_t IMEM_SIZE, uint32_t DMEM_SIZE, class Memory>
+    void restore(CPU<IMEM_SIZE, DMEM_SIZE, Memory>& cpu, const Loaded& loaded){
+        using Machine = CPU<IMEM_SIZE, DMEM_SIZE, Memory>;
+
+        std::array<typename Machine::Instruction, IMEM_SIZE> IMEM;
+        for (size_t i = 0; i < IMEM_SIZE; ++i)
+            IMEM[i].raw = loaded.IMEM[i];
+        cpu.loadIMEM(IMEM);
+
+        const Registers& registers = loaded.registers;
+        typename Machine::Snapshot snapshot;
+        snapshot.PC = registers.PC;
+        snapshot.ACC = registers.ACC;
+        snapshot.Z = registers.Z;
+        snapshot.C = registers.C;
+        snapshot.IR.raw = registers.IR;
+        snapshot.step = registers.step;
+        snapshot.state = registers.running ? Simulator::State::RUNNING : Simulator::State::STOPPED;
+        for (const auto& [address, value] : loaded.DMEM)
+            snapshot.DMEM.store(address, value);
+        cpu.restore(snapshot);
+    }
+}
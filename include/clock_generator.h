@@ -13,12 +13,22 @@ public:
         RESULT
     };
 
+    enum class TimingMode {
+        REAL_TIME,
+        MAX_SPEED,
+        VIRTUAL_TIME
+    };
+
+    static constexpr size_t BATCH_STEPS = 1 << 16;
+
     ClockGenerator(double simulationFrequencyHz, double displayFrequencyHz = 0);
     
     void setSimulationFrequency(double frequencyHz);
     void setDisplayFrequency(double frequencyHz);
     void setDisplayMode(DisplayMode mode);
+    void setTimingMode(TimingMode mode);
     void setSimulator(std::shared_ptr<Simulator> simulatorObj);
+    // Runs on the simulation thread; hand slow output to an AsyncDisplay.
     void setDisplayCallback(std::function<void()> callback);
 
     void start();
@@ -29,12 +39,18 @@ public:
     double getSimulationFrequency() const;
     double getDisplayFrequency() const;
     DisplayMode getDisplayMode() const;
+    TimingMode getTimingMode() const;
+    std::chrono::duration<double> getVirtualTime() const;
     bool isRunning() const;
     std::shared_ptr<Simulator> getSimulator() const;
 
 private:
     void setShouldDisplay(std::chrono::steady_clock::time_point nowTime);
+    bool tickRealTime();
+    bool tickBatch();
 
+    double simulationFrequency;
+    double displayFrequency = 0;
     std::chrono::microseconds simulationPeriod;
     std::chrono::microseconds displayPeriod;
     std::chrono::steady_clock::time_point lastSimulationTick;
@@ -42,5 +58,7 @@ private:
     std::shared_ptr<Simulator> simulator;
     std::function<void()> displayCallback;
     DisplayMode displayMode = DisplayMode::EVERY_FRAME;
+    TimingMode timingMode = TimingMode::REAL_TIME;
     bool shouldDisplay = false;
+    double nextDisplayStep = 0;
 };
\ No newline at end of file
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <expected>
+#include <optional>
+#include <string_view>
+
+#include "cpu.h"
+#include "assembler.h"
+
+// Runs programs during constant evaluation, for fixed routines whose results
+// depend only on constant inputs:
+//
+//   constexpr auto sum = ConstexprCPU<64, 16>::evaluate("LOAD 2\nADD 3\nHLT\n", 100);
+//   static_assert(sum && sum->status == ConstexprCPU<64, 16>::Status::HALTED && sum->ACC == 5);
+//
+// Register semantics come from CPUCore, the same code CPU executes. Faults
+// that CPU throws for end the run with a status instead, and DMEM addresses
+// are bounds-checked. Long runs can hit the compiler's constant-evaluation
+// limits (-fconstexpr-loop-limit and -fconstexpr-ops-limit on GCC).
+template<uint16_t IMEM_SIZE = 1024, uint32_t DMEM_SIZE = 1024>
+class ConstexprCPU : private CPUCore<IMEM_SIZE>{
+    using Core = CPUCore<IMEM_SIZE>;
+    using typename Core::Registers;
+
+public:
+    using Instruction = EncodedInstruction;
+
+    enum class Status{
+        HALTED,
+        BUDGET_EXHAUSTED,
+        BAD_INSTRUCTION,
+        OUT_OF_IMEM,
+        BAD_ADDRESS
+    };
+
+    struct Result{
+        Status status;
+        size_t steps;
+        uint32_t PC;
+        uint32_t ACC;
+        bool Z;
+        bool C;
+        std::array<uint32_t, DMEM_SIZE> DMEM;
+    };
+
+    constexpr ConstexprCPU(const std::array<Instruction, IMEM_SIZE>& IMEM,
+        const std::array<uint32_t, DMEM_SIZE>& DMEM = {})
+        : IMEM(IMEM), DMEM(DMEM){}
+
+    // Assembles `source` and runs it from PC 0 for at most `maxSteps` steps.
+    static consteval std::expected<Result, Assembler::TranslationError> evaluate(std::string_view source,
+        size_t maxSteps, const std::array<uint32_t, DMEM_SIZE>& DMEM = {}){
+        auto assembly = Assembler{}.translate(source);
+        if (!assembly)
+            return std::unexpected(assembly.error());
+        if (assembly->size() > IMEM_SIZE)
+            return std::unexpected(Assembler::TranslationError{Assembler::TranslationError::Code::BloatError, IMEM_SIZE});
+        ConstexprCPU cpu(flashAssembly<IMEM_SIZE, DMEM_SIZE>(*assembly), DMEM);
+        return cpu.run(maxSteps);
+    }
+
+    // Runs from PC 0 until HLT, a fault, or `maxSteps` executed steps. A
+    // faulting instruction is not counted, as in CPU.
+    constexpr Result run(size_t maxSteps){
+        Registers r{0, 0, false, false};
+        size_t executed = 0;
+        Status status = Status::BUDGET_EXHAUSTED;
+        while (executed < maxSteps){
+            std::optional<Status> stop = step(r);
+            if (!stop || *stop == Status::HALTED)
+                ++executed;
+            if (stop){
+                status = *stop;
+                break;
+            }
+        }
+        return Result{status, executed, r.PC, r.ACC, r.Z, r.C, DMEM};
+    }
+
+private:
+    std::array<Instruction, IMEM_SIZE> IMEM;
+    std::array<uint32_t, DMEM_SIZE> DMEM;
+
+    constexpr bool read(uint32_t address, uint32_t& value) const{
+        if (address >= DMEM_SIZE)
+            return false;
+        value = DMEM[address];
+        return true;
+    }
+
+    // Executes the instruction at PC; nullopt means the run goes on.
+    constexpr std::optional<Status> step(Registers& r){
+        if (r.PC >= IMEM_SIZE)
+            return Status::OUT_OF_IMEM;
+        Instruction instr = IMEM[r.PC];
+        MicroOp op = decodeMicroOp(instr.fields.code, instr.fields.isLiteral);
+        uint32_t operand = instr.fields.value;
+        uint32_t word = 0;
+
+        switch (op){
+            case MicroOp::LOAD_M:  case MicroOp::STORE_M: case MicroOp::LOADI_M:
+            case MicroOp::ADD_M:   case MicroOp::SUB_M:
+            case MicroOp::AND_M:   case MicroOp::OR_M:    case MicroOp::XOR_M:
+            case MicroOp::SHL_M:   case MicroOp::SHR_M:
+            case MicroOp::JMP_M:   case MicroOp::JZ_M:    case MicroOp::JNZ_M:
+            case MicroOp::JC_M:    case MicroOp::JNC_M:
+                if (!read(operand, operand))
+                    return Status::BAD_ADDRESS;
+                break;
+            default:
+                break;
+        }
+
+        switch (op){
+            case MicroOp::NOP:                          Core::NOP(r);               break;
+            case MicroOp::LOAD_L:  case MicroOp::LOAD_M: Core::LOAD(r, operand);     break;
+            case MicroOp::STORE_L: case MicroOp::STORE_M:
+                if (operand >= DMEM_SIZE)
+                    return Status::BAD_ADDRESS;
+                DMEM[operand] = r.ACC;
+                break;
+            case MicroOp::LOADI_L: case MicroOp::LOADI_M:
+                if (!read(operand, word))
+                    return Status::BAD_ADDRESS;
+                Core::setAcc(r, word);
+                break;
+            case MicroOp::ADD_L:   case MicroOp::ADD_M:  Core::ADD(r, operand);      break;
+            case MicroOp::SUB_L:   case MicroOp::SUB_M:  Core::SUB(r, operand);      break;
+            case MicroOp::INC:                          Core::INC(r);               break;
+            case MicroOp::DEC:                          Core::DEC(r);               break;
+            case MicroOp::AND_L:   case MicroOp::AND_M:  Core::AND(r, operand);      break;
+            case MicroOp::OR_L:    case MicroOp::OR_M:   Core::OR(r, operand);       break;
+            case MicroOp::XOR_L:   case MicroOp::XOR_M:  Core::XOR(r, operand);      break;
+            case MicroOp::NOT:                          Core::NOT(r);               break;
+            case MicroOp::SHL_L:   case MicroOp::SHL_M:  Core::SHL(r, operand);      break;
+            case MicroOp::SHR_L:   case MicroOp::SHR_M:  Core::SHR(r, operand);      break;
+            case MicroOp::JMP_L:   case MicroOp::JMP_M:  Core::JMP(r, operand);      break;
+            case MicroOp::JZ_L:    case MicroOp::JZ_M:   Core::JZ(r, operand);       break;
+            case MicroOp::JNZ_L:   case MicroOp::JNZ_M:  Core::JNZ(r, operand);      break;
+            case MicroOp::JC_L:    case MicroOp::JC_M:   Core::JC(r, operand);       break;
+            case MicroOp::JNC_L:   case MicroOp::JNC_M:  Core::JNC(r, operand);      break;
+            case MicroOp::HLT:
+                ++r.PC;
+                return Status::HALTED;
+            default:
+                return Status::BAD_INSTRUCTION;
+        }
+        ++r.PC;
+        return std::nullopt;
+    }
+};
@@ -2,9 +2,31 @@
 
 #include <cstdint>
 #include <array>
-#include <functional>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <memory>
+#include <span>
+#include <utility>
 
 #include "simulator.h"  
+#include "micro_op.h"
+#include "superinstructions.h"
+#include "loop_acceleration.h"
+#include "paged_memory.h"
+#include "sparse_memory.h"
+#include "undo_log.h"
+#include "jit.h"
+
+#if !defined(CPUEMUL_DISPATCH_SWITCH) && !defined(CPUEMUL_DISPATCH_THREADED)
+    #if defined(__GNUC__)
+        #define CPUEMUL_DISPATCH_THREADED
+    #else
+        #define CPUEMUL_DISPATCH_SWITCH
+    #endif
+#endif
 
 namespace Asm {
     constexpr uint16_t NOP = 0x00;
@@ -38,43 +60,375 @@ namespace Asm {
     constexpr bool p = false;
 }
 
-template<uint16_t IMEM_SIZE = 1024, uint16_t DMEM_SIZE = 1024>
-class CPU : public Simulator{
+struct NeverStop{
+    template<class T>
+    constexpr bool operator()(const T&) const{return false;}
+};
 
-public:
-    union Instruction {
-        struct {
-            uint16_t code : 5;
-            uint16_t isLiteral : 1;
-            uint16_t value : 10;
-        } fields;
-        
-        uint16_t raw;
+constexpr MicroOp decodeMicroOp(uint16_t code, bool isLiteral){
+    auto form = [isLiteral](MicroOp literal, MicroOp memory){
+        return isLiteral ? literal : memory;
     };
+    switch (code){
+        case Asm::NOP:   return MicroOp::NOP;
+        case Asm::LOAD:  return form(MicroOp::LOAD_L, MicroOp::LOAD_M);
+        case Asm::STORE: return form(MicroOp::STORE_L, MicroOp::STORE_M);
+        case Asm::LOADI: return form(MicroOp::LOADI_L, MicroOp::LOADI_M);
+        case Asm::ADD:   return form(MicroOp::ADD_L, MicroOp::ADD_M);
+        case Asm::SUB:   return form(MicroOp::SUB_L, MicroOp::SUB_M);
+        case Asm::INC:   return MicroOp::INC;
+        case Asm::DEC:   return MicroOp::DEC;
+        case Asm::AND:   return form(MicroOp::AND_L, MicroOp::AND_M);
+        case Asm::OR:    return form(MicroOp::OR_L, MicroOp::OR_M);
+        case Asm::XOR:   return form(MicroOp::XOR_L, MicroOp::XOR_M);
+        case Asm::NOT:   return MicroOp::NOT;
+        case Asm::SHL:   return form(MicroOp::SHL_L, MicroOp::SHL_M);
+        case Asm::SHR:   return form(MicroOp::SHR_L, MicroOp::SHR_M);
+        case Asm::JMP:   return form(MicroOp::JMP_L, MicroOp::JMP_M);
+        case Asm::JZ:    return form(MicroOp::JZ_L, MicroOp::JZ_M);
+        case Asm::JNZ:   return form(MicroOp::JNZ_L, MicroOp::JNZ_M);
+        case Asm::JC:    return form(MicroOp::JC_L, MicroOp::JC_M);
+        case Asm::JNC:   return form(MicroOp::JNC_L, MicroOp::JNC_M);
+        case Asm::HLT:   return MicroOp::HLT;
+        default:         return MicroOp::BAD;
+    }
+}
+
+// Shared by every CPU instantiation, so one flashed IMEM loads into any of
+// them regardless of memory sizes or backend.
+union EncodedInstruction {
+    struct {
+        uint16_t code : 5;
+        uint16_t isLiteral : 1;
+        uint16_t value : 10;
+    } fields;
+
+    uint16_t raw;
+};
+
+// Register file and the register-only instruction semantics. CPU executes
+// through these, and ConstexprCPU runs the same code in constant evaluation.
+template<uint16_t IMEM_SIZE>
+struct CPUCore{
+    struct Registers{
+        uint32_t PC;
+        uint32_t ACC;
+        bool Z;
+        bool C;
+    };
+
+    static constexpr void setAcc(Registers& r, uint32_t ACC){
+        r.ACC = ACC;
+        r.Z = (ACC == 0);
+    }
+
+
+    static constexpr void NOP(Registers&){
+    }
+
+
+    static constexpr void LOAD(Registers& r, uint32_t value) {
+        setAcc(r, value);
+    }
+    static constexpr void ADD(Registers& r, uint32_t value) {
+        uint32_t result = r.ACC + value;
+        r.C = (result < r.ACC);
+        setAcc(r, result);
+    }
+    static constexpr void SUB(Registers& r, uint32_t value) {
+        uint32_t result = r.ACC - value;
+        r.C = (result > r.ACC);
+        setAcc(r, result);
+    }
+    static constexpr void INC(Registers& r){
+        uint32_t result = r.ACC + 1;
+        r.C = (result < r.ACC);
+        setAcc(r, result);
+    }
+    static constexpr void DEC(Registers& r){
+        uint32_t result = r.ACC - 1;
+        r.C = (result > r.ACC);
+        setAcc(r, result);
+    }
+
+
+    static constexpr void AND(Registers& r, uint32_t value){
+        setAcc(r, r.ACC & value);
+    }
+    static constexpr void OR(Registers& r, uint32_t value){
+        setAcc(r, r.ACC | value);
+    }
+    static constexpr void XOR(Registers& r, uint32_t value){
+        setAcc(r, r.ACC ^ value);
+    }
+    static constexpr void NOT(Registers& r){
+        setAcc(r, !r.ACC);
+    }
+    static constexpr void SHL(Registers& r, uint32_t value){
+        uint8_t shift_count = value & 0b00011111;
+        if (shift_count > 0) {
+            r.C = (r.ACC >> (32 - shift_count)) & 1;
+        } else {
+            r.C = 0;
+        }
+        setAcc(r, r.ACC << shift_count);
+    }
+    static constexpr void SHR(Registers& r, uint32_t value){
+        uint8_t shift_count = value & 0b00011111;
+        if (shift_count > 0) {
+            r.C = (r.ACC >> (shift_count - 1)) & 1;
+        } else {
+            r.C = 0;
+        }
+        setAcc(r, r.ACC >> shift_count);
+    }
+
+
+    static constexpr void JMP(Registers& r, uint32_t target){
+        r.PC = std::min<uint32_t>(target, IMEM_SIZE) - 1;
+    }
+    static constexpr void JZ(Registers& r, uint32_t target){
+        if (r.Z){
+            JMP(r, target);
+        }
+    }
+    static constexpr void JNZ(Registers& r, uint32_t target){
+        if (!r.Z){
+            JMP(r, target);
+        }
+    }
+
+    static constexpr void JC(Registers& r, uint32_t target){
+        if (!r.C){
+            JMP(r, target);
+        }
+    }
+    static constexpr void JNC(Registers& r, uint32_t target){
+        if (!r.C){
+            JMP(r, target);
+        }
+    }
+};
+
+// `Memory` is the DMEM backend: PagedMemory keeps all of DMEM in one arena,
+// SparseMemory allocates pages on first store for large address spaces.
+template<uint16_t IMEM_SIZE = 1024, uint32_t DMEM_SIZE = 1024, class Memory = PagedMemory<DMEM_SIZE>>
+class CPU : public Simulator, private CPUCore<IMEM_SIZE>{
+    using Core = CPUCore<IMEM_SIZE>;
+    using typename Core::Registers;
+    using Core::setAcc;
+    using Core::NOP;
+    using Core::LOAD;
+    using Core::ADD;
+    using Core::SUB;
+    using Core::INC;
+    using Core::DEC;
+    using Core::AND;
+    using Core::OR;
+    using Core::XOR;
+    using Core::NOT;
+    using Core::SHL;
+    using Core::SHR;
+    using Core::JMP;
+    using Core::JZ;
+    using Core::JNZ;
+    using Core::JC;
+    using Core::JNC;
+
+public:
+    using Instruction = EncodedInstruction;
 
-    CPU(){};
+    CPU(){
+        decodeIMEM();
+    };
 
     uint32_t getPC() const{return PC;};
     uint32_t getACC() const{return ACC;};
     bool getZ() const{return Z;};
     bool getC() const{return C;};
     Instruction getIR() const{return IR;};
+    std::array<uint32_t, DMEM_SIZE> getDMEM() const{return DMEM.toArray();};
+    uint32_t readDMEM(uint32_t address) const{return DMEM[address];};
+    Instruction readIMEM(uint32_t address) const{return IMEM[address];};
+
+    template<class Predicate>
+    RunStatus runUntil(Predicate&& predicate, size_t budget){
+        requireRunning();
+        size_t counted = 0;
+        bool hit = false;
+        size_t executed;
+        try{
+            executed = execute(budget, [&](const CPU& cpu){
+                advanceStep(1);
+                ++counted;
+                hit = predicate(cpu);
+                return hit;
+            });
+        } catch (const SimulationFault& fault){
+            advanceStep(fault.getExecuted() - counted);
+            throw;
+        }
+        advanceStep(executed - counted);
+        if (getState() != State::RUNNING)
+            return RunStatus::HALTED;
+        return hit ? RunStatus::BREAKPOINT : RunStatus::BUDGET_EXHAUSTED;
+    }
 
-    void loadDMEM(const std::array<uint32_t, IMEM_SIZE>& DMEM){
+    void reset(){
+        if (getState() != State::STOPPED)
+            throw std::runtime_error("The CPU is already running");
+        storeRegisters(Registers{0, 0, false, false});
+        IR.raw = 0;
+        clearUndoLog();
+    }
+    void loadDMEM(const std::array<uint32_t, DMEM_SIZE>& DMEM){
         if (getState() != State::STOPPED)
             throw std::runtime_error("The CPU is already running");
-        this->DMEM = DMEM;
+        this->DMEM.assign(DMEM);
+        clearUndoLog();
+    }
+    // Clears DMEM and sets only the given words, so a sparse backend
+    // allocates just the pages they fall in.
+    void loadDMEM(std::span<const std::pair<uint32_t, uint32_t>> words){
+        if (getState() != State::STOPPED)
+            throw std::runtime_error("The CPU is already running");
+        DMEM.clear();
+        for (const auto& [address, value] : words){
+            if (address >= DMEM_SIZE)
+                throw std::out_of_range("DMEM address out of range: " + std::to_string(address));
+            DMEM.store(address, value);
+        }
+        clearUndoLog();
+    }
+
+    // Machine state without the program: DMEM pages are shared with the CPU
+    // and copied by whichever side stores to them first.
+    struct Snapshot{
+        uint32_t PC = 0;
+        uint32_t ACC = 0;
+        bool Z = 0;
+        bool C = 0;
+        Instruction IR = {};
+        size_t step = 0;
+        State state = State::STOPPED;
+        Memory DMEM;
+    };
+
+    Snapshot snapshot() const{
+        return Snapshot{PC, ACC, Z, C, IR, getStep(), getState(), DMEM};
+    }
+    void restore(const Snapshot& snapshot){
+        PC = snapshot.PC;
+        ACC = snapshot.ACC;
+        Z = snapshot.Z;
+        C = snapshot.C;
+        IR = snapshot.IR;
+        DMEM = snapshot.DMEM;
+        restoreSimulation(snapshot.state, snapshot.step);
+        clearUndoLog();
     }
-    void loadIMEM(const std::array<Instruction, DMEM_SIZE>& IMEM){
+    // The fork keeps the program, fusion and JIT settings. A JIT compiler is
+    // shared with the fork, so JIT-enabled forks must run on one thread.
+    // The undo log is not inherited: the fork starts an empty one.
+    std::unique_ptr<CPU> fork() const{
+        auto copy = std::make_unique<CPU>(*this);
+        if (undoLog)
+            copy->undoLog = std::make_shared<UndoLog>(undoLog->capacity());
+        return copy;
+    }
+
+    void loadIMEM(const std::array<Instruction, IMEM_SIZE>& IMEM){
         if (getState() != State::STOPPED)
             throw std::runtime_error("The CPU is already running");
         this->IMEM = IMEM;
+        decodeIMEM();
+        clearUndoLog();
+        specialize();
+        if (jitCompiler)
+            enableJit();
+    }
+
+    bool enableJit(){
+#if defined(CPUEMUL_JIT)
+        if constexpr (Memory::HAS_PAGE_TABLE){
+            jitCompiler = std::make_shared<jit::Compiler>(program.data(), program.size(), DMEM_SIZE,
+                Memory::PAGE_SHIFT);
+            if (!jitCompiler->isReady())
+                jitCompiler.reset();
+        }
+#endif
+        return jitCompiler != nullptr;
+    }
+    void disableJit(){
+        jitCompiler.reset();
+    }
+
+    const FusionReport& enableFusion(){
+        fusion = true;
+        specialize();
+        return fusionReport;
+    }
+    void disableFusion(){
+        fusion = false;
+        specialize();
+    }
+    const FusionReport& getFusionReport() const{return fusionReport;};
+
+    // Runs the counted loops accelerateLoops recognises in closed form.
+    // Results and step counts match plain execution; like fusion it is
+    // bypassed by runUntil and while the undo log records.
+    const LoopReport& enableLoopAcceleration(){
+        loopAcceleration = true;
+        specialize();
+        return loopReport;
+    }
+    void disableLoopAcceleration(){
+        loopAcceleration = false;
+        specialize();
+    }
+    const LoopReport& getLoopReport() const{return loopReport;};
+
+    // Records the state every executed instruction destroys, keeping the
+    // last `capacity` steps (rounded up to a power of two). While enabled,
+    // superinstructions and the JIT are bypassed.
+    void enableUndoLog(size_t capacity){
+        undoLog = std::make_shared<UndoLog>(capacity);
+        undoBaseIR = IR.raw;
+    }
+    void disableUndoLog(){
+        undoLog.reset();
+    }
+    // Once the ring has wrapped, its oldest entry is kept only to recover IR.
+    size_t getUndoDepth() const{
+        return undoLog ? undoLog->size() - undoLog->truncated() : 0;
+    }
+
+    // Both leave the CPU running, even if the undone steps ended in HLT.
+    size_t stepBack(size_t steps = 1){
+        requireUndoLog();
+        size_t undone = 0;
+        for (; undone < steps && getUndoDepth() != 0; ++undone)
+            undo(undoLog->pop());
+        if (undone)
+            restoreSimulation(State::RUNNING, getStep() - undone);
+        return undone;
+    }
+    RunStatus runBackUntil(uint32_t pc, size_t budget = SIZE_MAX){
+        requireUndoLog();
+        for (size_t undone = 0; undone < budget && getUndoDepth() != 0; ++undone){
+            undo(undoLog->pop());
+            restoreSimulation(State::RUNNING, getStep() - 1);
+            if (PC == pc)
+                return RunStatus::BREAKPOINT;
+        }
+        return RunStatus::BUDGET_EXHAUSTED;
     }
     
 private:
 
-    std::array<Instruction, IMEM_SIZE> IMEM{0};
-    std::array<uint32_t, DMEM_SIZE> DMEM{0};
+    std::array<Instruction, IMEM_SIZE> IMEM{};
+    std::array<DecodedInstruction, IMEM_SIZE + 1> program{};
+    Memory DMEM;
 
     uint32_t PC = 0;
     uint32_t ACC = 0;
@@ -82,156 +436,562 @@ private:
     bool Z = 0;
     bool C = 0;
 
-    Instruction IR = {0};
-
+    Instruction IR = {};
 
+#if defined(CPUEMUL_JIT)
+    std::shared_ptr<jit::Compiler> jitCompiler;
+#else
+    std::shared_ptr<void> jitCompiler;
+#endif
 
+    bool fusion = false;
+    FusionReport fusionReport;
+    bool loopAcceleration = false;
+    LoopReport loopReport;
 
-    void onStart(){};
-    void onStep() override{
-        IR = IMEM[PC];
-        execute();
-        ++PC;
-    };
-    void onStop(){};
+    std::shared_ptr<UndoLog> undoLog;
+    uint16_t undoBaseIR = 0;
 
-    void execute(){
-        instructions[IR.fields.code]();
+    Registers loadRegisters() const{
+        return Registers{PC, ACC, Z, C};
     }
-
-    uint32_t getOperand(){
-        return IR.fields.isLiteral ? IR.fields.value : DMEM[IR.fields.value];
+    void storeRegisters(const Registers& r){
+        PC = r.PC;
+        ACC = r.ACC;
+        Z = r.Z;
+        C = r.C;
     }
 
-    void setAcc(uint32_t ACC){
-        this->ACC = ACC;
-        Z = (ACC == 0);
-    }
-    
 
-    void NOP(){
+    void decodeIMEM(){
+        for (size_t i = 0; i < IMEM_SIZE; ++i){
+            Instruction instr = IMEM[i];
+            DecodedInstruction& decoded = program[i];
+            decoded.op = decodeMicroOp(instr.fields.code, instr.fields.isLiteral);
+            decoded.raw = instr.raw;
+            decoded.operand = instr.fields.value;
+
+            if (decoded.op == MicroOp::SHL_L || decoded.op == MicroOp::SHR_L)
+                decoded.operand &= 0b00011111;
+            decoded.base = decoded.op;
+        }
+        program[IMEM_SIZE] = DecodedInstruction{MicroOp::END, MicroOp::END, 0, 0};
     }
 
 
-    void LOAD() {
-        setAcc(getOperand());
-    }
-    void STORE() {
-        DMEM[getOperand()] = ACC;
-    }
-    void LOADI(){
-        setAcc(DMEM[getOperand()]);
+    // Rebuilds every `op` from `base` with the enabled rewrites.
+    void specialize(){
+        std::span<DecodedInstruction> code(program.data(), IMEM_SIZE);
+        for (DecodedInstruction& instr : code)
+            instr.op = instr.base;
+        fusionReport = fusion ? fuseSuperinstructions(code) : FusionReport{};
+        loopReport = loopAcceleration ? accelerateLoops(code, DMEM_SIZE) : LoopReport{};
     }
 
+    void onStart(){
+        clearUndoLog();
+    };
+    void onStep() override final{
+        execute(1);
+    };
+    size_t onRun(size_t maxSteps) override final{
+#if defined(CPUEMUL_JIT)
+        if constexpr (Memory::HAS_PAGE_TABLE){
+            if (jitCompiler && !undoLog)
+                return runJit(maxSteps);
+        }
+#endif
+        return execute(maxSteps);
+    }
+    void onStop(){};
 
-    void ADD() {
-        uint32_t result = ACC + getOperand();
-        C = (result < ACC);
-        setAcc(result);
+    void badInstruction(size_t executed){
+        throw SimulationFault("Bad instruction code: " + std::to_string(IR.fields.code), executed);
     }
-    void SUB() {
-        uint32_t result = ACC - getOperand();
-        C = (result > ACC);
-        setAcc(result);
+    void outOfIMEM(size_t executed){
+        throw SimulationFault("Program counter out of IMEM: " + std::to_string(PC), executed);
     }
-    void INC(){
-        uint32_t result = ACC + 1;
-        C = (result < ACC);
-        setAcc(result);
+    void outOfDMEM(uint32_t address, size_t executed){
+        throw SimulationFault("Address out of DMEM: " + std::to_string(address), executed);
     }
-    void DEC(){
-        uint32_t result = ACC - 1;
-        C = (result > ACC);
-        setAcc(result);
+
+#if defined(CPUEMUL_JIT)
+    size_t runJit(size_t maxSteps){
+        size_t executed = 0;
+        DMEM.detachAll();
+        while (executed < maxSteps && getState() == State::RUNNING){
+            auto result = jitCompiler->run(PC, ACC, Z, C, DMEM.pageTable(), maxSteps - executed);
+            if (result.lastPC != jit::Compiler::NO_PC)
+                IR = IMEM[result.lastPC];
+            executed += result.executed;
+            if (executed == maxSteps)
+                break;
+            try{
+                executed += execute(result.fallback ? 1 : maxSteps - executed);
+            } catch (SimulationFault& fault){
+                fault.addExecuted(executed);
+                throw;
+            }
+        }
+        return executed;
     }
+#endif
 
+    void requireUndoLog() const{
+        if (!undoLog)
+            throw std::runtime_error("The undo log is disabled");
+    }
+    void clearUndoLog(){
+        if (undoLog)
+            undoLog->clear();
+        undoBaseIR = IR.raw;
+    }
 
-    void AND(){
-        setAcc(ACC & getOperand());
+    [[gnu::always_inline]] static void record(UndoLog::Writer& log, const Registers& r){
+        UndoEntry& entry = log.push();
+        entry.PC = r.PC;
+        entry.ACC = r.ACC;
+        entry.flags = 0;
     }
-    void OR(){
-        setAcc(ACC | getOperand());
+    static void saveCarry(UndoLog::Writer& log, const Registers& r){
+        log.last().flags = UndoEntry::C_SAVED | (r.C ? UndoEntry::C : 0);
     }
-    void XOR(){
-        setAcc(ACC ^ getOperand());
+    static void saveCarry(UndoLog::NoWriter&, const Registers&){
     }
-    void NOT(){
-        setAcc(!ACC);
+    // Called with `entry` just popped. IR is not logged: it held the
+    // instruction of the entry below, or undoBaseIR once the log is empty.
+    void undo(const UndoEntry& entry){
+        PC = entry.PC;
+        ACC = entry.ACC;
+        Z = entry.flags & UndoEntry::Z_SAVED ? entry.flags & UndoEntry::Z : ACC == 0;
+        if (entry.flags & UndoEntry::C_SAVED)
+            C = entry.flags & UndoEntry::C;
+        if (isStore(program[PC].base))
+            DMEM.store(entry.address, entry.word);
+        IR.raw = undoLog->empty() ? undoBaseIR : program[undoLog->top().PC].raw;
     }
-    void SHL(){
-        uint8_t shift_count = getOperand() & 0b00011111;
-        if (shift_count > 0) {
-            C = (ACC >> (32 - shift_count)) & 1;
-        } else {
-            C = 0;
-        }
-        setAcc(ACC << shift_count);
+    static constexpr bool isStore(MicroOp op){
+        return op == MicroOp::STORE_L || op == MicroOp::STORE_M;
     }
-    void SHR(){
-        uint8_t shift_count = getOperand() & 0b00011111;
-        if (shift_count > 0) {
-            C = (ACC >> (shift_count - 1)) & 1;
-        } else {
-            C = 0;
+
+    template<class Stop = NeverStop>
+    size_t execute(size_t maxSteps, Stop&& stop = {}){
+        if (!undoLog)
+            return dispatch<false>(maxSteps, std::forward<Stop>(stop));
+
+        // Recording runs in chunks that end where the ring wraps.
+        constexpr bool checkStop = !std::is_same_v<std::remove_cvref_t<Stop>, NeverStop>;
+        bool stopped = false;
+        auto record = [&](size_t steps){
+            if constexpr (checkStop)
+                return dispatch<true>(steps, [&](const CPU& cpu){return stopped = stop(cpu);});
+            else
+                return dispatch<true>(steps);
+        };
+        size_t executed = 0;
+        try{
+            while (executed < maxSteps && !stopped && getState() == State::RUNNING){
+                if (Z == (ACC == 0)){
+                    executed += record(std::min(maxSteps - executed, undoLog->room()));
+                    continue;
+                }
+                // Only reset() and restore() leave Z out of step with ACC, and the
+                // next instruction that writes ACC fixes it. Until then Z is saved
+                // explicitly, one step at a time.
+                uint8_t savedZ = UndoEntry::Z_SAVED | (Z ? UndoEntry::Z : 0);
+                executed += record(1);
+                undoLog->top().flags |= savedZ;
+            }
+        } catch (SimulationFault& fault){
+            fault.addExecuted(executed);
+            throw;
         }
-        setAcc(ACC >> shift_count);
+        return executed;
     }
 
-
-    void JMP(){
-        PC = getOperand() - 1;
-    }
-    void JZ(){
-        if (Z){
-            JMP();
-        }
+#if defined(CPUEMUL_DISPATCH_THREADED)
+    template<bool Record, class Stop = NeverStop>
+    size_t dispatch(size_t maxSteps, Stop&& stop = {}){
+        constexpr bool checkStop = !std::is_same_v<std::remove_cvref_t<Stop>, NeverStop>;
+
+        static void* const handlers[] = {
+            &&op_NOP,
+            &&op_LOAD_L, &&op_LOAD_M,
+            &&op_STORE_L, &&op_STORE_M,
+            &&op_LOADI_L, &&op_LOADI_M,
+            &&op_ADD_L, &&op_ADD_M,
+            &&op_SUB_L, &&op_SUB_M,
+            &&op_INC,
+            &&op_DEC,
+            &&op_AND_L, &&op_AND_M,
+            &&op_OR_L, &&op_OR_M,
+            &&op_XOR_L, &&op_XOR_M,
+            &&op_NOT,
+            &&op_SHL_L, &&op_SHL_M,
+            &&op_SHR_L, &&op_SHR_M,
+            &&op_JMP_L, &&op_JMP_M,
+            &&op_JZ_L, &&op_JZ_M,
+            &&op_JNZ_L, &&op_JNZ_M,
+            &&op_JC_L, &&op_JC_M,
+            &&op_JNC_L, &&op_JNC_M,
+            &&op_LOAD_ADD_STORE_L, &&op_LOAD_ADD_STORE_M,
+            &&op_LOAD_SUB_STORE_L, &&op_LOAD_SUB_STORE_M,
+            &&op_DEC_JNZ,
+            &&op_LOAD_JZ,
+            &&op_LOAD_JNZ,
+            &&op_DELAY_LOOP,
+            &&op_COUNTDOWN_LOOP,
+            &&op_ACCUMULATE_LOOP,
+            &&op_HLT,
+            &&op_BAD,
+            &&op_END,
+        };
+        static_assert(std::size(handlers) == static_cast<size_t>(MicroOp::END) + 1);
+
+        if (maxSteps == 0)
+            return 0;
+
+        size_t executed = 0;
+        Registers r = loadRegisters();
+        const DecodedInstruction* instr = &program[r.PC];
+        std::conditional_t<Record, UndoLog::Writer, UndoLog::NoWriter> log(undoLog.get());
+
+        #define CPU_NEXT() \
+            ++r.PC; \
+            ++executed; \
+            if constexpr (checkStop){ \
+                IR.raw = instr->raw; \
+                storeRegisters(r); \
+                if (stop(*this)) \
+                    return executed; \
+            } \
+            if (executed == maxSteps){ \
+                IR.raw = instr->raw; \
+                storeRegisters(r); \
+                return executed; \
+            } \
+            if constexpr (Record) \
+                record(log, r); \
+            instr = &program[r.PC]; \
+            goto *handlers[static_cast<uint8_t>(instr->op)]
+
+        // Advances to the next entry of a superinstruction; the last entry
+        // is retired by CPU_NEXT so IR and the batch exit stay exact.
+        #define CPU_FUSED_NEXT() \
+            ++r.PC; \
+            ++executed; \
+            ++instr
+
+        // A superinstruction only fires when its whole sequence fits in the
+        // remaining budget and no per-step predicate or undo log has to
+        // observe it.
+        #define CPU_FUSED_GUARD(length, fallback) \
+            if (checkStop || Record || maxSteps - executed < length) \
+                goto fallback
+
+        // An indirect address outside DMEM faults before the instruction
+        // retires, like the END sentinel does.
+        #define CPU_DMEM_GUARD(address) \
+            if ((address) >= DMEM_SIZE){ \
+                if constexpr (Record) \
+                    log.drop(); \
+                IR.raw = instr->raw; \
+                storeRegisters(r); \
+                outOfDMEM(address, executed); \
+                return executed; \
+            }
+
+        if constexpr (Record)
+            record(log, r);
+        goto *handlers[static_cast<uint8_t>(instr->op)];
+
+        op_NOP:     NOP(r);                                            CPU_NEXT();
+        op_LOAD_L:  LOAD(r, instr->operand);                           CPU_NEXT();
+        op_LOAD_M:  LOAD(r, DMEM[instr->operand]);                     CPU_NEXT();
+        op_STORE_L: STORE(r, instr->operand, log);                     CPU_NEXT();
+        op_STORE_M: CPU_DMEM_GUARD(DMEM[instr->operand]);
+                    STORE(r, DMEM[instr->operand], log);               CPU_NEXT();
+        op_LOADI_L: LOADI(r, instr->operand);                          CPU_NEXT();
+        op_LOADI_M: CPU_DMEM_GUARD(DMEM[instr->operand]);
+                    LOADI(r, DMEM[instr->operand]);                    CPU_NEXT();
+        op_ADD_L:   saveCarry(log, r); ADD(r, instr->operand);         CPU_NEXT();
+        op_ADD_M:   saveCarry(log, r); ADD(r, DMEM[instr->operand]);   CPU_NEXT();
+        op_SUB_L:   saveCarry(log, r); SUB(r, instr->operand);         CPU_NEXT();
+        op_SUB_M:   saveCarry(log, r); SUB(r, DMEM[instr->operand]);   CPU_NEXT();
+        op_INC:     saveCarry(log, r); INC(r);                         CPU_NEXT();
+        op_DEC:     saveCarry(log, r); DEC(r);                         CPU_NEXT();
+        op_AND_L:   AND(r, instr->operand);                            CPU_NEXT();
+        op_AND_M:   AND(r, DMEM[instr->operand]);                      CPU_NEXT();
+        op_OR_L:    OR(r, instr->operand);                             CPU_NEXT();
+        op_OR_M:    OR(r, DMEM[instr->operand]);                       CPU_NEXT();
+        op_XOR_L:   XOR(r, instr->operand);                            CPU_NEXT();
+        op_XOR_M:   XOR(r, DMEM[instr->operand]);                      CPU_NEXT();
+        op_NOT:     NOT(r);                                            CPU_NEXT();
+        op_SHL_L:   saveCarry(log, r); SHL(r, instr->operand);         CPU_NEXT();
+        op_SHL_M:   saveCarry(log, r); SHL(r, DMEM[instr->operand]);   CPU_NEXT();
+        op_SHR_L:   saveCarry(log, r); SHR(r, instr->operand);         CPU_NEXT();
+        op_SHR_M:   saveCarry(log, r); SHR(r, DMEM[instr->operand]);   CPU_NEXT();
+        op_JMP_L:   JMP(r, instr->operand);                            CPU_NEXT();
+        op_JMP_M:   JMP(r, DMEM[instr->operand]);                      CPU_NEXT();
+        op_JZ_L:    JZ(r, instr->operand);                             CPU_NEXT();
+        op_JZ_M:    JZ(r, DMEM[instr->operand]);                       CPU_NEXT();
+        op_JNZ_L:   JNZ(r, instr->operand);                            CPU_NEXT();
+        op_JNZ_M:   JNZ(r, DMEM[instr->operand]);                      CPU_NEXT();
+        op_JC_L:    JC(r, instr->operand);                             CPU_NEXT();
+        op_JC_M:    JC(r, DMEM[instr->operand]);                       CPU_NEXT();
+        op_JNC_L:   JNC(r, instr->operand);                            CPU_NEXT();
+        op_JNC_M:   JNC(r, DMEM[instr->operand]);                      CPU_NEXT();
+        op_LOAD_ADD_STORE_L:
+            CPU_FUSED_GUARD(3, op_LOAD_M);
+            LOAD(r, DMEM[instr->operand]);      CPU_FUSED_NEXT();
+            ADD(r, instr->operand);             CPU_FUSED_NEXT();
+            STORE(r, instr->operand);           CPU_NEXT();
+        op_LOAD_ADD_STORE_M:
+            CPU_FUSED_GUARD(3, op_LOAD_M);
+            LOAD(r, DMEM[instr->operand]);      CPU_FUSED_NEXT();
+            ADD(r, DMEM[instr->operand]);       CPU_FUSED_NEXT();
+            STORE(r, instr->operand);           CPU_NEXT();
+        op_LOAD_SUB_STORE_L:
+            CPU_FUSED_GUARD(3, op_LOAD_M);
+            LOAD(r, DMEM[instr->operand]);      CPU_FUSED_NEXT();
+            SUB(r, instr->operand);             CPU_FUSED_NEXT();
+            STORE(r, instr->operand);           CPU_NEXT();
+        op_LOAD_SUB_STORE_M:
+            CPU_FUSED_GUARD(3, op_LOAD_M);
+            LOAD(r, DMEM[instr->operand]);      CPU_FUSED_NEXT();
+            SUB(r, DMEM[instr->operand]);       CPU_FUSED_NEXT();
+            STORE(r, instr->operand);           CPU_NEXT();
+        op_DEC_JNZ:
+            CPU_FUSED_GUARD(2, op_DEC);
+            DEC(r);                             CPU_FUSED_NEXT();
+            JNZ(r, instr->operand);             CPU_NEXT();
+        op_LOAD_JZ:
+            CPU_FUSED_GUARD(2, op_LOAD_M);
+            LOAD(r, DMEM[instr->operand]);      CPU_FUSED_NEXT();
+            JZ(r, instr->operand);              CPU_NEXT();
+        op_LOAD_JNZ:
+            CPU_FUSED_GUARD(2, op_LOAD_M);
+            LOAD(r, DMEM[instr->operand]);      CPU_FUSED_NEXT();
+            JNZ(r, instr->operand);             CPU_NEXT();
+        op_DELAY_LOOP:
+            CPU_FUSED_GUARD(2, op_DEC);
+            instr = runLoop(r, executed, maxSteps, instr);      CPU_NEXT();
+        op_COUNTDOWN_LOOP:
+            CPU_FUSED_GUARD(4, op_LOAD_M);
+            instr = runLoop(r, executed, maxSteps, instr);      CPU_NEXT();
+        op_ACCUMULATE_LOOP:
+            CPU_FUSED_GUARD(7, op_LOAD_M);
+            instr = runLoop(r, executed, maxSteps, instr);      CPU_NEXT();
+        op_HLT:
+            IR.raw = instr->raw;
+            ++r.PC;
+            storeRegisters(r);
+            HLT();
+            return executed + 1;
+        op_BAD:
+            if constexpr (Record)
+                log.drop();
+            IR.raw = instr->raw;
+            storeRegisters(r);
+            badInstruction(executed);
+            return executed;
+        op_END:
+            if constexpr (Record)
+                log.drop();
+            storeRegisters(r);
+            outOfIMEM(executed);
+            return executed;
+
+        #undef CPU_DMEM_GUARD
+        #undef CPU_FUSED_GUARD
+        #undef CPU_FUSED_NEXT
+        #undef CPU_NEXT
     }
-    void JNZ(){
-        if (!Z){
-            JMP();
+#else
+    template<bool Record, class Stop = NeverStop>
+    size_t dispatch(size_t maxSteps, Stop&& stop = {}){
+        constexpr bool checkStop = !std::is_same_v<std::remove_cvref_t<Stop>, NeverStop>;
+
+        size_t executed = 0;
+        Registers r = loadRegisters();
+        std::conditional_t<Record, UndoLog::Writer, UndoLog::NoWriter> log(undoLog.get());
+        while (executed < maxSteps){
+            const DecodedInstruction& instr = program[r.PC];
+            if constexpr (Record)
+                record(log, r);
+            IR.raw = instr.raw;
+            MicroOp op = instr.op;
+            if (checkStop || Record || maxSteps - executed < fusedLength(op))
+                op = instr.base;
+            // An indirect address outside DMEM faults before the instruction
+            // retires, like the END sentinel does.
+            if ((op == MicroOp::STORE_M || op == MicroOp::LOADI_M) && DMEM[instr.operand] >= DMEM_SIZE){
+                if constexpr (Record)
+                    log.drop();
+                storeRegisters(r);
+                outOfDMEM(DMEM[instr.operand], executed);
+                return executed;
+            }
+            switch (op){
+                case MicroOp::NOP:      NOP(r);                                            break;
+                case MicroOp::LOAD_L:   LOAD(r, instr.operand);                            break;
+                case MicroOp::LOAD_M:   LOAD(r, DMEM[instr.operand]);                      break;
+                case MicroOp::STORE_L:  STORE(r, instr.operand, log);                      break;
+                case MicroOp::STORE_M:  STORE(r, DMEM[instr.operand], log);                break;
+                case MicroOp::LOADI_L:  LOADI(r, instr.operand);                           break;
+                case MicroOp::LOADI_M:  LOADI(r, DMEM[instr.operand]);                     break;
+                case MicroOp::ADD_L:    saveCarry(log, r); ADD(r, instr.operand);          break;
+                case MicroOp::ADD_M:    saveCarry(log, r); ADD(r, DMEM[instr.operand]);    break;
+                case MicroOp::SUB_L:    saveCarry(log, r); SUB(r, instr.operand);          break;
+                case MicroOp::SUB_M:    saveCarry(log, r); SUB(r, DMEM[instr.operand]);    break;
+                case MicroOp::INC:      saveCarry(log, r); INC(r);                         break;
+                case MicroOp::DEC:      saveCarry(log, r); DEC(r);                         break;
+                case MicroOp::AND_L:    AND(r, instr.operand);                             break;
+                case MicroOp::AND_M:    AND(r, DMEM[instr.operand]);                       break;
+                case MicroOp::OR_L:     OR(r, instr.operand);                              break;
+                case MicroOp::OR_M:     OR(r, DMEM[instr.operand]);                        break;
+                case MicroOp::XOR_L:    XOR(r, instr.operand);                             break;
+                case MicroOp::XOR_M:    XOR(r, DMEM[instr.operand]);                       break;
+                case MicroOp::NOT:      NOT(r);                                            break;
+                case MicroOp::SHL_L:    saveCarry(log, r); SHL(r, instr.operand);          break;
+                case MicroOp::SHL_M:    saveCarry(log, r); SHL(r, DMEM[instr.operand]);    break;
+                case MicroOp::SHR_L:    saveCarry(log, r); SHR(r, instr.operand);          break;
+                case MicroOp::SHR_M:    saveCarry(log, r); SHR(r, DMEM[instr.operand]);    break;
+                case MicroOp::JMP_L:    JMP(r, instr.operand);                             break;
+                case MicroOp::JMP_M:    JMP(r, DMEM[instr.operand]);                       break;
+                case MicroOp::JZ_L:     JZ(r, instr.operand);                              break;
+                case MicroOp::JZ_M:     JZ(r, DMEM[instr.operand]);                        break;
+                case MicroOp::JNZ_L:    JNZ(r, instr.operand);                             break;
+                case MicroOp::JNZ_M:    JNZ(r, DMEM[instr.operand]);                       break;
+                case MicroOp::JC_L:     JC(r, instr.operand);                              break;
+                case MicroOp::JC_M:     JC(r, DMEM[instr.operand]);                        break;
+                case MicroOp::JNC_L:    JNC(r, instr.operand);                             break;
+                case MicroOp::JNC_M:    JNC(r, DMEM[instr.operand]);                       break;
+                case MicroOp::LOAD_ADD_STORE_L:
+                case MicroOp::LOAD_ADD_STORE_M:
+                case MicroOp::LOAD_SUB_STORE_L:
+                case MicroOp::LOAD_SUB_STORE_M:
+                    dispatchLoadOpStore(r, op, &instr);
+                    r.PC += 2;
+                    executed += 2;
+                    IR.raw = (&instr)[2].raw;
+                    break;
+                case MicroOp::DEC_JNZ:
+                    DEC(r);
+                    ++r.PC;
+                    ++executed;
+                    IR.raw = (&instr)[1].raw;
+                    JNZ(r, (&instr)[1].operand);
+                    break;
+                case MicroOp::LOAD_JZ:
+                case MicroOp::LOAD_JNZ:
+                    LOAD(r, DMEM[instr.operand]);
+                    ++r.PC;
+                    ++executed;
+                    IR.raw = (&instr)[1].raw;
+                    if (op == MicroOp::LOAD_JZ)
+                        JZ(r, (&instr)[1].operand);
+                    else
+                        JNZ(r, (&instr)[1].operand);
+                    break;
+                case MicroOp::DELAY_LOOP:
+                case MicroOp::COUNTDOWN_LOOP:
+                case MicroOp::ACCUMULATE_LOOP:
+                    IR.raw = runLoop(r, executed, maxSteps, &instr)->raw;
+                    break;
+                case MicroOp::HLT:
+                    ++r.PC;
+                    storeRegisters(r);
+                    HLT();
+                    return executed + 1;
+                case MicroOp::BAD:
+                    if constexpr (Record)
+                        log.drop();
+                    storeRegisters(r);
+                    badInstruction(executed);
+                    return executed;
+                case MicroOp::END:
+                    if constexpr (Record)
+                        log.drop();
+                    storeRegisters(r);
+                    outOfIMEM(executed);
+                    return executed;
+            }
+            ++r.PC;
+            ++executed;
+            if constexpr (checkStop){
+                storeRegisters(r);
+                if (stop(*this))
+                    return executed;
+            }
         }
+        storeRegisters(r);
+        return executed;
     }
 
-    void JC(){
-        if (!C){
-            JMP();
+    void dispatchLoadOpStore(Registers& r, MicroOp op, const DecodedInstruction* instr){
+        LOAD(r, DMEM[instr[0].operand]);
+        switch (op){
+            case MicroOp::LOAD_ADD_STORE_L: ADD(r, instr[1].operand);       break;
+            case MicroOp::LOAD_ADD_STORE_M: ADD(r, DMEM[instr[1].operand]); break;
+            case MicroOp::LOAD_SUB_STORE_L: SUB(r, instr[1].operand);       break;
+            default:                        SUB(r, DMEM[instr[1].operand]); break;
         }
+        STORE(r, instr[2].operand);
     }
-    void JNC(){
-        if (!C){
-            JMP();
+#endif
+
+    // Runs as many whole iterations of the loop headed by `instr` as the
+    // budget allows, in closed form (see accelerateLoops). Like the fused
+    // handlers it leaves the PC and `executed` one step short and returns
+    // the last instruction run, the loop's JNZ.
+    const DecodedInstruction* runLoop(Registers& r, size_t& executed, size_t maxSteps, const DecodedInstruction* instr){
+        MicroOp op = instr->op;
+        size_t length = fusedLength(op);
+        uint32_t counterAt = op == MicroOp::ACCUMULATE_LOOP ? instr[3].operand : instr[0].operand;
+        uint32_t counter = op == MicroOp::DELAY_LOOP ? r.ACC : DMEM[counterAt];
+
+        uint64_t iterations = counter ? counter : uint64_t{1} << 32;
+        uint64_t runs = std::min<uint64_t>(iterations, (maxSteps - executed) / length);
+        uint32_t left = counter - static_cast<uint32_t>(runs);
+
+        if (op == MicroOp::ACCUMULATE_LOOP){
+            uint32_t delta = static_cast<uint32_t>(runs) * instr[1].operand;
+            uint32_t word = DMEM[instr[0].operand];
+            DMEM.store(instr[0].operand, instr[1].base == MicroOp::ADD_L ? word + delta : word - delta);
         }
+        if (op != MicroOp::DELAY_LOOP)
+            DMEM.store(counterAt, left);
+        setAcc(r, left);
+        r.C = (left + 1 == 0);
+
+        // A finished loop falls through its JNZ, otherwise it jumps back.
+        r.PC = runs == iterations ? r.PC + length - 1 : r.PC - 1;
+        executed += runs * length - 1;
+        return instr + length - 1;
+    }
+
+    void STORE(Registers& r, uint32_t address) {
+        DMEM.store(address, r.ACC);
+    }
+    void STORE(Registers& r, uint32_t address, UndoLog::Writer& log) {
+        UndoEntry& entry = log.last();
+        entry.address = address;
+        entry.word = DMEM[address];
+        STORE(r, address);
+    }
+    void STORE(Registers& r, uint32_t address, UndoLog::NoWriter&) {
+        STORE(r, address);
+    }
+    void LOADI(Registers& r, uint32_t address){
+        setAcc(r, DMEM[address]);
     }
 
     void HLT(){
         stop();
     }
+};
 
-    const std::function<void()> instructions[20] {
-        [Asm::NOP] = std::bind(&CPU::NOP, this),
-        [Asm::LOAD] = std::bind(&CPU::LOAD, this),
-        [Asm::STORE] = std::bind(&CPU::STORE, this),
-        [Asm::LOADI] = std::bind(&CPU::LOADI, this),
-
-        [Asm::ADD] = std::bind(&CPU::ADD, this),
-        [Asm::SUB] = std::bind(&CPU::SUB, this),
-        [Asm::INC] = std::bind(&CPU::INC, this),
-        [Asm::DEC] = std::bind(&CPU::DEC, this),
-
-        [Asm::AND] = std::bind(&CPU::AND, this),
-        [Asm::OR] = std::bind(&CPU::OR, this),
-        [Asm::XOR] = std::bind(&CPU::XOR, this),
-        [Asm::NOT] = std::bind(&CPU::NOT, this),
-        
-        [Asm::SHL] = std::bind(&CPU::SHL, this),
-        [Asm::SHR] = std::bind(&CPU::SHR, this),
-
-        [Asm::JMP] = std::bind(&CPU::JMP, this),
-        [Asm::JZ] = std::bind(&CPU::JZ, this),
-        [Asm::JNZ] = std::bind(&CPU::JNZ, this),
-        [Asm::JC] = std::bind(&CPU::JC, this),
-        [Asm::JNC] = std::bind(&CPU::JNC, this),
-
-        [Asm::HLT] = std::bind(&CPU::HLT, this),
-    };
-};
\ No newline at end of file
+// A CPU whose DMEM pages are allocated on first store.
+template<uint16_t IMEM_SIZE = 1024, uint32_t DMEM_SIZE = 1024>
+using SparseCPU = CPU<IMEM_SIZE, DMEM_SIZE, SparseMemory<DMEM_SIZE>>;
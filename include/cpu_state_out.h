@@ -117,8 +117,9 @@ namespace coutCPU{
         }
     }
 
-    void logTableRow(const CPU<>& cpu){
-        CPU<>::Instruction ir = cpu.getIR();
+    // Rows end in '\n' so that offline rendering (trace dump) is not bound by
+    // a flush per line; the CPU overload below still flushes every row.
+    void logTableRow(size_t step, uint32_t PC, CPU<>::Instruction ir, uint32_t ACC, bool Z, bool C){
         Assembly line(ir);
         
         std::string assemblyStr = line.toString();
@@ -135,21 +136,44 @@ namespace coutCPU{
         }
         
         if (displaySimulationStep) {
-            std::cout << "| " << std::setw(4) << cpu.getStep() << " | "
-                    << std::setw(4) << cpu.getPC() << " | "
+            std::cout << "| " << std::setw(4) << step << " | "
+                    << std::setw(4) << PC << " | "
                     << std::left << std::setw(6) << mnemonic
                     << std::right << std::setw(5) << operand
-                    << " | " << std::setw(6) << cpu.getACC() << " |   "
-                    << (cpu.getZ() ? 'Z' : ' ') << (cpu.getC() ? 'C' : ' ') << "  |"
-                    << std::endl;
+                    << " | " << std::setw(6) << ACC << " |   "
+                    << (Z ? 'Z' : ' ') << (C ? 'C' : ' ') << "  |"
+                    << '\n';
         } else {
-            std::cout << "| " << std::setw(4) << cpu.getPC() << " | "
+            std::cout << "| " << std::setw(4) << PC << " | "
                     << std::left << std::setw(6) << mnemonic
                     << std::right << std::setw(5) << operand
-                    << " | " << std::setw(6) << cpu.getACC() << " |   "
-                    << (cpu.getZ() ? 'Z' : ' ') << (cpu.getC() ? 'C' : ' ') << "  |"
-                    << std::endl;
+                    << " | " << std::setw(6) << ACC << " |   "
+                    << (Z ? 'Z' : ' ') << (C ? 'C' : ' ') << "  |"
+                    << '\n';
+        }
+    }
+
+    void logTableRow(const CPU<>& cpu){
+        logTableRow(cpu.getStep(), cpu.getPC(), cpu.getIR(), cpu.getACC(), cpu.getZ(), cpu.getC());
+        std::cout.flush();
+    }
+
+    // Registers captured on the simulation thread for rendering elsewhere.
+    struct Frame{
+        size_t step = 0;
+        uint32_t PC = 0;
+        uint32_t ACC = 0;
+        CPU<>::Instruction IR{};
+        bool Z = false;
+        bool C = false;
+
+        static Frame capture(const CPU<>& cpu){
+            return Frame{cpu.getStep(), cpu.getPC(), cpu.getACC(), cpu.getIR(), cpu.getZ(), cpu.getC()};
         }
+    };
+
+    void logTableRow(const Frame& frame){
+        logTableRow(frame.step, frame.PC, frame.IR, frame.ACC, frame.Z, frame.C);
     }
 
     void logTableFooter(){
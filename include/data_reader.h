@@ -1,11 +1,26 @@
+#pragma once
+
 #include <expected>
 #include <array>
+#include <bitset>
+#include <charconv>
+#include <optional>
 #include <string>
-#include <sstream>
-
+#include <string_view>
+#include <unordered_set>
+#include <utility>
 #include <vector>
+
 #include <cstdint>
 
+// Each line of a data file is one of
+//   ADDR VALUE             one word
+//   ADDR: V1 V2 ...        consecutive words starting at ADDR
+//   FIRST..LAST = VALUE    VALUE in every word from FIRST to LAST inclusive
+//   ADDR:x HEX ...         consecutive words starting at ADDR, eight hex
+//                          digits per word, most significant first
+// Numbers take 0x (hex) and 0 (octal) prefixes, `#` starts a comment and
+// blank lines are skipped. Every address may be set only once.
 class DataReader {
 public:
     struct TranslationError {
@@ -18,114 +33,262 @@ public:
             DUPLICATE_ADDRESS,
             UNKNOWN_ERROR
         };
-        
-        static constexpr std::array<std::string_view, 8> stringCodes{
+
+        static constexpr std::array<std::string_view, 7> stringCodes{
             "Invalid format: expected 'ADDRESS VALUE'",
             "Invalid address format",
-            "Invalid value format", 
+            "Invalid value format",
             "Address out of range",
             "Value out of uint32_t range",
             "Duplicate address",
             "Unknown error"
         };
-        
+
         Code code;
         size_t line;
-        
-        
+
+
     };
     static const char* toStr(TranslationError::Code code) {
         return TranslationError::stringCodes[static_cast<size_t>(code)].data();
     }
 
+    using Word = std::pair<uint32_t, uint32_t>;
+
     template<uint32_t DMEM_SIZE>
-    static std::expected<std::array<uint32_t, DMEM_SIZE>, TranslationError> 
-    parseData(const std::string& dataSource) {
+    static std::expected<std::array<uint32_t, DMEM_SIZE>, TranslationError>
+    parseData(std::string_view dataSource) {
         std::array<uint32_t, DMEM_SIZE> result{0};
-        std::istringstream stream(dataSource);
-        std::string line;
+        std::bitset<DMEM_SIZE> usedAddresses;
+        DenseTarget<DMEM_SIZE> target{result, usedAddresses};
+        if (auto error = parseLines<DMEM_SIZE>(dataSource, target))
+            return std::unexpected(*error);
+        return result;
+    }
+
+    // The words the file sets as {address, value} pairs in file order, for
+    // DMEMs too large to hold as an array.
+    template<uint32_t DMEM_SIZE>
+    static std::expected<std::vector<Word>, TranslationError>
+    parseWords(std::string_view dataSource) {
+        SparseTarget target;
+        if (auto error = parseLines<DMEM_SIZE>(dataSource, target))
+            return std::unexpected(*error);
+        return std::move(target.words);
+    }
+
+private:
+    using Code = TranslationError::Code;
+
+    template<uint32_t DMEM_SIZE>
+    struct DenseTarget {
+        std::array<uint32_t, DMEM_SIZE>& words;
+        std::bitset<DMEM_SIZE>& used;
+
+        bool contains(uint32_t address) const {return used[address];}
+        bool insert(uint32_t address, uint32_t value) {
+            if (used[address])
+                return false;
+            words[address] = value;
+            used[address] = true;
+            return true;
+        }
+    };
+
+    struct SparseTarget {
+        std::vector<Word> words;
+        std::unordered_set<uint32_t> used;
+
+        bool contains(uint32_t address) const {return used.contains(address);}
+        bool insert(uint32_t address, uint32_t value) {
+            if (!used.insert(address).second)
+                return false;
+            words.emplace_back(address, value);
+            return true;
+        }
+    };
+
+    template<uint32_t DMEM_SIZE, class Target>
+    static std::optional<TranslationError> parseLines(std::string_view dataSource, Target& target) {
         size_t lineNumber = 0;
-        
-        std::vector<bool> usedAddresses(DMEM_SIZE, false);
-        
-        while (std::getline(stream, line)) {
+        size_t begin = 0;
+        while (begin < dataSource.size()) {
+            size_t end = dataSource.find('\n', begin);
+            if (end == std::string_view::npos)
+                end = dataSource.size();
+            std::string_view line = dataSource.substr(begin, end - begin);
+            begin = end + 1;
             lineNumber++;
-            
-            if (line.size() == 1 && (line[0] == '\n' || line[0] == '\r')) continue;
-            if (line[0] == '#') continue;
-            
-            std::istringstream lineStream(line);
-            std::string addressStr, valueStr;
-            
-            if (!(lineStream >> addressStr >> valueStr)) {
-                return std::unexpected(TranslationError{
-                    TranslationError::Code::INVALID_FORMAT, lineNumber
-                });
-            }
-            
-            std::string extra;
-            if (lineStream >> extra) {
-                return std::unexpected(TranslationError{
-                    TranslationError::Code::INVALID_FORMAT, lineNumber
-                });
+
+            if (auto code = parseLine<DMEM_SIZE>(line, target))
+                return TranslationError{*code, lineNumber};
+        }
+        return std::nullopt;
+    }
+
+    static constexpr size_t HEX_WORD_DIGITS = 8;
+
+    static constexpr bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    // Next whitespace-separated token, or an empty view at the end of the
+    // line or at a comment.
+    static std::string_view nextToken(std::string_view& rest) {
+        size_t begin = 0;
+        while (begin < rest.size() && isSpace(rest[begin]))
+            ++begin;
+        size_t end = begin;
+        while (end < rest.size() && !isSpace(rest[end]))
+            ++end;
+        std::string_view token = rest.substr(begin, end - begin);
+        rest.remove_prefix(end);
+        if (!token.empty() && token[0] == '#') {
+            rest = {};
+            return {};
+        }
+        return token;
+    }
+
+    // Accepts an optional sign like std::stoul: a negative number is
+    // reported as argument_out_of_domain, overflow as result_out_of_range.
+    static std::expected<uint64_t, std::errc> parseNumber(std::string_view token) {
+        bool negative = false;
+        if (!token.empty() && (token[0] == '+' || token[0] == '-')) {
+            negative = token[0] == '-';
+            token.remove_prefix(1);
+        }
+        int base = 10;
+        if (token.size() > 2 && token[0] == '0' && (token[1] == 'x' || token[1] == 'X')) {
+            base = 16;
+            token.remove_prefix(2);
+        } else if (token.size() > 1 && token[0] == '0') {
+            base = 8;
+            token.remove_prefix(1);
+        }
+        uint64_t number;
+        auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), number, base);
+        if (ec == std::errc() && ptr != token.data() + token.size())
+            ec = std::errc::invalid_argument;
+        if (ec != std::errc())
+            return std::unexpected(ec);
+        if (negative && number != 0)
+            return std::unexpected(std::errc::argument_out_of_domain);
+        return number;
+    }
+
+    template<uint32_t DMEM_SIZE>
+    static std::expected<uint32_t, Code> parseAddress(std::string_view token) {
+        auto number = parseNumber(token);
+        if (!number) {
+            return std::unexpected(number.error() == std::errc::invalid_argument
+                ? Code::INVALID_ADDRESS : Code::ADDRESS_OUT_OF_RANGE);
+        }
+        if (*number >= DMEM_SIZE)
+            return std::unexpected(Code::ADDRESS_OUT_OF_RANGE);
+        return static_cast<uint32_t>(*number);
+    }
+
+    static std::expected<uint32_t, Code> parseValue(std::string_view token) {
+        auto number = parseNumber(token);
+        if (!number) {
+            return std::unexpected(number.error() == std::errc::invalid_argument
+                ? Code::INVALID_VALUE : Code::VALUE_OUT_OF_RANGE);
+        }
+        if (*number > UINT32_MAX)
+            return std::unexpected(Code::VALUE_OUT_OF_RANGE);
+        return static_cast<uint32_t>(*number);
+    }
+
+    template<uint32_t DMEM_SIZE, class Target>
+    static std::optional<Code> store(Target& target, uint64_t address, uint32_t value) {
+        if (address >= DMEM_SIZE)
+            return Code::ADDRESS_OUT_OF_RANGE;
+        if (!target.insert(static_cast<uint32_t>(address), value))
+            return Code::DUPLICATE_ADDRESS;
+        return std::nullopt;
+    }
+
+    template<uint32_t DMEM_SIZE, class Target>
+    static std::optional<Code> parseLine(std::string_view line, Target& target) {
+        std::string_view first = nextToken(line);
+        if (first.empty())
+            return std::nullopt;
+
+        if (size_t dots = first.find(".."); dots != std::string_view::npos) {
+            auto from = parseAddress<DMEM_SIZE>(first.substr(0, dots));
+            if (!from)
+                return from.error();
+            auto to = parseAddress<DMEM_SIZE>(first.substr(dots + 2));
+            if (!to)
+                return to.error();
+            if (*to < *from)
+                return Code::INVALID_ADDRESS;
+            std::string_view equals = nextToken(line);
+            std::string_view valueToken = nextToken(line);
+            if (equals != "=" || valueToken.empty() || !nextToken(line).empty())
+                return Code::INVALID_FORMAT;
+            auto value = parseValue(valueToken);
+            if (!value)
+                return value.error();
+            for (uint64_t address = *from; address <= *to; ++address) {
+                if (auto code = store<DMEM_SIZE>(target, address, *value))
+                    return code;
             }
-            
-            uint32_t address;
-            try {
-                size_t pos;
-                address = std::stoul(addressStr, &pos, 0);
-                
-                if (pos != addressStr.length()) {
-                    return std::unexpected(TranslationError{
-                        TranslationError::Code::INVALID_ADDRESS, lineNumber
-                    });
+            return std::nullopt;
+        }
+
+        if (first.ends_with(":x")) {
+            auto address = parseAddress<DMEM_SIZE>(first.substr(0, first.size() - 2));
+            if (!address)
+                return address.error();
+            uint64_t next = *address;
+            for (std::string_view digits = nextToken(line); !digits.empty(); digits = nextToken(line)) {
+                if (digits.size() % HEX_WORD_DIGITS != 0)
+                    return Code::INVALID_VALUE;
+                for (size_t at = 0; at < digits.size(); at += HEX_WORD_DIGITS) {
+                    const char* wordEnd = digits.data() + at + HEX_WORD_DIGITS;
+                    uint32_t value;
+                    auto [ptr, ec] = std::from_chars(digits.data() + at, wordEnd, value, 16);
+                    if (ec != std::errc() || ptr != wordEnd)
+                        return Code::INVALID_VALUE;
+                    if (auto code = store<DMEM_SIZE>(target, next++, value))
+                        return code;
                 }
-            } catch (const std::exception&) {
-                return std::unexpected(TranslationError{
-                    TranslationError::Code::INVALID_ADDRESS, lineNumber
-                });
-            }
-            
-            if (address >= DMEM_SIZE) {
-                return std::unexpected(TranslationError{
-                    TranslationError::Code::ADDRESS_OUT_OF_RANGE, lineNumber
-                });
             }
-            
-            if (usedAddresses[address]) {
-                return std::unexpected(TranslationError{
-                    TranslationError::Code::DUPLICATE_ADDRESS, lineNumber
-                });
-            }
-            
-            uint32_t value;
-            try {
-                size_t pos;
-                unsigned long long tempValue = std::stoull(valueStr, &pos, 0);
-                
-                if (pos != valueStr.length()) {
-                    return std::unexpected(TranslationError{
-                        TranslationError::Code::INVALID_VALUE, lineNumber
-                    });
-                }
-                
-                if (tempValue > UINT32_MAX) {
-                    return std::unexpected(TranslationError{
-                        TranslationError::Code::VALUE_OUT_OF_RANGE, lineNumber
-                    });
-                }
-                
-                value = static_cast<uint32_t>(tempValue);
-            } catch (const std::exception&) {
-                return std::unexpected(TranslationError{
-                    TranslationError::Code::INVALID_VALUE, lineNumber
-                });
+            if (next == *address)
+                return Code::INVALID_FORMAT;
+            return std::nullopt;
+        }
+
+        if (first.ends_with(':')) {
+            auto address = parseAddress<DMEM_SIZE>(first.substr(0, first.size() - 1));
+            if (!address)
+                return address.error();
+            uint64_t next = *address;
+            for (std::string_view token = nextToken(line); !token.empty(); token = nextToken(line)) {
+                auto value = parseValue(token);
+                if (!value)
+                    return value.error();
+                if (auto code = store<DMEM_SIZE>(target, next++, *value))
+                    return code;
             }
-            
-            result[address] = value;
-            usedAddresses[address] = true;
+            if (next == *address)
+                return Code::INVALID_FORMAT;
+            return std::nullopt;
         }
-        
-        return result;
+
+        std::string_view valueToken = nextToken(line);
+        if (valueToken.empty() || !nextToken(line).empty())
+            return Code::INVALID_FORMAT;
+        auto address = parseAddress<DMEM_SIZE>(first);
+        if (!address)
+            return address.error();
+        if (target.contains(*address))
+            return Code::DUPLICATE_ADDRESS;
+        auto value = parseValue(valueToken);
+        if (!value)
+            return value.error();
+        return store<DMEM_SIZE>(target, *address, *value);
     }
-};
\ No newline at end of file
+};
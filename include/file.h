@@ -5,6 +5,8 @@
 #include <array>
 #include <fstream>
 #include <filesystem>
+#include <span>
+#include <string_view>
 
 namespace file{
 
@@ -58,4 +60,35 @@ namespace file{
         }
         return source;
     }
-}
\ No newline at end of file
+
+    // Read-only view of a whole file. Regular files are memory-mapped and
+    // unmapped when the Mapping goes away; pipes, character devices, "-"
+    // (stdin) and files that cannot be mapped are read into an owned buffer.
+    class Mapping{
+    public:
+        Mapping() = default;
+        ~Mapping();
+        Mapping(Mapping&& other) noexcept;
+        Mapping& operator=(Mapping&& other) noexcept;
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+
+        std::string_view view() const{return {data, size};};
+        std::span<const unsigned char> bytes() const{
+            return {reinterpret_cast<const unsigned char*>(data), size};
+        };
+        bool isMapped() const{return mapping != nullptr;};
+
+    private:
+        friend std::expected<Mapping, FileError> map(const std::filesystem::path& filepath);
+
+        void release();
+
+        void* mapping = nullptr;
+        std::string buffer;
+        const char* data = nullptr;
+        size_t size = 0;
+    };
+
+    std::expected<Mapping, FileError> map(const std::filesystem::path& filepath);
+}
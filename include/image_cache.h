@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "cpu.h"
+
+// On-disk cache of flashed IMEM images, keyed by a hash of the assembly
+// source, ASSEMBLER_VERSION, the IMEM and DMEM sizes and whether
+// optimizeAssembly ran. An entry can carry a note, such as the optimizer's
+// report, so a hit prints what the miss did. Entries are written to a
+// temporary file and renamed into place, so processes sharing the directory
+// only ever see complete entries. A hit refreshes the entry's mtime, and
+// stores evict the least recently used entries once the directory grows
+// past `maxBytes`.
+class ImageCache{
+public:
+    // Bump whenever the assembler or flashAssembly may produce a different
+    // image for the same source, so stale entries stop matching.
+    static constexpr uint32_t ASSEMBLER_VERSION = 2;
+    static constexpr uint64_t DEFAULT_MAX_BYTES = uint64_t{64} << 20;
+
+    // $XDG_CACHE_HOME/cpuemul, falling back to $HOME/.cache/cpuemul.
+    static std::optional<std::filesystem::path> defaultDirectory();
+
+    ImageCache(std::filesystem::path directory, uint64_t maxBytes = DEFAULT_MAX_BYTES);
+
+    const std::filesystem::path& getDirectory() const{return directory;};
+
+    template<uint16_t IMEM_SIZE>
+    struct Entry{
+        std::array<CPU<>::Instruction, IMEM_SIZE> image;
+        std::string note;
+    };
+    struct Words{
+        std::vector<uint16_t> words;
+        std::string note;
+    };
+
+    template<uint16_t IMEM_SIZE, uint32_t DMEM_SIZE>
+    std::optional<Entry<IMEM_SIZE>> load(std::string_view source, bool optimized = false) const{
+        auto words = loadWords(source, IMEM_SIZE, DMEM_SIZE, optimized);
+        if (!words)
+            return std::nullopt;
+        Entry<IMEM_SIZE> entry;
+        for (size_t i = 0; i < IMEM_SIZE; ++i)
+            entry.image[i].raw = words->words[i];
+        entry.note = std::move(words->note);
+        return entry;
+    }
+    template<uint16_t IMEM_SIZE, uint32_t DMEM_SIZE>
+    bool store(std::string_view source, const std::array<CPU<>::Instruction, IMEM_SIZE>& image,
+        bool optimized = false, std::string_view note = {}) const{
+        std::array<uint16_t, IMEM_SIZE> words;
+        for (size_t i = 0; i < IMEM_SIZE; ++i)
+            words[i] = image[i].raw;
+        return storeWords(source, words, DMEM_SIZE, optimized, note);
+    }
+
+    // Both fail softly: a missing, foreign or corrupt entry is a miss, and a
+    // failed store leaves the cache as it was.
+    std::optional<Words> loadWords(std::string_view source, size_t count, size_t dmemSize,
+        bool optimized = false) const;
+    bool storeWords(std::string_view source, std::span<const uint16_t> words, size_t dmemSize,
+        bool optimized = false, std::string_view note = {}) const;
+
+    // Removes least recently used entries until the cache fits in maxBytes.
+    void evict() const;
+
+private:
+    std::filesystem::path entryPath(std::string_view source, size_t count, size_t dmemSize, bool optimized) const;
+
+    std::filesystem::path directory;
+    uint64_t maxBytes;
+};
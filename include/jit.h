@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "micro_op.h"
+
+#if defined(CPUEMUL_JIT) && !(defined(__x86_64__) && defined(__linux__))
+    #undef CPUEMUL_JIT
+#endif
+
+namespace jit{
+
+#if defined(CPUEMUL_JIT)
+
+    class Compiler{
+    public:
+        static constexpr uint32_t NO_PC = UINT32_MAX;
+
+        struct Result{
+            size_t executed = 0;
+            uint32_t lastPC = NO_PC;
+            bool fallback = false;
+        };
+
+        // DMEM is reached through a table of pages of 2^pageShift words; every
+        // page must be writable while generated code runs.
+        Compiler(const DecodedInstruction* program, size_t programSize, size_t dmemSize, size_t pageShift);
+        ~Compiler();
+
+        Compiler(const Compiler&) = delete;
+        Compiler& operator=(const Compiler&) = delete;
+
+        bool isReady() const{return code != nullptr;};
+
+        Result run(uint32_t& PC, uint32_t& ACC, bool& Z, bool& C, uint32_t* const* pages, size_t budget);
+
+    private:
+        struct Block{
+            uint8_t* entry = nullptr;
+            uint32_t length = 0;
+            bool compiled = false;
+        };
+
+        void emitRuntime();
+        void reset();
+        Block& blockAt(uint32_t pc);
+        void compile(uint32_t pc);
+        bool isSupported(const DecodedInstruction& instr) const;
+        void emitInstruction(const DecodedInstruction& instr, uint8_t liveFlags);
+        void emitIndirect(const DecodedInstruction& instr, uint8_t liveFlags, uint32_t pc, uint32_t refund, uint32_t lastPC);
+        void emitExit(uint32_t target, uint32_t lastPC);
+        void emitIndirectExit(const DecodedInstruction& instr, uint32_t lastPC);
+        void emitCondition(MicroOp op);
+        void chain(uint8_t* rel32, uint8_t* target);
+
+        void emit(std::initializer_list<uint8_t> bytes);
+        void emit32(uint32_t value);
+
+        std::vector<DecodedInstruction> program;
+        size_t dmemSize;
+        size_t pageShift;
+
+        std::vector<Block> blocks;
+        std::vector<std::vector<uint8_t*>> pendingChains;
+
+        uint8_t* code = nullptr;
+        uint8_t* cursor = nullptr;
+        uint8_t* codeEnd = nullptr;
+        uint8_t* blocksBegin = nullptr;
+        uint8_t* exitStub = nullptr;
+        void (*enter)(void* state, void* entry) = nullptr;
+    };
+
+#endif
+
+    constexpr bool isAvailable(){
+#if defined(CPUEMUL_JIT)
+        return true;
+#else
+        return false;
+#endif
+    }
+}
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <algorithm>
+#include <stdexcept>
+
+#include "cpu.h"
+
+// Runs one IMEM image over LANES independent register files and DMEM images.
+// While every running lane sits on the same PC an instruction is executed for
+// all lanes at once; the lane loops have a constant trip count and blend
+// instead of branch, so they compile to AVX2/AVX-512 when the target allows
+// it (see CPUEMUL_NATIVE). While converged the lanes share one PC and step
+// counter, which are written back to the lanes only at control flow. Lanes
+// that split at a conditional or indirect jump are stepped one at a time
+// until their PCs meet again.
+//
+// Every running lane retires one instruction per round, so a lane ends with
+// the same registers, DMEM and step count as a CPU<> run with the same budget.
+template<uint16_t IMEM_SIZE = 1024, uint32_t DMEM_SIZE = 1024, size_t LANES = 16>
+class LockstepCPU{
+public:
+    using Instruction = typename CPU<IMEM_SIZE, DMEM_SIZE>::Instruction;
+
+    enum class LaneState : uint8_t{
+        RUNNING,
+        HALTED,
+        FAULT
+    };
+
+    static constexpr size_t getLaneCount(){return LANES;};
+
+    LockstepCPU(){
+        decodeIMEM();
+        reset(0);
+    }
+
+    void loadIMEM(const std::array<Instruction, IMEM_SIZE>& IMEM){
+        this->IMEM = IMEM;
+        decodeIMEM();
+    }
+    void loadDMEM(size_t lane, const std::array<uint32_t, DMEM_SIZE>& DMEM){
+        requireLane(lane);
+        for (size_t address = 0; address < DMEM_SIZE; ++address)
+            this->DMEM[address][lane] = DMEM[address];
+    }
+
+    // Clears the registers of every lane and starts the first `lanes` of them.
+    void reset(size_t lanes = LANES){
+        if (lanes > LANES)
+            throw std::out_of_range("Lockstep lane count exceeds " + std::to_string(LANES));
+        PC.fill(0);
+        ACC.fill(0);
+        Z.fill(0);
+        C.fill(0);
+        steps.fill(0);
+        for (size_t lane = 0; lane < LANES; ++lane){
+            active[lane] = lane < lanes;
+            state[lane] = lane < lanes ? LaneState::RUNNING : LaneState::HALTED;
+        }
+        activeCount = lanes;
+        converged = true;
+        sharedPC = 0;
+        pendingSteps = 0;
+    }
+
+    // Executes up to `rounds` instructions on every running lane; returns the
+    // number of rounds in which at least one lane ran.
+    size_t run(size_t rounds){
+        size_t executed = 0;
+        while (executed < rounds && activeCount){
+            if (converged){
+                const DecodedInstruction& instr = program[sharedPC];
+                if (isControl(instr.base)){
+                    flush();
+                    execute<true>(instr, 0);
+                    converge();
+                } else {
+                    if (activeCount == LANES)
+                        execute<true, false>(instr, 0);
+                    else
+                        execute<true>(instr, 0);
+                    ++sharedPC;
+                    ++pendingSteps;
+                }
+            } else {
+                for (size_t lane = 0; lane < LANES; ++lane){
+                    if (active[lane])
+                        execute<false>(program[PC[lane]], lane);
+                }
+                converge();
+            }
+            ++executed;
+        }
+        if (converged)
+            flush();
+        return executed;
+    }
+
+    bool isRunning() const{return activeCount != 0;};
+    bool isConverged() const{return converged;};
+
+    LaneState getLaneState(size_t lane) const{return state[lane];};
+    size_t getStep(size_t lane) const{return steps[lane];};
+    uint32_t getPC(size_t lane) const{return PC[lane];};
+    uint32_t getACC(size_t lane) const{return ACC[lane];};
+    bool getZ(size_t lane) const{return Z[lane];};
+    bool getC(size_t lane) const{return C[lane];};
+    std::array<uint32_t, DMEM_SIZE> getDMEM(size_t lane) const{
+        requireLane(lane);
+        std::array<uint32_t, DMEM_SIZE> result;
+        for (size_t address = 0; address < DMEM_SIZE; ++address)
+            result[address] = DMEM[address][lane];
+        return result;
+    }
+
+private:
+    using Lanes = std::array<uint32_t, LANES>;
+    using Flags = std::array<uint8_t, LANES>;
+
+    std::array<Instruction, IMEM_SIZE> IMEM{};
+    std::array<DecodedInstruction, IMEM_SIZE + 1> program{};
+    std::array<Lanes, DMEM_SIZE> DMEM{};
+
+    Lanes PC{};
+    Lanes ACC{};
+    Flags Z{};
+    Flags C{};
+    Flags active{};
+    std::array<size_t, LANES> steps{};
+    std::array<LaneState, LANES> state{};
+    size_t activeCount = 0;
+
+    bool converged = true;
+    uint32_t sharedPC = 0;
+    size_t pendingSteps = 0;
+
+    void requireLane(size_t lane) const{
+        if (lane >= LANES)
+            throw std::out_of_range("Bad lockstep lane: " + std::to_string(lane));
+    }
+
+    void decodeIMEM(){
+        for (size_t i = 0; i < IMEM_SIZE; ++i){
+            Instruction instr = IMEM[i];
+            DecodedInstruction& decoded = program[i];
+            decoded.op = decodeMicroOp(instr.fields.code, instr.fields.isLiteral);
+            decoded.base = decoded.op;
+            decoded.raw = instr.raw;
+            decoded.operand = instr.fields.value;
+
+            if (decoded.op == MicroOp::SHL_L || decoded.op == MicroOp::SHR_L)
+                decoded.operand &= 0b00011111;
+        }
+        program[IMEM_SIZE] = DecodedInstruction{MicroOp::END, MicroOp::END, 0, 0};
+    }
+
+    static constexpr bool isControl(MicroOp op){
+        switch (op){
+            case MicroOp::JMP_L: case MicroOp::JMP_M:
+            case MicroOp::JZ_L: case MicroOp::JZ_M:
+            case MicroOp::JNZ_L: case MicroOp::JNZ_M:
+            case MicroOp::JC_L: case MicroOp::JC_M:
+            case MicroOp::JNC_L: case MicroOp::JNC_M:
+            case MicroOp::HLT:
+            case MicroOp::BAD:
+            case MicroOp::END:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void flush(){
+        for (size_t lane = 0; lane < LANES; ++lane){
+            PC[lane] = active[lane] ? sharedPC : PC[lane];
+            steps[lane] += active[lane] ? pendingSteps : 0;
+        }
+        pendingSteps = 0;
+    }
+    void converge(){
+        uint32_t pc = UINT32_MAX;
+        for (size_t lane = 0; lane < LANES; ++lane){
+            if (!active[lane])
+                continue;
+            if (pc == UINT32_MAX){
+                pc = PC[lane];
+            } else if (PC[lane] != pc){
+                converged = false;
+                return;
+            }
+        }
+        converged = true;
+        sharedPC = pc;
+    }
+
+    static uint32_t jumpTarget(uint32_t target){
+        return std::min<uint32_t>(target, IMEM_SIZE);
+    }
+
+    // With Vector set the loops cover every lane and, when Masked, inactive
+    // lanes keep their old values through the blends; otherwise only `lane`
+    // runs. Vector data ops leave PC and the step count to the shared counters.
+    template<bool Vector, bool Masked = Vector>
+    void execute(const DecodedInstruction& instr, size_t lane){
+        const size_t begin = Vector ? 0 : lane;
+        const size_t end = Vector ? LANES : lane + 1;
+        const uint32_t a = instr.operand;
+
+        auto keep = [this](size_t l, uint32_t value, uint32_t old) -> uint32_t{
+            if constexpr (Masked)
+                return active[l] ? value : old;
+            else
+                return value;
+        };
+        auto setAcc = [&](size_t l, uint32_t value){
+            ACC[l] = keep(l, value, ACC[l]);
+            Z[l] = keep(l, value == 0, Z[l]);
+        };
+        auto add = [&](size_t l, uint32_t value){
+            uint32_t result = ACC[l] + value;
+            C[l] = keep(l, result < ACC[l], C[l]);
+            setAcc(l, result);
+        };
+        auto sub = [&](size_t l, uint32_t value){
+            uint32_t result = ACC[l] - value;
+            C[l] = keep(l, result > ACC[l], C[l]);
+            setAcc(l, result);
+        };
+        auto shl = [&](size_t l, uint32_t value){
+            uint32_t count = value & 0b00011111;
+            C[l] = keep(l, count > 0 ? (ACC[l] >> (32 - count)) & 1 : 0, C[l]);
+            setAcc(l, ACC[l] << count);
+        };
+        auto shr = [&](size_t l, uint32_t value){
+            uint32_t count = value & 0b00011111;
+            C[l] = keep(l, count > 0 ? (ACC[l] >> (count - 1)) & 1 : 0, C[l]);
+            setAcc(l, ACC[l] >> count);
+        };
+        auto branch = [&](size_t l, bool taken, uint32_t target){
+            PC[l] = keep(l, taken ? jumpTarget(target) : PC[l] + 1, PC[l]);
+        };
+        auto retire = [&]{
+            for (size_t l = begin; l < end; ++l)
+                steps[l] += Masked ? active[l] : 1;
+        };
+        auto next = [&]{
+            for (size_t l = begin; l < end; ++l)
+                PC[l] += Masked ? active[l] : 1;
+            retire();
+        };
+        auto leave = [&](LaneState to){
+            for (size_t l = begin; l < end; ++l){
+                if (Masked && !active[l])
+                    continue;
+                state[l] = to;
+                active[l] = 0;
+                --activeCount;
+            }
+        };
+        // An indirect address outside DMEM faults the lane without retiring
+        // the instruction, as CPU<> does. A converged lane takes the shared
+        // PC and steps with it, since flush() skips lanes that left.
+        auto fault = [&](size_t l){
+            if constexpr (Vector){
+                PC[l] = sharedPC;
+                steps[l] += pendingSteps;
+            }
+            state[l] = LaneState::FAULT;
+            active[l] = 0;
+            --activeCount;
+        };
+
+        switch (instr.base){
+            case MicroOp::NOP:
+                break;
+            case MicroOp::LOAD_L:
+                for (size_t l = begin; l < end; ++l) setAcc(l, a);
+                break;
+            case MicroOp::LOAD_M:
+                for (size_t l = begin; l < end; ++l) setAcc(l, DMEM[a][l]);
+                break;
+            case MicroOp::STORE_L:
+                for (size_t l = begin; l < end; ++l) DMEM[a][l] = keep(l, ACC[l], DMEM[a][l]);
+                break;
+            case MicroOp::STORE_M:
+                for (size_t l = begin; l < end; ++l){
+                    if (Masked && !active[l])
+                        continue;
+                    if (DMEM[a][l] < DMEM_SIZE)
+                        DMEM[DMEM[a][l]][l] = ACC[l];
+                    else
+                        fault(l);
+                }
+                break;
+            case MicroOp::LOADI_L:
+                for (size_t l = begin; l < end; ++l) setAcc(l, DMEM[a][l]);
+                break;
+            case MicroOp::LOADI_M:
+                for (size_t l = begin; l < end; ++l){
+                    if (Masked && !active[l])
+                        continue;
+                    if (DMEM[a][l] < DMEM_SIZE)
+                        setAcc(l, DMEM[DMEM[a][l]][l]);
+                    else
+                        fault(l);
+                }
+                break;
+            case MicroOp::ADD_L:
+                for (size_t l = begin; l < end; ++l) add(l, a);
+                break;
+            case MicroOp::ADD_M:
+                for (size_t l = begin; l < end; ++l) add(l, DMEM[a][l]);
+                break;
+            case MicroOp::SUB_L:
+                for (size_t l = begin; l < end; ++l) sub(l, a);
+                break;
+            case MicroOp::SUB_M:
+                for (size_t l = begin; l < end; ++l) sub(l, DMEM[a][l]);
+                break;
+            case MicroOp::INC:
+                for (size_t l = begin; l < end; ++l) add(l, 1);
+                break;
+            case MicroOp::DEC:
+                for (size_t l = begin; l < end; ++l) sub(l, 1);
+                break;
+            case MicroOp::AND_L:
+                for (size_t l = begin; l < end; ++l) setAcc(l, ACC[l] & a);
+                break;
+            case MicroOp::AND_M:
+                for (size_t l = begin; l < end; ++l) setAcc(l, ACC[l] & DMEM[a][l]);
+                break;
+            case MicroOp::OR_L:
+                for (size_t l = begin; l < end; ++l) setAcc(l, ACC[l] | a);
+                break;
+            case MicroOp::OR_M:
+                for (size_t l = begin; l < end; ++l) setAcc(l, ACC[l] | DMEM[a][l]);
+                break;
+            case MicroOp::XOR_L:
+                for (size_t l = begin; l < end; ++l) setAcc(l, ACC[l] ^ a);
+                break;
+            case MicroOp::XOR_M:
+                for (size_t l = begin; l < end; ++l) setAcc(l, ACC[l] ^ DMEM[a][l]);
+                break;
+            case MicroOp::NOT:
+                for (size_t l = begin; l < end; ++l) setAcc(l, !ACC[l]);
+                break;
+            case MicroOp::SHL_L:
+                for (size_t l = begin; l < end; ++l) shl(l, a);
+                break;
+            case MicroOp::SHL_M:
+                for (size_t l = begin; l < end; ++l) shl(l, DMEM[a][l]);
+                break;
+            case MicroOp::SHR_L:
+                for (size_t l = begin; l < end; ++l) shr(l, a);
+                break;
+            case MicroOp::SHR_M:
+                for (size_t l = begin; l < end; ++l) shr(l, DMEM[a][l]);
+                break;
+
+            // JC shares JNC's condition, mirroring CPU::JC.
+            case MicroOp::JMP_L:
+                for (size_t l = begin; l < end; ++l) branch(l, true, a);
+                retire();
+                return;
+            case MicroOp::JMP_M:
+                for (size_t l = begin; l < end; ++l) branch(l, true, DMEM[a][l]);
+                retire();
+                return;
+            case MicroOp::JZ_L:
+                for (size_t l = begin; l < end; ++l) branch(l, Z[l], a);
+                retire();
+                return;
+            case MicroOp::JZ_M:
+                for (size_t l = begin; l < end; ++l) branch(l, Z[l], DMEM[a][l]);
+                retire();
+                return;
+            case MicroOp::JNZ_L:
+                for (size_t l = begin; l < end; ++l) branch(l, !Z[l], a);
+                retire();
+                return;
+            case MicroOp::JNZ_M:
+                for (size_t l = begin; l < end; ++l) branch(l, !Z[l], DMEM[a][l]);
+                retire();
+                return;
+            case MicroOp::JC_L:
+            case MicroOp::JNC_L:
+                for (size_t l = begin; l < end; ++l) branch(l, !C[l], a);
+                retire();
+                return;
+            case MicroOp::JC_M:
+            case MicroOp::JNC_M:
+                for (size_t l = begin; l < end; ++l) branch(l, !C[l], DMEM[a][l]);
+                retire();
+                return;
+
+            case MicroOp::HLT:
+                next();
+                leave(LaneState::HALTED);
+                return;
+            default:
+                leave(LaneState::FAULT);
+                return;
+        }
+        if constexpr (!Vector){
+            if (active[lane])
+                next();
+        }
+    }
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <format>
+
+#include "micro_op.h"
+
+struct LoopReport{
+    size_t delay = 0;
+    size_t countdown = 0;
+    size_t accumulate = 0;
+
+    size_t total() const{
+        return delay + countdown + accumulate;
+    }
+    std::string toString() const{
+        return std::format("DEC/JNZ: {}, countdown: {}, accumulate: {}", delay, countdown, accumulate);
+    }
+};
+
+// Marks the head of each counted loop whose iterations the CPU can run in
+// closed form. The recognised shapes, with the loop starting at address i:
+//
+//   DELAY_LOOP       DEC, JNZ i
+//   COUNTDOWN_LOOP   LOAD *c, DEC, STORE c, JNZ i
+//   ACCUMULATE_LOOP  LOAD *a, ADD|SUB v, STORE a, LOAD *c, DEC, STORE c, JNZ i
+//
+// with literal v and a != c, both inside DMEM. The counter n runs down to
+// zero, so the loop takes n iterations, or 2^32 when n starts at 0; each
+// iteration leaves ACC = counter, Z = (counter == 0) and the DEC borrow
+// in C, and adds or subtracts v from DMEM[a]. Nothing else in the body can
+// observe or change those words. Like superinstructions, only the head is
+// rewritten and `base` keeps the plain micro-op. Run after
+// fuseSuperinstructions, since a loop head takes precedence over a fused one.
+inline LoopReport accelerateLoops(std::span<DecodedInstruction> program, size_t dmemSize){
+    LoopReport report;
+
+    auto is = [&](size_t at, MicroOp op){
+        return at < program.size() && program[at].base == op;
+    };
+    auto jumpsTo = [&](size_t at, size_t target){
+        return is(at, MicroOp::JNZ_L) && program[at].operand == target;
+    };
+    auto storesTo = [&](size_t at, uint32_t address){
+        return is(at, MicroOp::STORE_L) && program[at].operand == address;
+    };
+
+    for (size_t i = 0; i < program.size(); ++i){
+        if (is(i, MicroOp::DEC) && jumpsTo(i + 1, i)){
+            program[i].op = MicroOp::DELAY_LOOP;
+            ++report.delay;
+            continue;
+        }
+        if (!is(i, MicroOp::LOAD_M) || program[i].operand >= dmemSize)
+            continue;
+        uint32_t first = program[i].operand;
+        if (is(i + 1, MicroOp::DEC) && storesTo(i + 2, first) && jumpsTo(i + 3, i)){
+            program[i].op = MicroOp::COUNTDOWN_LOOP;
+            ++report.countdown;
+            continue;
+        }
+        if ((is(i + 1, MicroOp::ADD_L) || is(i + 1, MicroOp::SUB_L)) && storesTo(i + 2, first)
+            && is(i + 3, MicroOp::LOAD_M) && program[i + 3].operand < dmemSize && program[i + 3].operand != first
+            && is(i + 4, MicroOp::DEC) && storesTo(i + 5, program[i + 3].operand) && jumpsTo(i + 6, i)){
+            program[i].op = MicroOp::ACCUMULATE_LOOP;
+            ++report.accumulate;
+        }
+    }
+    return report;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <format>
+#include <optional>
+#include <string>
+
+#include "cpu.h"
+
+// Ends a run once the machine provably repeats itself. The architectural
+// state is PC, ACC, Z, C and DMEM; DMEM enters as a 64-bit sum of per-word
+// hashes that is updated on every STORE instead of rehashed. The state is
+// compared after every step with one saved at exponentially spaced steps
+// (Brent's cycle detection): a loop of period P entered at step S is
+// reported, with its exact period, by step 2 * max(S, P) + P or so. Like
+// Profiler it observes the CPU through runUntil and leaves the plain run
+// paths untouched.
+template<uint16_t IMEM_SIZE = 1024, uint32_t DMEM_SIZE = 1024, class Memory = PagedMemory<DMEM_SIZE>>
+class LoopDetector{
+public:
+    using Machine = CPU<IMEM_SIZE, DMEM_SIZE, Memory>;
+    using Instruction = typename Machine::Instruction;
+
+    struct Loop{
+        uint32_t PC;
+        size_t step;
+        size_t period;
+
+        std::string toString() const{
+            return std::format("Non-terminating loop detected at PC {} after {} steps (period {} steps)",
+                PC, step, period);
+        }
+    };
+
+    // Runs a started CPU until it halts, `budget` steps pass or its state
+    // repeats. A repeat returns BREAKPOINT and is described by getLoop().
+    // Can be called again on the same CPU to continue the search.
+    Simulator::RunStatus run(Machine& cpu, size_t budget = SIZE_MAX){
+        if (!tracking){
+            for (size_t i = 0; i < IMEM_SIZE; ++i)
+                IMEM[i] = cpu.readIMEM(i);
+            dmemHash = 0;
+            for (uint32_t address = 0; address < DMEM_SIZE; ++address)
+                dmemHash += wordHash(address, cpu.readDMEM(address));
+            saved = capture(cpu);
+            power = 1;
+            distance = 0;
+            loop.reset();
+            tracking = true;
+        }
+
+        std::optional<uint32_t> target = storeTarget(cpu);
+        uint32_t overwritten = target ? cpu.readDMEM(*target) : 0;
+        auto check = [&](const Machine& cpu){
+            if (target)
+                dmemHash += wordHash(*target, cpu.readDMEM(*target)) - wordHash(*target, overwritten);
+            target = storeTarget(cpu);
+            if (target)
+                overwritten = cpu.readDMEM(*target);
+
+            State state = capture(cpu);
+            ++distance;
+            if (state == saved){
+                loop = Loop{state.PC, cpu.getStep(), distance};
+                return true;
+            }
+            if (distance == power){
+                saved = state;
+                power *= 2;
+                distance = 0;
+            }
+            return false;
+        };
+        auto status = cpu.runUntil(check, budget);
+        if (status != Simulator::RunStatus::BUDGET_EXHAUSTED)
+            tracking = false;
+        return status;
+    }
+
+    const std::optional<Loop>& getLoop() const{return loop;};
+
+private:
+    struct State{
+        uint32_t PC;
+        uint32_t ACC;
+        bool Z;
+        bool C;
+        uint64_t dmemHash;
+
+        bool operator==(const State&) const = default;
+    };
+
+    std::array<Instruction, IMEM_SIZE> IMEM{};
+    uint64_t dmemHash = 0;
+    State saved{};
+    size_t power = 1;
+    size_t distance = 0;
+    bool tracking = false;
+    std::optional<Loop> loop;
+
+    State capture(const Machine& cpu) const{
+        return State{cpu.getPC(), cpu.getACC(), cpu.getZ(), cpu.getC(), dmemHash};
+    }
+
+    // splitmix64 of the address and value; zero words hash to zero so an
+    // untouched DMEM costs nothing.
+    static uint64_t wordHash(uint32_t address, uint32_t value){
+        if (value == 0)
+            return 0;
+        uint64_t x = (static_cast<uint64_t>(address) << 32 | value) + 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    // The word the instruction at PC is about to store to, if any.
+    std::optional<uint32_t> storeTarget(const Machine& cpu) const{
+        uint32_t pc = cpu.getPC();
+        if (pc >= IMEM_SIZE || IMEM[pc].fields.code != Asm::STORE)
+            return std::nullopt;
+        uint32_t address = IMEM[pc].fields.value;
+        if (!IMEM[pc].fields.isLiteral){
+            if (address >= DMEM_SIZE)
+                return std::nullopt;
+            address = cpu.readDMEM(address);
+        }
+        if (address >= DMEM_SIZE)
+            return std::nullopt;
+        return address;
+    }
+};
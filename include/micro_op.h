@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+enum class MicroOp : uint8_t {
+    NOP,
+    LOAD_L, LOAD_M,
+    STORE_L, STORE_M,
+    LOADI_L, LOADI_M,
+
+    ADD_L, ADD_M,
+    SUB_L, SUB_M,
+    INC,
+    DEC,
+
+    AND_L, AND_M,
+    OR_L, OR_M,
+    XOR_L, XOR_M,
+    NOT,
+    SHL_L, SHL_M,
+    SHR_L, SHR_M,
+
+    JMP_L, JMP_M,
+    JZ_L, JZ_M,
+    JNZ_L, JNZ_M,
+    JC_L, JC_M,
+    JNC_L, JNC_M,
+
+    LOAD_ADD_STORE_L, LOAD_ADD_STORE_M,
+    LOAD_SUB_STORE_L, LOAD_SUB_STORE_M,
+    DEC_JNZ,
+    LOAD_JZ,
+    LOAD_JNZ,
+
+    DELAY_LOOP,
+    COUNTDOWN_LOOP,
+    ACCUMULATE_LOOP,
+
+    HLT,
+    BAD,
+    END
+};
+
+struct DecodedInstruction{
+    MicroOp op = MicroOp::NOP;
+    MicroOp base = MicroOp::NOP;
+    uint16_t raw = 0;
+    uint32_t operand = 0;
+};
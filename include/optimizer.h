@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <format>
+#include <vector>
+
+#include "assembly.h"
+
+struct OptimizationReport{
+    size_t before = 0;
+    size_t after = 0;
+    size_t unreachable = 0;
+    size_t nops = 0;
+    size_t redundantLoads = 0;
+    size_t redundantStores = 0;
+    size_t identities = 0;
+    size_t dead = 0;
+    size_t folded = 0;
+    size_t branchesResolved = 0;
+    size_t jumpsThreaded = 0;
+    size_t jumpsRemoved = 0;
+    // Set when the program jumps through memory: its targets are addresses
+    // computed at run time, so no instruction may move.
+    bool skipped = false;
+
+    size_t removed() const{
+        return before - after;
+    }
+    std::string toString() const{
+        if (skipped)
+            return "skipped: the program jumps through memory";
+        return std::format("unreachable: {}, NOP: {}, redundant loads: {}, redundant stores: {}, identities: {}, "
+            "dead: {}, folded: {}, branches resolved: {}, jumps threaded: {}, jumps removed: {}",
+            unreachable, nops, redundantLoads, redundantStores, identities,
+            dead, folded, branchesResolved, jumpsThreaded, jumpsRemoved);
+    }
+    // The line the CLI prints, which the image cache keeps for its hits.
+    std::string summary() const{
+        return std::format("Optimized: {} instructions removed ({})\n", removed(), toString());
+    }
+};
+
+// Optional pass between Assembler::translate and flashAssembly. It works on
+// a per-instruction control-flow graph and repeats until nothing changes:
+//
+//   - unreachable code and NOPs are dropped;
+//   - LOAD/LOADI/STORE of a word already equal to ACC, and arithmetic that
+//     leaves ACC, Z and C as they were, are dropped;
+//   - arithmetic on a known ACC and a known operand becomes LOAD of the
+//     result when it fits a literal and the C it would set is never read;
+//   - instructions whose every result is overwritten before being read are
+//     dropped;
+//   - branches on a known flag become JMP or disappear, jumps to a JMP are
+//     retargeted past it, and jumps to the next instruction disappear.
+//
+// Jump targets are then remapped over the removed instructions. On every
+// path the program leaves DMEM, ACC, Z and C as the original would at HLT
+// (or at a fault), only in fewer steps; DMEM starts unknown, since a data
+// file may fill it. Instructions that can fault on an address outside
+// `dmemSize`, STORE through memory and LOADI through memory are never
+// removed, and a program with a memory-operand jump is left as it is.
+OptimizationReport optimizeAssembly(std::vector<Assembly>& program, size_t dmemSize);
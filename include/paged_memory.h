@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <memory>
+#include <algorithm>
+
+// Word-addressed memory split into refcounted pages. Copying a PagedMemory
+// only copies the page table; a page is duplicated on the first store that
+// hits it while another copy still references it.
+//
+// Pages start out as slices of one contiguous arena. While every page is
+// still in the arena, reads go straight through `flat` with no table lookup;
+// the first copy-on-write drops that copy to paged reads. `writable` caches
+// which pages this copy may store to, and copying clears it on both sides;
+// `flatWritable` is set only while the whole arena belongs to this copy.
+template<size_t SIZE>
+class PagedMemory{
+public:
+    static constexpr bool HAS_PAGE_TABLE = true;
+    static constexpr size_t PAGE_SHIFT = 6;
+    static constexpr size_t PAGE_WORDS = size_t{1} << PAGE_SHIFT;
+    static constexpr size_t PAGE_MASK = PAGE_WORDS - 1;
+    static constexpr size_t PAGE_COUNT = (SIZE + PAGE_WORDS - 1) / PAGE_WORDS;
+
+    PagedMemory(){
+        clear();
+    }
+    PagedMemory(const PagedMemory& other)
+        : flat(other.flat), data(other.data), pages(other.pages){
+        other.flatWritable = nullptr;
+        other.writable.fill(nullptr);
+    }
+    PagedMemory& operator=(const PagedMemory& other){
+        if (this != &other){
+            flat = other.flat;
+            data = other.data;
+            pages = other.pages;
+            flatWritable = nullptr;
+            writable.fill(nullptr);
+            other.flatWritable = nullptr;
+            other.writable.fill(nullptr);
+        }
+        return *this;
+    }
+
+    uint32_t operator[](size_t address) const{
+        if (flat)
+            return flat[address];
+        return data[address >> PAGE_SHIFT][address & PAGE_MASK];
+    }
+    void store(size_t address, uint32_t value){
+        if (flatWritable){
+            flatWritable[address] = value;
+            return;
+        }
+        size_t page = address >> PAGE_SHIFT;
+        uint32_t* words = writable[page];
+        if (!words)
+            words = detach(page);
+        words[address & PAGE_MASK] = value;
+    }
+
+    void clear(){
+        std::shared_ptr<uint32_t[]> arena = std::make_shared<uint32_t[]>(PAGE_COUNT * PAGE_WORDS);
+        flat = arena.get();
+        flatWritable = flat;
+        for (size_t page = 0; page < PAGE_COUNT; ++page){
+            data[page] = flat + page * PAGE_WORDS;
+            pages[page] = std::shared_ptr<uint32_t[]>(arena, data[page]);
+            writable[page] = data[page];
+        }
+    }
+    void assign(const std::array<uint32_t, SIZE>& words){
+        clear();
+        std::ranges::copy(words, flat);
+    }
+    std::array<uint32_t, SIZE> toArray() const{
+        std::array<uint32_t, SIZE> words;
+        for (size_t page = 0; page < PAGE_COUNT; ++page){
+            size_t begin = page * PAGE_WORDS;
+            size_t count = std::min(PAGE_WORDS, SIZE - begin);
+            std::copy_n(data[page], count, words.begin() + begin);
+        }
+        return words;
+    }
+
+    // Makes every page private, so the table can be written through directly
+    // (the JIT does) until the memory is copied again.
+    void detachAll(){
+        for (size_t page = 0; page < PAGE_COUNT; ++page){
+            if (!writable[page])
+                detach(page);
+        }
+    }
+    uint32_t* const* pageTable(){return data.data();};
+    // A page's words. A store after the memory was copied moves the page,
+    // so an unchanged pointer means an unchanged page.
+    const uint32_t* page(size_t index) const{return data[index];};
+
+private:
+    uint32_t* flat = nullptr;
+    mutable uint32_t* flatWritable = nullptr;
+    std::array<uint32_t*, PAGE_COUNT> data{};
+    std::array<std::shared_ptr<uint32_t[]>, PAGE_COUNT> pages{};
+    mutable std::array<uint32_t*, PAGE_COUNT> writable{};
+
+    [[gnu::noinline]] uint32_t* detach(size_t page){
+        if (pages[page].use_count() != 1){
+            auto copy = std::make_shared_for_overwrite<uint32_t[]>(PAGE_WORDS);
+            std::copy_n(data[page], PAGE_WORDS, copy.get());
+            pages[page] = std::move(copy);
+            data[page] = pages[page].get();
+            flat = nullptr;
+        }
+        writable[page] = data[page];
+        return data[page];
+    }
+};
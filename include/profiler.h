@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <array>
+#include <format>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "assembly.h"
+#include "cpu.h"
+
+// Counts executions per IMEM address and per opcode, taken/not-taken per
+// branch and reads/writes per DMEM address. It observes the CPU through
+// runUntil, so the plain run paths carry no counters at all.
+template<uint16_t IMEM_SIZE = 1024, uint32_t DMEM_SIZE = 1024>
+class Profiler{
+public:
+    using Machine = CPU<IMEM_SIZE, DMEM_SIZE>;
+    using Instruction = typename Machine::Instruction;
+
+    static constexpr size_t OPCODE_COUNT = Asm::HLT + 1;
+    static constexpr size_t TOP_LOOPS = 5;
+    static constexpr size_t TOP_LOCATIONS = 10;
+
+    Profiler() : hits(IMEM_SIZE), taken(IMEM_SIZE), notTaken(IMEM_SIZE), reads(DMEM_SIZE), writes(DMEM_SIZE){}
+
+    // Runs a started CPU until it halts or `budget` steps pass.
+    Simulator::RunStatus run(Machine& cpu, size_t budget = SIZE_MAX){
+        for (size_t i = 0; i < IMEM_SIZE; ++i)
+            IMEM[i] = cpu.readIMEM(i);
+
+        // Memory accesses are resolved before the instruction runs, since an
+        // indirect STORE may overwrite its own pointer, and counted once it
+        // retires, so an instruction the budget or a fault stops is not.
+        std::optional<Pending> pending = fetch(cpu);
+        size_t start = cpu.getStep();
+        size_t counted = start;
+        auto count = [&](const Machine& cpu){
+            if (pending){
+                uint32_t pc = pending->pc;
+                uint16_t code = IMEM[pc].fields.code;
+                ++hits[pc];
+                if (code < OPCODE_COUNT)
+                    ++opcodes[code];
+                if (code >= Asm::JMP && code <= Asm::JNC)
+                    ++(cpu.getPC() == pc + 1 ? notTaken : taken)[pc];
+                for (size_t i = 0; i < pending->readCount; ++i)
+                    ++reads[pending->reads[i]];
+                if (pending->write)
+                    ++writes[*pending->write];
+            }
+            counted = cpu.getStep();
+            pending = fetch(cpu);
+            return false;
+        };
+        auto status = cpu.runUntil(count, budget);
+        // The halting step ends the run without consulting the predicate.
+        if (cpu.getStep() != counted)
+            count(cpu);
+        steps += cpu.getStep() - start;
+        return status;
+    }
+
+    // Annotated listing, opcode histogram, hottest loops and DMEM locations.
+    std::string report() const{
+        std::string out = std::format("Profile: {} steps\n\n", steps);
+
+        size_t end = 0;
+        for (size_t i = 0; i < IMEM_SIZE; ++i){
+            if (IMEM[i].raw != 0 || hits[i] != 0)
+                end = i + 1;
+        }
+        out += std::format("{:>5}  {:>12}  {:>6}  {:>21}  {}\n", "ADDR", "HITS", "%", "TAKEN/NOT TAKEN", "INSTRUCTION");
+        for (size_t i = 0; i < end; ++i){
+            std::string branch;
+            if (taken[i] || notTaken[i])
+                branch = std::format("{}/{}", taken[i], notTaken[i]);
+            out += std::format("{:>5}  {:>12}  {:>6.2f}  {:>21}  {}\n",
+                i, hits[i], percent(hits[i]), branch, Assembly(toCPU(IMEM[i])).toString());
+        }
+
+        out += "\nOpcodes:\n";
+        std::vector<size_t> order(OPCODE_COUNT);
+        for (size_t i = 0; i < OPCODE_COUNT; ++i)
+            order[i] = i;
+        std::ranges::stable_sort(order, std::greater{}, [this](size_t code){return opcodes[code];});
+        for (size_t code : order){
+            if (opcodes[code] == 0)
+                break;
+            out += std::format("  {:<6} {:>12}  {:>6.2f}%\n", mnemonic(code), opcodes[code], percent(opcodes[code]));
+        }
+
+        out += "\nHottest loops:\n";
+        for (const Loop& loop : hottestLoops()){
+            out += std::format("  {:>4}..{:<4} {:>12} steps  {:>6.2f}%  {} iterations\n",
+                loop.begin, loop.end, loop.steps, percent(loop.steps), loop.iterations);
+        }
+
+        out += "\nHottest DMEM locations:\n";
+        std::vector<size_t> locations;
+        for (size_t i = 0; i < DMEM_SIZE; ++i){
+            if (reads[i] || writes[i])
+                locations.push_back(i);
+        }
+        std::ranges::stable_sort(locations, std::greater{}, [this](size_t i){return reads[i] + writes[i];});
+        if (locations.size() > TOP_LOCATIONS)
+            locations.resize(TOP_LOCATIONS);
+        for (size_t i : locations)
+            out += std::format("  [{:>4}] {:>12} reads {:>12} writes\n", i, reads[i], writes[i]);
+        return out;
+    }
+
+private:
+    // The instruction about to run and the DMEM words it will touch.
+    struct Pending{
+        uint32_t pc = 0;
+        std::array<uint32_t, 2> reads{};
+        size_t readCount = 0;
+        std::optional<uint32_t> write;
+    };
+
+    // A backward branch that was taken, and the IMEM range it repeats.
+    struct Loop{
+        size_t begin;
+        size_t end;
+        uint64_t steps;
+        uint64_t iterations;
+    };
+
+    std::array<Instruction, IMEM_SIZE> IMEM{};
+    std::vector<uint64_t> hits;
+    std::vector<uint64_t> taken;
+    std::vector<uint64_t> notTaken;
+    std::vector<uint64_t> reads;
+    std::vector<uint64_t> writes;
+    std::array<uint64_t, OPCODE_COUNT> opcodes{};
+    uint64_t steps = 0;
+
+    std::optional<Pending> fetch(const Machine& cpu){
+        uint32_t pc = cpu.getPC();
+        if (pc >= IMEM_SIZE)
+            return std::nullopt;
+        Pending pending;
+        pending.pc = pc;
+        Instruction instr = IMEM[pc];
+        uint16_t code = instr.fields.code;
+        uint32_t value = instr.fields.value;
+        bool hasOperand = code != Asm::NOP && code != Asm::HLT && code != Asm::INC
+            && code != Asm::DEC && code != Asm::NOT && code < OPCODE_COUNT;
+        if (!hasOperand)
+            return pending;
+
+        std::optional<uint32_t> operand = value;
+        if (!instr.fields.isLiteral){
+            operand = read(cpu, value, pending);
+        }
+        if (code == Asm::LOADI && operand)
+            read(cpu, *operand, pending);
+        if (code == Asm::STORE && operand && *operand < DMEM_SIZE)
+            pending.write = *operand;
+        return pending;
+    }
+    std::optional<uint32_t> read(const Machine& cpu, uint32_t address, Pending& pending){
+        if (address >= DMEM_SIZE)
+            return std::nullopt;
+        pending.reads[pending.readCount++] = address;
+        return cpu.readDMEM(address);
+    }
+
+    std::vector<Loop> hottestLoops() const{
+        std::vector<Loop> loops;
+        for (size_t i = 0; i < IMEM_SIZE; ++i){
+            if (!taken[i] || IMEM[i].fields.code < Asm::JMP || IMEM[i].fields.code > Asm::JNC)
+                continue;
+            // Only literal targets give a static loop range.
+            if (!IMEM[i].fields.isLiteral || IMEM[i].fields.value > i)
+                continue;
+            Loop loop{IMEM[i].fields.value, i, 0, taken[i]};
+            for (size_t j = loop.begin; j <= loop.end; ++j)
+                loop.steps += hits[j];
+            loops.push_back(loop);
+        }
+        std::ranges::stable_sort(loops, std::greater{}, &Loop::steps);
+        if (loops.size() > TOP_LOOPS)
+            loops.resize(TOP_LOOPS);
+        return loops;
+    }
+
+    double percent(uint64_t count) const{
+        return steps ? 100.0 * count / steps : 0.0;
+    }
+    static CPU<>::Instruction toCPU(Instruction instr){
+        CPU<>::Instruction result;
+        result.raw = instr.raw;
+        return result;
+    }
+    static std::string mnemonic(size_t code){
+        Assembly line;
+        line.instructionCode = code;
+        std::string text = line.toString();
+        return text.substr(0, text.find(' '));
+    }
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <expected>
+#include <filesystem>
+#include <span>
+#include <string>
+
+#include "cpu.h"
+
+// Versioned binary file holding a flashed IMEM and an initial DMEM, written
+// by `CPUemul assemble` and memory-mapped by `CPUemul run`.
+//
+// Layout, all integers little-endian:
+//   header   magic "CPUPROGM", version, IMEM size, DMEM size, stored IMEM
+//            words, DMEM run count, payload bytes, FNV-1a of the payload
+//   payload  IMEM words (u16) with trailing zero words dropped, padded to 4
+//            bytes, then DMEM runs of {u32 address, u32 length, u32 words...};
+//            DMEM outside every run is zero.
+namespace image{
+
+    enum class ImageError {
+        CannotOpen,
+        WriteError,
+        BadHeader,
+        SizeMismatch,
+        Truncated,
+        BadChecksum
+    };
+
+    static constexpr std::array<std::string, 6> imageErrorStringCodes{
+        "CannotOpen",
+        "WriteError",
+        "BadHeader",
+        "SizeMismatch",
+        "Truncated",
+        "BadChecksum"
+    };
+
+    inline std::string toStr(ImageError code) {return imageErrorStringCodes[static_cast<uint64_t>(code)];};
+
+    static constexpr uint32_t VERSION = 1;
+
+    // True when `path` starts with the image magic.
+    bool isImage(const std::filesystem::path& path);
+
+    // Returns the number of bytes written.
+    std::expected<size_t, ImageError> write(const std::filesystem::path& path,
+        std::span<const uint16_t> IMEM, std::span<const uint32_t> DMEM);
+    // The image's memory sizes must match the spans exactly.
+    std::expected<void, ImageError> read(const std::filesystem::path& path,
+        std::span<uint16_t> IMEM, std::span<uint32_t> DMEM);
+
+    template<uint16_t IMEM_SIZE, uint32_t DMEM_SIZE>
+    struct Program{
+        std::array<typename CPU<IMEM_SIZE, DMEM_SIZE>::Instruction, IMEM_SIZE> IMEM;
+        std::array<uint32_t, DMEM_SIZE> DMEM;
+    };
+
+    template<uint16_t IMEM_SIZE, uint32_t DMEM_SIZE>
+    std::expected<size_t, ImageError> save(const std::filesystem::path& path,
+        const std::array<typename CPU<IMEM_SIZE, DMEM_SIZE>::Instruction, IMEM_SIZE>& IMEM,
+        const std::array<uint32_t, DMEM_SIZE>& DMEM){
+        std::array<uint16_t, IMEM_SIZE> words;
+        for (size_t i = 0; i < IMEM_SIZE; ++i)
+            words[i] = IMEM[i].raw;
+        return write(path, words, DMEM);
+    }
+
+    template<uint16_t IMEM_SIZE, uint32_t DMEM_SIZE>
+    std::expected<Program<IMEM_SIZE, DMEM_SIZE>, ImageError> load(const std::filesystem::path& path){
+        std::array<uint16_t, IMEM_SIZE> words;
+        Program<IMEM_SIZE, DMEM_SIZE> program;
+        if (auto loaded = read(path, words, program.DMEM); !loaded)
+            return std::unexpected(loaded.error());
+        for (size_t i = 0; i < IMEM_SIZE; ++i)
+            program.IMEM[i].raw = words[i];
+        return program;
+    }
+}
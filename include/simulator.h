@@ -1,12 +1,47 @@
 #pragma once
 
 #include <stdexcept>
+#include <functional>
+#include <string>
+
+// Thrown when the simulated machine faults. Carries the steps retired
+// before the faulting one, so a run still counts them.
+class SimulationFault : public std::runtime_error{
+public:
+    SimulationFault(const std::string& message, size_t executed) : std::runtime_error(message), executed(executed){};
+
+    size_t getExecuted() const{return executed;};
+    void addExecuted(size_t steps){executed += steps;};
+private:
+    size_t executed;
+};
 
 class Simulator{
 protected:
     void virtual onStep() = 0;
     void virtual onStart() = 0;
     void virtual onStop() = 0;
+    size_t virtual onRun(size_t maxSteps){
+        size_t executed = 0;
+        try{
+            while (executed < maxSteps && state == State::RUNNING){
+                onStep();
+                ++executed;
+            }
+        } catch (SimulationFault& fault){
+            fault.addExecuted(executed);
+            throw;
+        }
+        return executed;
+    }
+
+    void requireRunning() const{
+        if (state != State::RUNNING)
+            throw std::runtime_error("The simulation is not running");
+    }
+    void advanceStep(size_t executed){
+        currentStep += executed;
+    }
 public:
 
     enum class State{
@@ -14,6 +49,12 @@ public:
         RUNNING
     };
 
+    enum class RunStatus{
+        HALTED,
+        BUDGET_EXHAUSTED,
+        BREAKPOINT
+    };
+
     Simulator(){};
     
     size_t getStep() const{return currentStep;};
@@ -33,14 +74,41 @@ public:
         state = State::STOPPED;
     }
     bool step(){
-        if (state != State::RUNNING)
-            throw std::runtime_error("The simulation is not running");
+        requireRunning();
         onStep();
         currentStep++;
         if (state == State::STOPPED)
             return false;
         return true;
     }
+    RunStatus runFor(size_t steps){
+        requireRunning();
+        try{
+            currentStep += onRun(steps);
+        } catch (const SimulationFault& fault){
+            currentStep += fault.getExecuted();
+            throw;
+        }
+        return state == State::RUNNING ? RunStatus::BUDGET_EXHAUSTED : RunStatus::HALTED;
+    }
+    RunStatus runUntilHalt(size_t budget){
+        return runFor(budget);
+    }
+    RunStatus runUntil(const std::function<bool()>& predicate, size_t budget){
+        requireRunning();
+        for (size_t executed = 0; executed < budget; ++executed){
+            if (!step())
+                return RunStatus::HALTED;
+            if (predicate())
+                return RunStatus::BREAKPOINT;
+        }
+        return RunStatus::BUDGET_EXHAUSTED;
+    }
+protected:
+    void restoreSimulation(State state, size_t step){
+        this->state = state;
+        currentStep = step;
+    }
 private:
     size_t currentStep = 0;
     State state = State::STOPPED;
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+// Word-addressed memory for address spaces too large to allocate up front.
+// Every page starts out mapped to one shared page of zeros and is only
+// allocated by the first store that hits it, so untouched memory costs a
+// page-table entry and reads as zero. Copies share pages copy-on-write the
+// same way PagedMemory does.
+//
+// A CPU built on SparseMemory runs on the interpreter only: the JIT needs
+// every page to be writable in place.
+template<size_t SIZE>
+class SparseMemory{
+public:
+    static constexpr bool HAS_PAGE_TABLE = false;
+    static constexpr size_t PAGE_SHIFT = 10;
+    static constexpr size_t PAGE_WORDS = size_t{1} << PAGE_SHIFT;
+    static constexpr size_t PAGE_MASK = PAGE_WORDS - 1;
+    static constexpr size_t PAGE_COUNT = (SIZE + PAGE_WORDS - 1) / PAGE_WORDS;
+
+    SparseMemory()
+        : data(PAGE_COUNT, zeroPage()), pages(PAGE_COUNT), writable(PAGE_COUNT, nullptr){}
+    SparseMemory(const SparseMemory& other)
+        : data(other.data), pages(other.pages), writable(PAGE_COUNT, nullptr){
+        std::ranges::fill(other.writable, nullptr);
+    }
+    SparseMemory& operator=(const SparseMemory& other){
+        if (this != &other){
+            data = other.data;
+            pages = other.pages;
+            std::ranges::fill(writable, nullptr);
+            std::ranges::fill(other.writable, nullptr);
+        }
+        return *this;
+    }
+
+    uint32_t operator[](size_t address) const{
+        return data[address >> PAGE_SHIFT][address & PAGE_MASK];
+    }
+    void store(size_t address, uint32_t value){
+        size_t page = address >> PAGE_SHIFT;
+        uint32_t* words = writable[page];
+        if (!words)
+            words = detach(page);
+        words[address & PAGE_MASK] = value;
+    }
+
+    void clear(){
+        std::ranges::fill(data, zeroPage());
+        std::ranges::fill(pages, nullptr);
+        std::ranges::fill(writable, nullptr);
+    }
+    // Only pages holding a non-zero word are allocated.
+    void assign(const std::array<uint32_t, SIZE>& words){
+        clear();
+        for (size_t page = 0; page < PAGE_COUNT; ++page){
+            size_t begin = page * PAGE_WORDS;
+            size_t count = std::min(PAGE_WORDS, SIZE - begin);
+            auto source = words.begin() + begin;
+            if (std::all_of(source, source + count, [](uint32_t word){return word == 0;}))
+                continue;
+            std::copy_n(source, count, detach(page));
+        }
+    }
+    std::array<uint32_t, SIZE> toArray() const{
+        std::array<uint32_t, SIZE> words;
+        for (size_t page = 0; page < PAGE_COUNT; ++page){
+            size_t begin = page * PAGE_WORDS;
+            size_t count = std::min(PAGE_WORDS, SIZE - begin);
+            std::copy_n(data[page], count, words.begin() + begin);
+        }
+        return words;
+    }
+
+    // A page's words. A store after the memory was copied moves the page,
+    // so an unchanged pointer means an unchanged page.
+    const uint32_t* page(size_t index) const{return data[index];};
+
+    // Pages backed by their own storage rather than the zero page.
+    size_t getAllocatedPages() const{
+        return std::ranges::count_if(pages, [](const auto& page){return page != nullptr;});
+    }
+
+private:
+    std::vector<const uint32_t*> data;
+    std::vector<std::shared_ptr<uint32_t[]>> pages;
+    mutable std::vector<uint32_t*> writable;
+
+    static const uint32_t* zeroPage(){
+        static const std::array<uint32_t, PAGE_WORDS> zeros{};
+        return zeros.data();
+    }
+
+    [[gnu::noinline]] uint32_t* detach(size_t page){
+        if (!pages[page] || pages[page].use_count() != 1){
+            auto copy = std::make_shared_for_overwrite<uint32_t[]>(PAGE_WORDS);
+            std::copy_n(data[page], PAGE_WORDS, copy.get());
+            pages[page] = std::move(copy);
+            data[page] = pages[page].get();
+        }
+        writable[page] = pages[page].get();
+        return writable[page];
+    }
+};
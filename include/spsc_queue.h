@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <new>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. `head` is only written by the producer and `tail` only by the
+// consumer; each side publishes with release and reads the other with acquire.
+template<class T, size_t CAPACITY>
+class SpscQueue{
+    static_assert(std::has_single_bit(CAPACITY), "SpscQueue capacity must be a power of two");
+
+public:
+    bool tryPush(const T& value){
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - cachedTail == CAPACITY){
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h - cachedTail == CAPACITY)
+                return false;
+        }
+        slots[h & MASK] = value;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    // Blocks while the queue is full.
+    void push(const T& value){
+        while (!tryPush(value))
+            tail.wait(cachedTail, std::memory_order_acquire);
+    }
+
+    bool tryPop(T& value){
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == cachedHead){
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t == cachedHead)
+                return false;
+        }
+        value = slots[t & MASK];
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+        return true;
+    }
+
+private:
+    static constexpr size_t MASK = CAPACITY - 1;
+    static constexpr size_t LINE = 64;
+
+    alignas(LINE) std::atomic<size_t> head{0};
+    size_t cachedTail = 0;
+    alignas(LINE) std::atomic<size_t> tail{0};
+    size_t cachedHead = 0;
+    alignas(LINE) std::array<T, CAPACITY> slots{};
+};
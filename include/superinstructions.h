@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <format>
+
+#include "micro_op.h"
+
+struct FusionReport{
+    size_t loadAddStore = 0;
+    size_t loadSubStore = 0;
+    size_t decJnz = 0;
+    size_t loadBranch = 0;
+
+    size_t total() const{
+        return loadAddStore + loadSubStore + decJnz + loadBranch;
+    }
+    std::string toString() const{
+        return std::format("LOAD/ADD/STORE: {}, LOAD/SUB/STORE: {}, DEC/JNZ: {}, LOAD/JZ|JNZ: {}",
+            loadAddStore, loadSubStore, decJnz, loadBranch);
+    }
+};
+
+constexpr size_t fusedLength(MicroOp op){
+    switch (op){
+        case MicroOp::LOAD_ADD_STORE_L:
+        case MicroOp::LOAD_ADD_STORE_M:
+        case MicroOp::LOAD_SUB_STORE_L:
+        case MicroOp::LOAD_SUB_STORE_M:
+            return 3;
+        case MicroOp::DEC_JNZ:
+        case MicroOp::LOAD_JZ:
+        case MicroOp::LOAD_JNZ:
+        case MicroOp::DELAY_LOOP:
+            return 2;
+        case MicroOp::COUNTDOWN_LOOP:
+            return 4;
+        case MicroOp::ACCUMULATE_LOOP:
+            return 7;
+        default:
+            return 1;
+    }
+}
+
+// Rewrites the head of each recognised sequence into a superinstruction.
+// The following entries are left untouched: fused handlers read their
+// operands from them, and jumps into the middle of a sequence still run
+// the plain instructions. `base` always keeps the unfused micro-op.
+inline FusionReport fuseSuperinstructions(std::span<DecodedInstruction> program){
+    FusionReport report;
+
+    for (DecodedInstruction& instr : program)
+        instr.op = instr.base;
+
+    for (size_t i = 0; i + 1 < program.size(); ++i){
+        MicroOp first = program[i].base;
+        MicroOp second = program[i + 1].base;
+        MicroOp third = i + 2 < program.size() ? program[i + 2].base : MicroOp::END;
+
+        if (first == MicroOp::LOAD_M && third == MicroOp::STORE_L){
+            switch (second){
+                case MicroOp::ADD_L: program[i].op = MicroOp::LOAD_ADD_STORE_L; ++report.loadAddStore; break;
+                case MicroOp::ADD_M: program[i].op = MicroOp::LOAD_ADD_STORE_M; ++report.loadAddStore; break;
+                case MicroOp::SUB_L: program[i].op = MicroOp::LOAD_SUB_STORE_L; ++report.loadSubStore; break;
+                case MicroOp::SUB_M: program[i].op = MicroOp::LOAD_SUB_STORE_M; ++report.loadSubStore; break;
+                default: break;
+            }
+        } else if (first == MicroOp::DEC && second == MicroOp::JNZ_L){
+            program[i].op = MicroOp::DEC_JNZ;
+            ++report.decJnz;
+        } else if (first == MicroOp::LOAD_M && second == MicroOp::JZ_L){
+            program[i].op = MicroOp::LOAD_JZ;
+            ++report.loadBranch;
+        } else if (first == MicroOp::LOAD_M && second == MicroOp::JNZ_L){
+            program[i].op = MicroOp::LOAD_JNZ;
+            ++report.loadBranch;
+        }
+    }
+    return report;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <condition_variable>
+#include <expected>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpu.h"
+
+namespace trace{
+
+    enum class TraceError {
+        CannotOpen,
+        WriteError,
+        BadHeader,
+        Truncated
+    };
+
+    static constexpr std::array<std::string, 4> traceErrorStringCodes{
+        "CannotOpen",
+        "WriteError",
+        "BadHeader",
+        "Truncated"
+    };
+
+    inline std::string toStr(TraceError code) {return traceErrorStringCodes[static_cast<uint64_t>(code)];};
+
+    // One executed step: the state right after it, plus the DMEM word it wrote
+    // when `flags` has STORE.
+    struct Record{
+        uint64_t step;
+        uint32_t PC;
+        uint32_t ACC;
+        uint32_t address;
+        uint32_t value;
+        uint16_t IR;
+        uint8_t flags;
+
+        static constexpr uint8_t Z = 1;
+        static constexpr uint8_t C = 2;
+        static constexpr uint8_t STORE = 4;
+    };
+
+    // Collects records in a fixed buffer on the caller's thread. A full buffer
+    // is swapped with a spare one, and a background thread delta/varint-encodes
+    // it and writes it out while recording carries on.
+    class Writer{
+    public:
+        static constexpr size_t BUFFER_RECORDS = 1 << 16;
+
+        static std::expected<std::unique_ptr<Writer>, TraceError> open(const std::filesystem::path& path);
+        ~Writer();
+
+        void append(const Record& record){
+            filling.push_back(record);
+            if (filling.size() == BUFFER_RECORDS)
+                submit();
+        }
+        // Writes out everything appended so far and stops the background thread.
+        std::expected<void, TraceError> close();
+
+        size_t getRecordCount() const{return recordCount;};
+        size_t getBytesWritten() const{return bytesWritten;};
+
+    private:
+        Writer(std::ofstream out);
+
+        void submit();
+        void drain();
+
+        std::ofstream out;
+        std::vector<Record> filling;
+        std::vector<Record> draining;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool busy = false;
+        bool closing = false;
+        bool failed = false;
+        size_t recordCount = 0;
+        size_t bytesWritten = 0;
+        std::thread thread;
+    };
+
+    // Decodes a trace file, calling `visit` for every record in order.
+    // Returns the number of records.
+    std::expected<size_t, TraceError> replay(const std::filesystem::path& path,
+        const std::function<void(const Record&)>& visit);
+
+    // Runs a started CPU until it halts or `budget` steps pass, appending one
+    // record per step.
+    template<uint16_t IMEM_SIZE, uint32_t DMEM_SIZE, class Memory>
+    Simulator::RunStatus run(CPU<IMEM_SIZE, DMEM_SIZE, Memory>& cpu, Writer& writer, size_t budget = SIZE_MAX){
+        using Machine = CPU<IMEM_SIZE, DMEM_SIZE, Memory>;
+
+        // The store target has to be read before the STORE runs, since an
+        // indirect STORE may overwrite its own pointer.
+        auto storeTarget = [](const Machine& cpu) -> std::optional<uint32_t>{
+            if (cpu.getPC() >= IMEM_SIZE)
+                return std::nullopt;
+            typename Machine::Instruction instr = cpu.readIMEM(cpu.getPC());
+            if (instr.fields.code != Asm::STORE)
+                return std::nullopt;
+            uint32_t address = instr.fields.isLiteral ? instr.fields.value : cpu.readDMEM(instr.fields.value);
+            if (address >= DMEM_SIZE)
+                return std::nullopt;
+            return address;
+        };
+
+        std::optional<uint32_t> target = storeTarget(cpu);
+        size_t recorded = cpu.getStep();
+        auto append = [&](const Machine& cpu){
+            Record record{cpu.getStep(), cpu.getPC(), cpu.getACC(), 0, 0, cpu.getIR().raw,
+                static_cast<uint8_t>((cpu.getZ() ? Record::Z : 0) | (cpu.getC() ? Record::C : 0))};
+            if (target){
+                record.flags |= Record::STORE;
+                record.address = *target;
+                record.value = cpu.readDMEM(*target);
+            }
+            writer.append(record);
+            recorded = record.step;
+            target = storeTarget(cpu);
+            return false;
+        };
+        auto status = cpu.runUntil(append, budget);
+        // The halting step ends the run without consulting the predicate.
+        if (cpu.getStep() != recorded)
+            append(cpu);
+        return status;
+    }
+}
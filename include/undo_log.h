@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <bit>
+#include <algorithm>
+#include <stdexcept>
+
+// State an instruction destroys, recorded just before it runs. Every entry
+// holds PC and ACC. Z is only saved when it differs from `ACC == 0` and C only
+// by instructions that overwrite it; `address` and `word` are filled in by
+// STORE, which overwrote DMEM[address] while it held `word`.
+struct UndoEntry{
+    uint32_t PC;
+    uint32_t ACC;
+    uint32_t address;
+    uint32_t word;
+    uint8_t flags;
+
+    static constexpr uint8_t Z_SAVED = 1;
+    static constexpr uint8_t Z = 2;
+    static constexpr uint8_t C_SAVED = 4;
+    static constexpr uint8_t C = 8;
+};
+
+// Bounded ring of UndoEntry; once full, the oldest entries are overwritten.
+class UndoLog{
+public:
+    UndoLog(size_t capacity){
+        if (capacity == 0)
+            throw std::invalid_argument("Undo log capacity must be positive");
+        ring.resize(std::bit_ceil(capacity));
+        mask = ring.size() - 1;
+    }
+
+    size_t capacity() const{return ring.size();};
+    size_t size() const{return count;};
+    bool empty() const{return count == 0;};
+    // True once entries older than the oldest kept one have been overwritten.
+    bool truncated() const{return head != count;};
+
+    UndoEntry& push(){
+        if (count < ring.size())
+            ++count;
+        return ring[head++ & mask];
+    }
+    const UndoEntry& pop(){
+        if (count == 0)
+            throw std::runtime_error("Undo log is empty");
+        --count;
+        return ring[--head & mask];
+    }
+    UndoEntry& top(){
+        if (count == 0)
+            throw std::runtime_error("Undo log is empty");
+        return ring[(head - 1) & mask];
+    }
+    void clear(){
+        head = 0;
+        count = 0;
+    }
+
+    // Slots left before the ring wraps back to its first entry.
+    size_t room() const{return ring.size() - (head & mask);};
+
+    // Keeps the write cursor in a local while an engine pushes a run of at
+    // most room() entries, and publishes it to the log when it goes out of
+    // scope. Callers split longer runs so that push() never has to wrap.
+    class Writer{
+    public:
+        Writer(UndoLog* log)
+            : log(*log), begin(log->ring.data() + (log->head & log->mask)), cursor(begin){}
+        ~Writer(){
+            size_t pushed = cursor - begin;
+            log.head += pushed;
+            log.count = std::min(log.count + pushed, log.ring.size());
+        }
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        UndoEntry& push(){
+            return *cursor++;
+        }
+        // Both only valid after a push() through this writer.
+        UndoEntry& last(){
+            return cursor[-1];
+        }
+        void drop(){
+            --cursor;
+        }
+
+    private:
+        UndoLog& log;
+        UndoEntry* begin;
+        UndoEntry* cursor;
+    };
+    // Stands in for Writer when nothing is recorded.
+    struct NoWriter{
+        NoWriter(UndoLog*){}
+    };
+
+private:
+    std::vector<UndoEntry> ring;
+    size_t mask = 0;
+    // Counts pushes without wrapping; `head & mask` is the next slot.
+    size_t head = 0;
+    size_t count = 0;
+};
@@ -1,4 +1,5 @@
 #include "assembly.h"
+#include <unordered_map>
 
 
 std::string Assembly::toString() const{
@@ -0,0 +1,485 @@
+#include "batch_runner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <deque>
+#include <format>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+
+#include "assembler.h"
+#include "data_reader.h"
+#include "file.h"
+#include "optimizer.h"
+
+namespace {
+    constexpr size_t FLUSH_LINES = 64;
+
+    // Next whitespace-separated token of a manifest line, or an empty view
+    // at its end.
+    std::string_view nextToken(std::string_view& rest){
+        auto isSpace = [](char c){return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';};
+        size_t begin = 0;
+        while (begin < rest.size() && isSpace(rest[begin]))
+            ++begin;
+        size_t end = begin;
+        while (end < rest.size() && !isSpace(rest[end]))
+            ++end;
+        std::string_view token = rest.substr(begin, end - begin);
+        rest.remove_prefix(end);
+        return token;
+    }
+
+    // Decimal, 0x hexadecimal or 0 octal, as the data file reads numbers.
+    std::expected<size_t, std::errc> parseBudget(std::string_view token){
+        int base = 10;
+        if (token.size() > 2 && token[0] == '0' && (token[1] == 'x' || token[1] == 'X')){
+            base = 16;
+            token.remove_prefix(2);
+        } else if (token.size() > 1 && token[0] == '0'){
+            base = 8;
+            token.remove_prefix(1);
+        }
+        size_t number;
+        auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), number, base);
+        if (ec == std::errc() && ptr != token.data() + token.size())
+            ec = std::errc::invalid_argument;
+        if (ec != std::errc())
+            return std::unexpected(ec);
+        return number;
+    }
+
+    using Image = std::array<BatchRunner::Machine::Instruction, BatchRunner::IMEM_SIZE>;
+
+    struct Program{
+        std::shared_ptr<const Image> image;
+        std::string error;
+    };
+
+    // Units are dealt to workers in contiguous ranges so a worker mostly keeps
+    // one program loaded; the owner takes from the front, thieves from the back.
+    struct WorkQueue{
+        std::mutex mutex;
+        std::deque<size_t> units;
+
+        std::optional<size_t> pop(){
+            std::lock_guard lock(mutex);
+            if (units.empty())
+                return std::nullopt;
+            size_t unit = units.front();
+            units.pop_front();
+            return unit;
+        }
+        std::optional<size_t> steal(){
+            std::lock_guard lock(mutex);
+            if (units.empty())
+                return std::nullopt;
+            size_t unit = units.back();
+            units.pop_back();
+            return unit;
+        }
+    };
+
+    uint64_t digest(const std::array<uint32_t, BatchRunner::DMEM_SIZE>& DMEM){
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (uint32_t word : DMEM){
+            for (int i = 0; i < 4; ++i){
+                hash ^= (word >> (i * 8)) & 0xFF;
+                hash *= 0x100000001b3ull;
+            }
+        }
+        return hash;
+    }
+
+    Program assemble(const std::filesystem::path& path, const ImageCache* cache, bool optimize){
+        auto source = file::map(path);
+        if (!source)
+            return Program{nullptr, file::toStr(source.error())};
+
+        if (cache){
+            if (auto entry = cache->load<BatchRunner::IMEM_SIZE, BatchRunner::DMEM_SIZE>(source->view(), optimize))
+                return Program{std::make_shared<const Image>(entry->image), {}};
+        }
+
+        Assembler assembler;
+        auto assembly = assembler.translate(source->view());
+        if (!assembly)
+            return Program{nullptr, Assembler::toStr(assembly.error().code)};
+        std::string note;
+        if (optimize)
+            note = optimizeAssembly(*assembly, BatchRunner::DMEM_SIZE).summary();
+
+        try{
+            auto image = flashAssembly<BatchRunner::IMEM_SIZE, BatchRunner::DMEM_SIZE>(*assembly);
+            if (cache)
+                cache->store<BatchRunner::IMEM_SIZE, BatchRunner::DMEM_SIZE>(source->view(), image, optimize, note);
+            return Program{std::make_shared<const Image>(image), {}};
+        } catch (const std::exception& e){
+            return Program{nullptr, e.what()};
+        }
+    }
+}
+
+std::string BatchRunner::toStr(ManifestError error){
+    return std::format("Manifest error: {}(line: {})\n",
+        ManifestError::stringCodes[static_cast<size_t>(error.code)], error.line);
+}
+
+std::string BatchRunner::toStr(JobStatus status){
+    switch (status){
+        case JobStatus::HALTED:           return "HALTED";
+        case JobStatus::BUDGET_EXHAUSTED: return "BUDGET_EXHAUSTED";
+        case JobStatus::TIMEOUT:          return "TIMEOUT";
+        case JobStatus::LOOP:             return "LOOP";
+        case JobStatus::ERROR:            return "ERROR";
+    }
+    return "UNKNOWN";
+}
+
+std::expected<std::vector<BatchRunner::Job>, BatchRunner::ManifestError> BatchRunner::parseManifest(
+    const std::string& source, const std::filesystem::path& baseDir){
+
+    std::vector<Job> jobs;
+    std::string_view rest = source;
+    size_t lineNumber = 0;
+
+    while (!rest.empty()){
+        size_t end = std::min(rest.find('\n'), rest.size());
+        std::string_view line = rest.substr(0, end);
+        rest.remove_prefix(std::min(end + 1, rest.size()));
+        lineNumber++;
+        line = line.substr(0, line.find('#'));
+
+        std::string_view program = nextToken(line);
+        if (program.empty())
+            continue;
+        std::string_view data = nextToken(line);
+        if (data.empty())
+            return std::unexpected(ManifestError{ManifestError::Code::IncompleteLine, lineNumber});
+
+        Job job{baseDir / program, baseDir / data, 0};
+        if (std::string_view budget = nextToken(line); !budget.empty()){
+            auto parsed = parseBudget(budget);
+            if (!parsed || *parsed == 0)
+                return std::unexpected(ManifestError{ManifestError::Code::BadBudget, lineNumber});
+            job.budget = *parsed;
+        }
+
+        if (!nextToken(line).empty())
+            return std::unexpected(ManifestError{ManifestError::Code::UnexpectedToken, lineNumber});
+
+        jobs.push_back(std::move(job));
+    }
+    return jobs;
+}
+
+std::vector<BatchRunner::Job> BatchRunner::jobsForDirectory(
+    const std::filesystem::path& program, const std::filesystem::path& dataDir){
+
+    std::vector<std::filesystem::path> files;
+    for (const auto& entry : std::filesystem::directory_iterator(dataDir)){
+        if (entry.is_regular_file())
+            files.push_back(entry.path());
+    }
+    std::ranges::sort(files);
+
+    std::vector<Job> jobs;
+    jobs.reserve(files.size());
+    for (auto& data : files)
+        jobs.push_back(Job{program, std::move(data), 0});
+    return jobs;
+}
+
+BatchRunner::BatchRunner(size_t threadCount)
+    : threadCount(threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency())){
+}
+
+void BatchRunner::setStepBudget(size_t steps){
+    if (steps == 0) throw std::invalid_argument("Step budget must be positive");
+    stepBudget = steps;
+}
+
+void BatchRunner::setTimeout(std::chrono::milliseconds timeout){
+    if (timeout.count() < 0) throw std::invalid_argument("Timeout must be non-negative");
+    this->timeout = timeout;
+}
+
+void BatchRunner::setFusion(bool enabled){
+    fusion = enabled;
+}
+
+void BatchRunner::setLoopAcceleration(bool enabled){
+    loopAcceleration = enabled;
+}
+
+void BatchRunner::setOptimization(bool enabled){
+    optimization = enabled;
+}
+
+void BatchRunner::setLockstep(bool enabled){
+    lockstep = enabled;
+}
+
+void BatchRunner::setLoopDetection(bool enabled){
+    loopDetection = enabled;
+}
+
+void BatchRunner::setImageCache(std::shared_ptr<const ImageCache> cache){
+    imageCache = std::move(cache);
+}
+
+size_t BatchRunner::getThreadCount() const{
+    return threadCount;
+}
+
+BatchRunner::Summary BatchRunner::run(const std::vector<Job>& jobs, std::ostream& out){
+    std::vector<Program> programs;
+    std::vector<size_t> programOf(jobs.size());
+    std::unordered_map<std::string, size_t> programIndex;
+    for (size_t i = 0; i < jobs.size(); ++i){
+        auto [it, inserted] = programIndex.try_emplace(jobs[i].program.lexically_normal().string(), programs.size());
+        if (inserted)
+            programs.push_back(assemble(jobs[i].program, imageCache.get(), optimization));
+        programOf[i] = it->second;
+    }
+
+    // A unit is one job, or with lockstep up to LOCKSTEP_LANES jobs sharing a
+    // program and a budget.
+    std::vector<std::vector<size_t>> units;
+    if (lockstep){
+        std::map<std::pair<size_t, size_t>, size_t> open;
+        for (size_t i = 0; i < jobs.size(); ++i){
+            auto key = std::make_pair(programOf[i], jobs[i].budget);
+            auto it = open.find(key);
+            if (it == open.end() || units[it->second].size() == LOCKSTEP_LANES){
+                it = open.insert_or_assign(key, units.size()).first;
+                units.emplace_back();
+            }
+            units[it->second].push_back(i);
+        }
+    } else {
+        units.reserve(jobs.size());
+        for (size_t i = 0; i < jobs.size(); ++i)
+            units.push_back({i});
+    }
+
+    size_t workers = std::min(threadCount, std::max<size_t>(units.size(), 1));
+    std::vector<WorkQueue> queues(workers);
+    for (size_t w = 0; w < workers; ++w){
+        size_t begin = units.size() * w / workers;
+        size_t end = units.size() * (w + 1) / workers;
+        for (size_t i = begin; i < end; ++i)
+            queues[w].units.push_back(i);
+    }
+
+    std::mutex outMutex;
+    std::atomic<size_t> halted = 0;
+    std::atomic<size_t> failed = 0;
+    std::atomic<size_t> loops = 0;
+    std::atomic<size_t> totalSteps = 0;
+
+    auto worker = [&](size_t self){
+        std::unique_ptr<Machine> cpu;
+        std::unique_ptr<Lockstep> lanes;
+        const Image* loaded = nullptr;
+        std::string buffer;
+        size_t buffered = 0;
+
+        auto next = [&]() -> std::optional<size_t>{
+            if (auto unit = queues[self].pop())
+                return unit;
+            for (size_t k = 1; k < workers; ++k){
+                if (auto unit = queues[(self + k) % workers].steal())
+                    return unit;
+            }
+            return std::nullopt;
+        };
+
+        auto flush = [&]{
+            std::lock_guard lock(outMutex);
+            out << buffer;
+            buffer.clear();
+            buffered = 0;
+        };
+        auto emit = [&](std::string line){
+            buffer += line;
+            if (++buffered == FLUSH_LINES)
+                flush();
+        };
+        auto emitError = [&](size_t index, const std::string& error){
+            const Job& job = jobs[index];
+            ++failed;
+            emit(std::format("{}\t{}\t{}\t{}\t{}\n",
+                index, toStr(JobStatus::ERROR), error, job.program.string(), job.data.string()));
+        };
+        auto emitState = [&](size_t index, JobStatus status, size_t steps, uint32_t PC, uint32_t ACC,
+            bool Z, bool C, const std::array<uint32_t, DMEM_SIZE>& DMEM){
+            const Job& job = jobs[index];
+            if (status == JobStatus::HALTED)
+                ++halted;
+            if (status == JobStatus::LOOP)
+                ++loops;
+            totalSteps += steps;
+            emit(std::format("{}\t{}\t{}\t{}\t{}\t{:d}\t{:d}\t{:016x}\t{}\t{}\n",
+                index, toStr(status), steps, PC, ACC, Z, C, digest(DMEM), job.program.string(), job.data.string()));
+        };
+
+        auto readData = [&](size_t index) -> std::optional<std::array<uint32_t, DMEM_SIZE>>{
+            auto source = file::map(jobs[index].data);
+            if (!source){
+                emitError(index, file::toStr(source.error()));
+                return std::nullopt;
+            }
+            auto data = DataReader::parseData<DMEM_SIZE>(source->view());
+            if (!data){
+                emitError(index, DataReader::toStr(data.error().code));
+                return std::nullopt;
+            }
+            return *data;
+        };
+
+        auto execute = [&](size_t index){
+            const Program& program = programs[programOf[index]];
+            if (!program.image)
+                return emitError(index, program.error);
+            auto data = readData(index);
+            if (!data)
+                return;
+
+            if (!cpu){
+                cpu = std::make_unique<Machine>();
+                if (fusion)
+                    cpu->enableFusion();
+                if (loopAcceleration)
+                    cpu->enableLoopAcceleration();
+                loaded = nullptr;
+            }
+            if (loaded != program.image.get()){
+                cpu->loadIMEM(*program.image);
+                loaded = program.image.get();
+            }
+            cpu->reset();
+            cpu->loadDMEM(*data);
+            cpu->start();
+
+            size_t budget = jobs[index].budget ? jobs[index].budget : stepBudget;
+            auto deadline = std::chrono::steady_clock::now() + timeout;
+            JobStatus status = JobStatus::BUDGET_EXHAUSTED;
+            std::optional<Detector> detector;
+            if (loopDetection)
+                detector.emplace();
+            try{
+                while (cpu->getStep() < budget){
+                    size_t chunk = budget - cpu->getStep();
+                    if (timeout.count() > 0)
+                        chunk = std::min(chunk, TIMEOUT_CHECK_STEPS);
+                    auto result = detector ? detector->run(*cpu, chunk) : cpu->runFor(chunk);
+                    if (result == Simulator::RunStatus::HALTED){
+                        status = JobStatus::HALTED;
+                        break;
+                    }
+                    if (result == Simulator::RunStatus::BREAKPOINT){
+                        status = JobStatus::LOOP;
+                        break;
+                    }
+                    if (timeout.count() > 0 && std::chrono::steady_clock::now() >= deadline){
+                        status = JobStatus::TIMEOUT;
+                        break;
+                    }
+                }
+            } catch (const std::exception& e){
+                if (cpu->getState() == Simulator::State::RUNNING)
+                    cpu->stop();
+                return emitError(index, e.what());
+            }
+            if (cpu->getState() == Simulator::State::RUNNING)
+                cpu->stop();
+            emitState(index, status, cpu->getStep(), cpu->getPC(), cpu->getACC(), cpu->getZ(), cpu->getC(), cpu->getDMEM());
+        };
+
+        auto executeLockstep = [&](const std::vector<size_t>& unit){
+            const Program& program = programs[programOf[unit.front()]];
+            if (!program.image){
+                for (size_t index : unit)
+                    emitError(index, program.error);
+                return;
+            }
+
+            if (!lanes){
+                lanes = std::make_unique<Lockstep>();
+                loaded = nullptr;
+            }
+            std::vector<size_t> laneJobs;
+            for (size_t index : unit){
+                auto data = readData(index);
+                if (!data)
+                    continue;
+                lanes->loadDMEM(laneJobs.size(), *data);
+                laneJobs.push_back(index);
+            }
+            if (laneJobs.empty())
+                return;
+
+            if (loaded != program.image.get()){
+                lanes->loadIMEM(*program.image);
+                loaded = program.image.get();
+            }
+            lanes->reset(laneJobs.size());
+
+            size_t budget = jobs[unit.front()].budget ? jobs[unit.front()].budget : stepBudget;
+            auto deadline = std::chrono::steady_clock::now() + timeout;
+            bool timedOut = false;
+            size_t rounds = 0;
+            while (rounds < budget && lanes->isRunning()){
+                size_t chunk = budget - rounds;
+                if (timeout.count() > 0)
+                    chunk = std::min(chunk, TIMEOUT_CHECK_STEPS);
+                rounds += lanes->run(chunk);
+                if (timeout.count() > 0 && std::chrono::steady_clock::now() >= deadline){
+                    timedOut = true;
+                    break;
+                }
+            }
+
+            for (size_t lane = 0; lane < laneJobs.size(); ++lane){
+                JobStatus status = timedOut ? JobStatus::TIMEOUT : JobStatus::BUDGET_EXHAUSTED;
+                switch (lanes->getLaneState(lane)){
+                    case Lockstep::LaneState::FAULT:
+                        emitError(laneJobs[lane], std::format("Lane fault at PC {}", lanes->getPC(lane)));
+                        continue;
+                    case Lockstep::LaneState::HALTED:
+                        status = JobStatus::HALTED;
+                        break;
+                    case Lockstep::LaneState::RUNNING:
+                        break;
+                }
+                emitState(laneJobs[lane], status, lanes->getStep(lane), lanes->getPC(lane), lanes->getACC(lane),
+                    lanes->getZ(lane), lanes->getC(lane), lanes->getDMEM(lane));
+            }
+        };
+
+        while (auto unit = next()){
+            if (lockstep)
+                executeLockstep(units[*unit]);
+            else
+                execute(units[*unit].front());
+        }
+        if (buffered)
+            flush();
+    };
+
+    {
+        std::vector<std::jthread> threads;
+        threads.reserve(workers);
+        for (size_t w = 0; w < workers; ++w)
+            threads.emplace_back(worker, w);
+    }
+    out.flush();
+
+    return Summary{jobs.size(), halted, failed, loops, totalSteps};
+}
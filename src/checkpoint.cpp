@@ -0,0 +1,284 @@
+#include "checkpoint.h"
+
+#include <bit>
+#include <cstring>
+#include <map>
+
+#include "file.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define CPUEMUL_HAS_FSYNC
+#endif
+
+namespace {
+    constexpr char MAGIC[8] = {'C', 'P', 'U', 'C', 'H', 'K', 'P', 'T'};
+    constexpr size_t HEADER_BYTES = 24;
+    constexpr size_t FRAME_HEADER_BYTES = 16;
+    constexpr size_t REGISTER_BYTES = 20;
+
+    constexpr uint32_t FULL = 0;
+    constexpr uint32_t DELTA = 1;
+
+    constexpr uint8_t Z_FLAG = 1;
+    constexpr uint8_t C_FLAG = 2;
+    constexpr uint8_t RUNNING_FLAG = 4;
+
+    template<class T>
+    T toLittle(T value){
+        if constexpr (std::endian::native == std::endian::big)
+            return std::byteswap(value);
+        return value;
+    }
+
+    template<class T>
+    void set(unsigned char* bytes, T value){
+        value = toLittle(value);
+        std::memcpy(bytes, &value, sizeof(T));
+    }
+
+    template<class T>
+    void put(std::vector<unsigned char>& bytes, T value){
+        size_t at = bytes.size();
+        bytes.resize(at + sizeof(T));
+        set<T>(bytes.data() + at, value);
+    }
+
+    template<class T>
+    T get(const unsigned char* bytes){
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return toLittle(value);
+    }
+
+    uint64_t fnv1a(const unsigned char* bytes, size_t size){
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; ++i){
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    // The payload is appended behind room for the frame header, which is
+    // filled in once the payload's size and checksum are known.
+    std::vector<unsigned char> encodeFrame(uint32_t kind, const checkpoint::Registers& registers,
+        std::span<const uint16_t> IMEM, std::span<const checkpoint::Page> pages){
+        std::vector<unsigned char> bytes(FRAME_HEADER_BYTES, 0);
+        put<uint32_t>(bytes, registers.PC);
+        put<uint32_t>(bytes, registers.ACC);
+        put<uint16_t>(bytes, registers.IR);
+        put<uint8_t>(bytes, (registers.Z ? Z_FLAG : 0) | (registers.C ? C_FLAG : 0)
+            | (registers.running ? RUNNING_FLAG : 0));
+        put<uint8_t>(bytes, 0);
+        put<uint64_t>(bytes, registers.step);
+        for (uint16_t word : IMEM)
+            put<uint16_t>(bytes, word);
+        bytes.resize((bytes.size() + 3) & ~size_t{3}, 0);
+        put<uint32_t>(bytes, pages.size());
+        for (const checkpoint::Page& page : pages){
+            put<uint32_t>(bytes, page.index);
+            for (uint32_t word : page.words)
+                put<uint32_t>(bytes, word);
+        }
+
+        const unsigned char* payload = bytes.data() + FRAME_HEADER_BYTES;
+        size_t payloadSize = bytes.size() - FRAME_HEADER_BYTES;
+        set<uint32_t>(bytes.data(), kind);
+        set<uint32_t>(bytes.data() + 4, payloadSize);
+        set<uint64_t>(bytes.data() + 8, fnv1a(payload, payloadSize));
+        return bytes;
+    }
+
+    // Flushes and, where the platform allows, waits for the data to reach
+    // the disk.
+    bool sync(std::FILE* file){
+        if (std::fflush(file) != 0)
+            return false;
+#if defined(CPUEMUL_HAS_FSYNC)
+        return ::fsync(::fileno(file)) == 0;
+#else
+        return true;
+#endif
+    }
+
+    bool writeAll(std::FILE* file, const std::vector<unsigned char>& bytes){
+        return std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size() && sync(file);
+    }
+}
+
+checkpoint::File::File(std::filesystem::path path, uint32_t imemSize, uint32_t dmemSize, uint32_t pageWords)
+    : path(std::move(path)), imemSize(imemSize), dmemSize(dmemSize), pageWords(pageWords){}
+
+checkpoint::File::~File(){
+    if (file)
+        std::fclose(file);
+}
+
+std::expected<size_t, checkpoint::CheckpointError> checkpoint::File::writeFull(const Registers& registers,
+    std::span<const uint16_t> IMEM, std::span<const Page> pages){
+
+    std::vector<unsigned char> bytes(MAGIC, MAGIC + sizeof(MAGIC));
+    put<uint32_t>(bytes, VERSION);
+    put<uint32_t>(bytes, imemSize);
+    put<uint32_t>(bytes, dmemSize);
+    put<uint32_t>(bytes, pageWords);
+    std::vector<unsigned char> frame = encodeFrame(FULL, registers, IMEM, pages);
+    bytes.insert(bytes.end(), frame.begin(), frame.end());
+
+    if (file){
+        std::fclose(file);
+        file = nullptr;
+    }
+
+    // Until the rename the previous file stays whole, so a crash here loses
+    // nothing already written.
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    std::FILE* out = std::fopen(temporary.string().c_str(), "wb");
+    if (!out)
+        return std::unexpected(CheckpointError::CannotOpen);
+    bool written = writeAll(out, bytes);
+    written &= std::fclose(out) == 0;
+    std::error_code ec;
+    if (written)
+        std::filesystem::rename(temporary, path, ec);
+    if (!written || ec){
+        std::filesystem::remove(temporary, ec);
+        return std::unexpected(CheckpointError::WriteError);
+    }
+
+    file = std::fopen(path.string().c_str(), "ab");
+    if (!file)
+        return std::unexpected(CheckpointError::CannotOpen);
+    return bytes.size();
+}
+
+std::expected<size_t, checkpoint::CheckpointError> checkpoint::File::appendDelta(const Registers& registers,
+    std::span<const Page> pages){
+
+    if (!file)
+        return std::unexpected(CheckpointError::WriteError);
+    std::vector<unsigned char> bytes = encodeFrame(DELTA, registers, {}, pages);
+    if (!writeAll(file, bytes))
+        return std::unexpected(CheckpointError::WriteError);
+    return bytes.size();
+}
+
+std::expected<checkpoint::Loaded, checkpoint::CheckpointError> checkpoint::read(const std::filesystem::path& path,
+    uint32_t imemSize, uint32_t dmemSize){
+
+    auto mapping = file::map(path);
+    if (!mapping){
+        return std::unexpected(mapping.error() == file::FileError::EmptyFile
+            ? CheckpointError::BadHeader : CheckpointError::CannotOpen);
+    }
+    const unsigned char* bytes = mapping->bytes().data();
+    size_t size = mapping->bytes().size();
+
+    if (size < HEADER_BYTES || std::memcmp(bytes, MAGIC, sizeof(MAGIC)) != 0
+        || get<uint32_t>(bytes + 8) != VERSION)
+        return std::unexpected(CheckpointError::BadHeader);
+    if (get<uint32_t>(bytes + 12) != imemSize || get<uint32_t>(bytes + 16) != dmemSize)
+        return std::unexpected(CheckpointError::SizeMismatch);
+    size_t pageWords = get<uint32_t>(bytes + 20);
+    if (pageWords == 0)
+        return std::unexpected(CheckpointError::BadHeader);
+    size_t pageCount = (dmemSize + pageWords - 1) / pageWords;
+
+    Loaded loaded;
+    std::map<uint32_t, std::vector<uint32_t>> pages;
+
+    // Decodes the frame at `offset` and applies it; nothing is applied
+    // unless the whole frame checks out.
+    auto apply = [&](size_t& offset) -> std::expected<void, CheckpointError>{
+        if (size - offset < FRAME_HEADER_BYTES)
+            return std::unexpected(CheckpointError::Truncated);
+        uint32_t kind = get<uint32_t>(bytes + offset);
+        size_t payloadSize = get<uint32_t>(bytes + offset + 4);
+        uint64_t checksum = get<uint64_t>(bytes + offset + 8);
+        const unsigned char* payload = bytes + offset + FRAME_HEADER_BYTES;
+        if (size - offset - FRAME_HEADER_BYTES < payloadSize)
+            return std::unexpected(CheckpointError::Truncated);
+        if (fnv1a(payload, payloadSize) != checksum)
+            return std::unexpected(CheckpointError::BadChecksum);
+        if (kind != (loaded.frames == 0 ? FULL : DELTA) || payloadSize < REGISTER_BYTES)
+            return std::unexpected(CheckpointError::BadHeader);
+
+        Registers registers;
+        registers.PC = get<uint32_t>(payload);
+        registers.ACC = get<uint32_t>(payload + 4);
+        registers.IR = get<uint16_t>(payload + 8);
+        uint8_t flags = payload[10];
+        registers.Z = flags & Z_FLAG;
+        registers.C = flags & C_FLAG;
+        registers.running = flags & RUNNING_FLAG;
+        registers.step = get<uint64_t>(payload + 12);
+
+        size_t at = REGISTER_BYTES;
+        std::vector<uint16_t> IMEM;
+        if (kind == FULL){
+            if ((payloadSize - at) / sizeof(uint16_t) < imemSize)
+                return std::unexpected(CheckpointError::Truncated);
+            IMEM.resize(imemSize);
+            for (size_t i = 0; i < imemSize; ++i)
+                IMEM[i] = get<uint16_t>(payload + at + i * sizeof(uint16_t));
+            at = (at + imemSize * sizeof(uint16_t) + 3) & ~size_t{3};
+        }
+        if (payloadSize < at || payloadSize - at < sizeof(uint32_t))
+            return std::unexpected(CheckpointError::Truncated);
+        size_t count = get<uint32_t>(payload + at);
+        at += sizeof(uint32_t);
+
+        std::vector<std::pair<uint32_t, std::vector<uint32_t>>> written;
+        for (size_t i = 0; i < count; ++i){
+            if (payloadSize - at < sizeof(uint32_t))
+                return std::unexpected(CheckpointError::Truncated);
+            uint32_t index = get<uint32_t>(payload + at);
+            at += sizeof(uint32_t);
+            if (index >= pageCount)
+                return std::unexpected(CheckpointError::BadHeader);
+            size_t words = std::min(pageWords, dmemSize - index * pageWords);
+            if ((payloadSize - at) / sizeof(uint32_t) < words)
+                return std::unexpected(CheckpointError::Truncated);
+            std::vector<uint32_t> page(words);
+            for (size_t word = 0; word < words; ++word)
+                page[word] = get<uint32_t>(payload + at + word * sizeof(uint32_t));
+            at += words * sizeof(uint32_t);
+            written.emplace_back(index, std::move(page));
+        }
+
+        if (kind == FULL){
+            pages.clear();
+            loaded.IMEM = std::move(IMEM);
+        }
+        for (auto& [index, page] : written)
+            pages[index] = std::move(page);
+        loaded.registers = registers;
+        ++loaded.frames;
+        offset += FRAME_HEADER_BYTES + payloadSize;
+        return {};
+    };
+
+    // A bad first frame leaves nothing to resume; after it, a bad frame is
+    // one a crash cut short, and the state before it stands.
+    size_t offset = HEADER_BYTES;
+    while (offset < size){
+        auto applied = apply(offset);
+        if (!applied){
+            if (loaded.frames == 0)
+                return std::unexpected(applied.error());
+            break;
+        }
+    }
+    if (loaded.frames == 0)
+        return std::unexpected(CheckpointError::Truncated);
+
+    for (const auto& [index, page] : pages){
+        for (size_t word = 0; word < page.size(); ++word){
+            if (page[word] != 0)
+                loaded.DMEM.emplace_back(index * pageWords + word, page[word]);
+        }
+    }
+    return loaded;
+}
@@ -1,6 +1,7 @@
 #include "clock_generator.h"
 #include <thread>
 #include <stdexcept>
+#include <algorithm>
 
 ClockGenerator::ClockGenerator(double simulationFrequencyHz, double displayFrequencyHz) {
     setSimulationFrequency(simulationFrequencyHz);
@@ -9,6 +10,7 @@ ClockGenerator::ClockGenerator(double simulationFrequencyHz, double displayFrequ
 
 void ClockGenerator::setSimulationFrequency(double frequencyHz) {
     if (frequencyHz <= 0) throw std::invalid_argument("Frequency must be positive");
+    simulationFrequency = frequencyHz;
     auto periodUs = static_cast<int64_t>(1000000.0 / frequencyHz);
     simulationPeriod = std::chrono::microseconds(periodUs);
 }
@@ -18,6 +20,7 @@ void ClockGenerator::setDisplayFrequency(double frequencyHz) {
         displayMode = DisplayMode::EVERY_FRAME;
     } else if (frequencyHz > 0) {
         displayMode = DisplayMode::FIXED_FPS;
+        displayFrequency = frequencyHz;
         auto periodUs = static_cast<int64_t>(1000000.0 / frequencyHz);
         displayPeriod = std::chrono::microseconds(periodUs);
     } else {
@@ -50,6 +53,10 @@ void ClockGenerator::setDisplayMode(DisplayMode mode) {
     displayMode = mode;
 }
 
+void ClockGenerator::setTimingMode(TimingMode mode) {
+    timingMode = mode;
+}
+
 void ClockGenerator::setSimulator(std::shared_ptr<Simulator> simulatorObj) {
     simulator = simulatorObj;
 }
@@ -65,6 +72,7 @@ void ClockGenerator::start() {
     simulator->start();
     lastSimulationTick = std::chrono::steady_clock::now();
     lastDisplayTick = lastSimulationTick;
+    nextDisplayStep = displayFrequency > 0 ? simulationFrequency / displayFrequency : 0;
 }
 
 void ClockGenerator::stop() {
@@ -78,6 +86,13 @@ bool ClockGenerator::tick() {
         return false;
     }
 
+    if (timingMode == TimingMode::REAL_TIME) {
+        return tickRealTime();
+    }
+    return tickBatch();
+}
+
+bool ClockGenerator::tickRealTime() {
     auto now = std::chrono::steady_clock::now();
     
     setShouldDisplay(now);
@@ -105,6 +120,49 @@ bool ClockGenerator::tick() {
     return true;
 }
 
+bool ClockGenerator::tickBatch() {
+    size_t batch = BATCH_STEPS;
+
+    switch (displayMode) {
+        case DisplayMode::EVERY_FRAME:
+            if (displayCallback) {
+                displayCallback();
+                batch = 1;
+            }
+            break;
+
+        case DisplayMode::FIXED_FPS:
+            if (timingMode == TimingMode::VIRTUAL_TIME && displayFrequency > 0) {
+                auto step = static_cast<double>(simulator->getStep());
+                if (step >= nextDisplayStep) {
+                    if (displayCallback) {
+                        displayCallback();
+                    }
+                    double stepsPerFrame = simulationFrequency / displayFrequency;
+                    while (nextDisplayStep <= step) {
+                        nextDisplayStep += stepsPerFrame;
+                    }
+                }
+                auto untilFrame = static_cast<size_t>(nextDisplayStep - step);
+                batch = std::clamp<size_t>(untilFrame, 1, BATCH_STEPS);
+            } else {
+                auto now = std::chrono::steady_clock::now();
+                setShouldDisplay(now);
+                if (shouldDisplay && displayCallback) {
+                    lastDisplayTick = now;
+                    displayCallback();
+                }
+            }
+            break;
+
+        case DisplayMode::RESULT:
+            break;
+    }
+
+    simulator->runFor(batch);
+    return simulator->getState() == Simulator::State::RUNNING;
+}
+
 void ClockGenerator::run() {
     start();
     
@@ -116,14 +174,14 @@ void ClockGenerator::run() {
 }
 
 double ClockGenerator::getSimulationFrequency() const {
-    return 1000000.0 / simulationPeriod.count();
+    return simulationFrequency;
 }
 
 double ClockGenerator::getDisplayFrequency() const {
     if (displayMode == DisplayMode::EVERY_FRAME) {
         return getSimulationFrequency();
     } else {
-        return 1000000.0 / displayPeriod.count();
+        return displayFrequency;
     }
 }
 
@@ -131,6 +189,17 @@ ClockGenerator::DisplayMode ClockGenerator::getDisplayMode() const {
     return displayMode;
 }
 
+ClockGenerator::TimingMode ClockGenerator::getTimingMode() const {
+    return timingMode;
+}
+
+std::chrono::duration<double> ClockGenerator::getVirtualTime() const {
+    if (!simulator) {
+        return std::chrono::duration<double>(0);
+    }
+    return std::chrono::duration<double>(simulator->getStep() / simulationFrequency);
+}
+
 bool ClockGenerator::isRunning() const {
     return simulator && simulator->getState() == Simulator::State::RUNNING;
 }
@@ -0,0 +1,109 @@
+#include "file.h"
+
+#include <iostream>
+#include <iterator>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CPUEMUL_HAS_MMAP
+#endif
+
+namespace {
+    std::expected<std::string, file::FileError> readStream(std::istream& in){
+        std::string buffer(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>{});
+        if (in.bad())
+            return std::unexpected(file::FileError::ReadError);
+        if (buffer.empty())
+            return std::unexpected(file::FileError::EmptyFile);
+        return buffer;
+    }
+}
+
+file::Mapping::~Mapping(){
+    release();
+}
+
+file::Mapping::Mapping(Mapping&& other) noexcept{
+    *this = std::move(other);
+}
+
+file::Mapping& file::Mapping::operator=(Mapping&& other) noexcept{
+    if (this == &other)
+        return *this;
+    release();
+    mapping = std::exchange(other.mapping, nullptr);
+    buffer = std::move(other.buffer);
+    // A short buffer lives inside the string object, so re-point at ours.
+    data = mapping ? other.data : buffer.data();
+    size = std::exchange(other.size, 0);
+    other.data = nullptr;
+    return *this;
+}
+
+void file::Mapping::release(){
+#if defined(CPUEMUL_HAS_MMAP)
+    if (mapping)
+        ::munmap(mapping, size);
+#endif
+    mapping = nullptr;
+    buffer.clear();
+    data = nullptr;
+    size = 0;
+}
+
+std::expected<file::Mapping, file::FileError> file::map(const std::filesystem::path& filepath){
+    Mapping result;
+    auto adopt = [&result](std::expected<std::string, FileError> buffer) -> std::expected<Mapping, FileError>{
+        if (!buffer)
+            return std::unexpected(buffer.error());
+        result.buffer = std::move(*buffer);
+        result.data = result.buffer.data();
+        result.size = result.buffer.size();
+        return std::move(result);
+    };
+
+    if (filepath == "-")
+        return adopt(readStream(std::cin));
+
+    std::error_code ec;
+    auto status = std::filesystem::status(filepath, ec);
+    if (ec || !std::filesystem::exists(status))
+        return std::unexpected(FileError::FileNotFound);
+    if (std::filesystem::is_directory(status))
+        return std::unexpected(FileError::NotAFile);
+
+#if defined(CPUEMUL_HAS_MMAP)
+    if (std::filesystem::is_regular_file(status)){
+        int fd = ::open(filepath.c_str(), O_RDONLY);
+        if (fd < 0)
+            return std::unexpected(errno == EACCES ? FileError::AccessDenied : FileError::ReadError);
+        struct stat info;
+        if (::fstat(fd, &info) != 0){
+            ::close(fd);
+            return std::unexpected(FileError::ReadError);
+        }
+        if (info.st_size == 0){
+            ::close(fd);
+            return std::unexpected(FileError::EmptyFile);
+        }
+        void* mapped = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped != MAP_FAILED){
+            result.mapping = mapped;
+            result.data = static_cast<const char*>(mapped);
+            result.size = info.st_size;
+            return result;
+        }
+    }
+#endif
+
+    std::ifstream in(filepath, std::ios::binary);
+    if (!in)
+        return std::unexpected(FileError::AccessDenied);
+    return adopt(readStream(in));
+}
@@ -0,0 +1,187 @@
+#include "image_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <random>
+
+namespace {
+    constexpr char MAGIC[8] = {'C', 'P', 'U', 'I', 'M', 'A', 'G', 'E'};
+    constexpr std::string_view ENTRY_EXTENSION = ".img";
+    constexpr std::string_view TEMP_EXTENSION = ".tmp";
+    // Temporary files this old belong to a writer that died before renaming.
+    constexpr auto STALE_TEMP_AGE = std::chrono::hours(1);
+
+    struct Header{
+        char magic[8];
+        uint32_t assemblerVersion;
+        uint32_t count;
+        uint32_t dmemSize;
+        uint32_t noteSize;
+        uint64_t sourceSize;
+        uint64_t sourceHash;
+        uint64_t checksum;
+    };
+
+    uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull){
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i){
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    // Two independent 64-bit hashes of the source: the first names the entry
+    // together with the version, memory sizes and optimization, the second
+    // is checked inside it.
+    uint64_t keyHash(std::string_view source, size_t count, size_t dmemSize, bool optimized){
+        uint64_t prefix[4] = {ImageCache::ASSEMBLER_VERSION, count, dmemSize, optimized};
+        return fnv1a(source.data(), source.size(), fnv1a(prefix, sizeof(prefix)));
+    }
+    uint64_t sourceHash(std::string_view source){
+        return fnv1a(source.data(), source.size(), 0x84222325cbf29ce4ull);
+    }
+
+    std::filesystem::path temporaryPath(const std::filesystem::path& entry){
+        static std::atomic<uint64_t> counter{0};
+        static const uint64_t process = std::random_device{}();
+        std::filesystem::path path = entry;
+        path += std::format(".{:x}.{:x}{}", process, counter++, TEMP_EXTENSION);
+        return path;
+    }
+}
+
+std::optional<std::filesystem::path> ImageCache::defaultDirectory(){
+    if (const char* cacheHome = std::getenv("XDG_CACHE_HOME"); cacheHome && *cacheHome == '/')
+        return std::filesystem::path(cacheHome) / "cpuemul";
+    if (const char* home = std::getenv("HOME"); home && *home)
+        return std::filesystem::path(home) / ".cache" / "cpuemul";
+    return std::nullopt;
+}
+
+ImageCache::ImageCache(std::filesystem::path directory, uint64_t maxBytes)
+    : directory(std::move(directory)), maxBytes(maxBytes){
+    std::error_code ec;
+    std::filesystem::create_directories(this->directory, ec);
+}
+
+std::filesystem::path ImageCache::entryPath(std::string_view source, size_t count, size_t dmemSize,
+    bool optimized) const{
+    return directory / std::format("{:016x}{}", keyHash(source, count, dmemSize, optimized), ENTRY_EXTENSION);
+}
+
+std::optional<ImageCache::Words> ImageCache::loadWords(std::string_view source, size_t count, size_t dmemSize,
+    bool optimized) const{
+    std::filesystem::path path = entryPath(source, count, dmemSize, optimized);
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return std::nullopt;
+
+    Header header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return std::nullopt;
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+        || header.assemblerVersion != ASSEMBLER_VERSION
+        || header.count != count
+        || header.dmemSize != dmemSize
+        || header.sourceSize != source.size()
+        || header.sourceHash != sourceHash(source))
+        return std::nullopt;
+
+    Words entry{std::vector<uint16_t>(count), std::string(header.noteSize, '\0')};
+    if (!in.read(reinterpret_cast<char*>(entry.words.data()), count * sizeof(uint16_t))
+        || !in.read(entry.note.data(), entry.note.size()))
+        return std::nullopt;
+    uint64_t checksum = fnv1a(entry.words.data(), count * sizeof(uint16_t));
+    if (fnv1a(entry.note.data(), entry.note.size(), checksum) != header.checksum)
+        return std::nullopt;
+
+    // The mtime doubles as the last-use time for eviction.
+    std::error_code ec;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+    return entry;
+}
+
+bool ImageCache::storeWords(std::string_view source, std::span<const uint16_t> words, size_t dmemSize,
+    bool optimized, std::string_view note) const{
+    std::filesystem::path path = entryPath(source, words.size(), dmemSize, optimized);
+    std::filesystem::path temporary = temporaryPath(path);
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.assemblerVersion = ASSEMBLER_VERSION;
+    header.count = words.size();
+    header.dmemSize = dmemSize;
+    header.noteSize = note.size();
+    header.sourceSize = source.size();
+    header.sourceHash = sourceHash(source);
+    header.checksum = fnv1a(note.data(), note.size(), fnv1a(words.data(), words.size_bytes()));
+
+    std::error_code ec;
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(words.data()), words.size_bytes());
+        out.write(note.data(), note.size());
+        out.close();
+        if (!out){
+            std::filesystem::remove(temporary, ec);
+            return false;
+        }
+    }
+    // rename() replaces the entry atomically, so a concurrent reader sees
+    // either the old file or the complete new one.
+    std::filesystem::rename(temporary, path, ec);
+    if (ec){
+        std::filesystem::remove(temporary, ec);
+        return false;
+    }
+    evict();
+    return true;
+}
+
+void ImageCache::evict() const{
+    struct Entry{
+        std::filesystem::file_time_type lastUse;
+        uint64_t size;
+        std::filesystem::path path;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    auto now = std::filesystem::file_time_type::clock::now();
+
+    std::error_code ec;
+    for (const auto& file : std::filesystem::directory_iterator(directory, ec)){
+        std::error_code entryError;
+        auto lastUse = file.last_write_time(entryError);
+        uint64_t size = file.file_size(entryError);
+        if (entryError)
+            continue;
+        std::filesystem::path extension = file.path().extension();
+        if (extension == TEMP_EXTENSION){
+            if (now - lastUse > STALE_TEMP_AGE)
+                std::filesystem::remove(file.path(), entryError);
+            continue;
+        }
+        if (extension != ENTRY_EXTENSION)
+            continue;
+        entries.push_back(Entry{lastUse, size, file.path()});
+        total += size;
+    }
+    if (total <= maxBytes)
+        return;
+
+    std::ranges::sort(entries, {}, &Entry::lastUse);
+    for (const Entry& entry : entries){
+        if (total <= maxBytes)
+            break;
+        // Another process may have evicted it already; either way it is gone.
+        std::filesystem::remove(entry.path, ec);
+        total -= entry.size;
+    }
+}
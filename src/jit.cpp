@@ -0,0 +1,620 @@
+#include "jit.h"
+
+#if defined(CPUEMUL_JIT)
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+namespace jit{
+
+namespace {
+    constexpr size_t CODE_SIZE = 4 << 20;
+    constexpr size_t MAX_BLOCK_LENGTH = 256;
+    constexpr size_t MAX_INSTRUCTION_BYTES = 128;
+
+    // Layout shared with the generated code; offsets are baked into the encodings below.
+    struct MachineState{
+        uint32_t PC;
+        uint32_t ACC;
+        uint8_t Z;
+        uint8_t C;
+        uint8_t trapped;
+        uint8_t padding;
+        uint32_t lastPC;
+        uint64_t budget;
+        uint32_t* const* pages;
+    };
+
+    constexpr uint8_t OFFSET_PC = offsetof(MachineState, PC);
+    constexpr uint8_t OFFSET_ACC = offsetof(MachineState, ACC);
+    constexpr uint8_t OFFSET_Z = offsetof(MachineState, Z);
+    constexpr uint8_t OFFSET_C = offsetof(MachineState, C);
+    constexpr uint8_t OFFSET_TRAPPED = offsetof(MachineState, trapped);
+    constexpr uint8_t OFFSET_LAST_PC = offsetof(MachineState, lastPC);
+    constexpr uint8_t OFFSET_BUDGET = offsetof(MachineState, budget);
+    constexpr uint8_t OFFSET_PAGES = offsetof(MachineState, pages);
+
+    constexpr uint8_t LIVE_Z = 1;
+    constexpr uint8_t LIVE_C = 2;
+
+    bool writesZ(MicroOp op){
+        switch (op){
+            case MicroOp::NOP:
+            case MicroOp::STORE_L: case MicroOp::STORE_M:
+            case MicroOp::JMP_L: case MicroOp::JMP_M:
+            case MicroOp::JZ_L: case MicroOp::JZ_M:
+            case MicroOp::JNZ_L: case MicroOp::JNZ_M:
+            case MicroOp::JC_L: case MicroOp::JC_M:
+            case MicroOp::JNC_L: case MicroOp::JNC_M:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    bool writesC(MicroOp op){
+        switch (op){
+            case MicroOp::ADD_L: case MicroOp::ADD_M:
+            case MicroOp::SUB_L: case MicroOp::SUB_M:
+            case MicroOp::INC:
+            case MicroOp::DEC:
+            case MicroOp::SHL_L: case MicroOp::SHL_M:
+            case MicroOp::SHR_L: case MicroOp::SHR_M:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool isJump(MicroOp op){
+        return op >= MicroOp::JMP_L && op <= MicroOp::JNC_M;
+    }
+
+    // Indirect accesses leave the block early when their address is out of
+    // DMEM, so the flags must be exact before them.
+    bool canTrap(MicroOp op){
+        return op == MicroOp::STORE_M || op == MicroOp::LOADI_M;
+    }
+}
+
+// Register assignment inside generated code. Generated code never calls out,
+// so blocks chain into each other with everything kept in registers; only the
+// entry/exit stubs move state between MachineState and the registers.
+//   r12 - MachineState*     rbp - DMEM page table
+//   rax - page of the current memory operand
+//   ecx, edx - scratch for shifts and indirect addresses
+//   ebx - ACC               r13d - Z (0/1)
+//   r14d - C (0/1)          r15 - remaining instruction budget
+//   r8d - next PC           r9d - PC of the last executed instruction
+
+Compiler::Compiler(const DecodedInstruction* program, size_t programSize, size_t dmemSize, size_t pageShift)
+    : program(program, program + programSize), dmemSize(dmemSize), pageShift(pageShift){
+
+    // Blocks are compiled from the plain instruction stream; superinstructions
+    // only matter to the interpreter.
+    for (DecodedInstruction& instr : this->program)
+        instr.op = instr.base;
+
+    void* memory = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return;
+
+    code = static_cast<uint8_t*>(memory);
+    cursor = code;
+    codeEnd = code + CODE_SIZE;
+    emitRuntime();
+    blocksBegin = cursor;
+    reset();
+}
+
+Compiler::~Compiler(){
+    if (code)
+        munmap(code, CODE_SIZE);
+}
+
+void Compiler::emit(std::initializer_list<uint8_t> bytes){
+    for (uint8_t byte : bytes)
+        *cursor++ = byte;
+}
+
+void Compiler::emit32(uint32_t value){
+    std::memcpy(cursor, &value, sizeof(value));
+    cursor += sizeof(value);
+}
+
+void Compiler::chain(uint8_t* rel32, uint8_t* target){
+    int32_t displacement = static_cast<int32_t>(target - (rel32 + 4));
+    std::memcpy(rel32, &displacement, sizeof(displacement));
+}
+
+void Compiler::emitRuntime(){
+    enter = reinterpret_cast<void (*)(void*, void*)>(cursor);
+    emit({0x53});                               // push rbx
+    emit({0x55});                               // push rbp
+    emit({0x41, 0x54});                         // push r12
+    emit({0x41, 0x55});                         // push r13
+    emit({0x41, 0x56});                         // push r14
+    emit({0x41, 0x57});                         // push r15
+    emit({0x48, 0x83, 0xEC, 0x08});             // sub rsp, 8
+    emit({0x49, 0x89, 0xFC});                   // mov r12, rdi
+    emit({0x49, 0x8B, 0x6C, 0x24, OFFSET_PAGES});        // mov rbp, [r12+pages]
+    emit({0x41, 0x8B, 0x5C, 0x24, OFFSET_ACC});         // mov ebx, [r12+ACC]
+    emit({0x45, 0x0F, 0xB6, 0x6C, 0x24, OFFSET_Z});     // movzx r13d, byte [r12+Z]
+    emit({0x45, 0x0F, 0xB6, 0x74, 0x24, OFFSET_C});     // movzx r14d, byte [r12+C]
+    emit({0x4D, 0x8B, 0x7C, 0x24, OFFSET_BUDGET});      // mov r15, [r12+budget]
+    emit({0x45, 0x8B, 0x44, 0x24, OFFSET_PC});          // mov r8d, [r12+PC]
+    emit({0x45, 0x8B, 0x4C, 0x24, OFFSET_LAST_PC});     // mov r9d, [r12+lastPC]
+    emit({0xFF, 0xE6});                         // jmp rsi
+
+    exitStub = cursor;
+    emit({0x41, 0x89, 0x5C, 0x24, OFFSET_ACC});         // mov [r12+ACC], ebx
+    emit({0x45, 0x88, 0x6C, 0x24, OFFSET_Z});           // mov [r12+Z], r13b
+    emit({0x45, 0x88, 0x74, 0x24, OFFSET_C});           // mov [r12+C], r14b
+    emit({0x4D, 0x89, 0x7C, 0x24, OFFSET_BUDGET});      // mov [r12+budget], r15
+    emit({0x45, 0x89, 0x44, 0x24, OFFSET_PC});          // mov [r12+PC], r8d
+    emit({0x45, 0x89, 0x4C, 0x24, OFFSET_LAST_PC});     // mov [r12+lastPC], r9d
+    emit({0x48, 0x83, 0xC4, 0x08});             // add rsp, 8
+    emit({0x41, 0x5F});                         // pop r15
+    emit({0x41, 0x5E});                         // pop r14
+    emit({0x41, 0x5D});                         // pop r13
+    emit({0x41, 0x5C});                         // pop r12
+    emit({0x5D});                               // pop rbp
+    emit({0x5B});                               // pop rbx
+    emit({0xC3});                               // ret
+}
+
+void Compiler::reset(){
+    cursor = blocksBegin;
+    blocks.assign(program.size(), Block{});
+    pendingChains.assign(program.size(), {});
+}
+
+Compiler::Block& Compiler::blockAt(uint32_t pc){
+    if (!blocks[pc].compiled)
+        compile(pc);
+    return blocks[pc];
+}
+
+bool Compiler::isSupported(const DecodedInstruction& instr) const{
+    switch (instr.op){
+        case MicroOp::NOP:
+        case MicroOp::LOAD_L:
+        case MicroOp::INC:
+        case MicroOp::DEC:
+        case MicroOp::NOT:
+        case MicroOp::ADD_L:
+        case MicroOp::SUB_L:
+        case MicroOp::AND_L:
+        case MicroOp::OR_L:
+        case MicroOp::XOR_L:
+        case MicroOp::SHL_L:
+        case MicroOp::SHR_L:
+        case MicroOp::JMP_L:
+        case MicroOp::JZ_L:
+        case MicroOp::JNZ_L:
+        case MicroOp::JC_L:
+        case MicroOp::JNC_L:
+            return true;
+
+        case MicroOp::LOAD_M:
+        case MicroOp::STORE_L:
+        case MicroOp::LOADI_L:
+        case MicroOp::ADD_M:
+        case MicroOp::SUB_M:
+        case MicroOp::AND_M:
+        case MicroOp::OR_M:
+        case MicroOp::XOR_M:
+        case MicroOp::SHL_M:
+        case MicroOp::SHR_M:
+        case MicroOp::STORE_M:
+        case MicroOp::LOADI_M:
+        case MicroOp::JMP_M:
+        case MicroOp::JZ_M:
+        case MicroOp::JNZ_M:
+        case MicroOp::JC_M:
+        case MicroOp::JNC_M:
+            return instr.operand < dmemSize;
+
+        default:
+            return false;
+    }
+}
+
+void Compiler::compile(uint32_t start){
+    size_t worstCase = (MAX_BLOCK_LENGTH + 2) * MAX_INSTRUCTION_BYTES;
+    if (static_cast<size_t>(codeEnd - cursor) < worstCase)
+        reset();
+
+    Block& block = blocks[start];
+    block.compiled = true;
+    if (!isSupported(program[start]))
+        return;
+
+    uint32_t imemEnd = static_cast<uint32_t>(program.size() - 1);
+    uint32_t end = start;
+    while (end - start < MAX_BLOCK_LENGTH && isSupported(program[end])){
+        if (isJump(program[end++].op))
+            break;
+    }
+    uint32_t length = end - start;
+
+    // Flags are only materialised when something can observe them before the
+    // next write: a later branch in this block or anything after the block.
+    std::vector<uint8_t> liveFlags(length);
+    bool zLive = true;
+    bool cLive = true;
+    for (uint32_t i = length; i-- > 0;){
+        MicroOp op = program[start + i].op;
+        liveFlags[i] = (zLive ? LIVE_Z : 0) | (cLive ? LIVE_C : 0);
+        if (writesZ(op))
+            zLive = false;
+        if (writesC(op))
+            cLive = false;
+        if (op == MicroOp::JZ_L || op == MicroOp::JNZ_L || op == MicroOp::JZ_M || op == MicroOp::JNZ_M)
+            zLive = true;
+        if (op == MicroOp::JC_L || op == MicroOp::JNC_L || op == MicroOp::JC_M || op == MicroOp::JNC_M)
+            cLive = true;
+        if (canTrap(op))
+            zLive = cLive = true;
+    }
+
+    // The whole block is charged against the budget up front; if it does not
+    // fit, control returns to the caller, which finishes in the interpreter.
+    block.entry = cursor;
+    block.length = length;
+    emit({0x49, 0x81, 0xFF});                   // cmp r15, length
+    emit32(length);
+    emit({0x0F, 0x82});                         // jb exit
+    emit32(0);
+    chain(cursor - 4, exitStub);
+    emit({0x49, 0x81, 0xEF});                   // sub r15, length
+    emit32(length);
+
+    for (uint32_t pc = start; pc < end; ++pc){
+        const DecodedInstruction& instr = program[pc];
+        if (instr.op == MicroOp::JMP_L){
+            emitExit(std::min(instr.operand, imemEnd), pc);
+        } else if (instr.op == MicroOp::JZ_L || instr.op == MicroOp::JNZ_L ||
+                   instr.op == MicroOp::JC_L || instr.op == MicroOp::JNC_L){
+            emitCondition(instr.op);
+            uint8_t* notTaken = cursor - 4;
+            emitExit(std::min(instr.operand, imemEnd), pc);
+            chain(notTaken, cursor);
+            emitExit(pc + 1, pc);
+        } else if (instr.op == MicroOp::JMP_M){
+            emitIndirectExit(instr, pc);
+        } else if (isJump(instr.op)){
+            emitCondition(instr.op);
+            uint8_t* notTaken = cursor - 4;
+            emitIndirectExit(instr, pc);
+            chain(notTaken, cursor);
+            emitExit(pc + 1, pc);
+        } else if (canTrap(instr.op)){
+            emitIndirect(instr, liveFlags[pc - start], pc, end - pc, pc == start ? NO_PC : pc - 1);
+            if (pc + 1 == end)
+                emitExit(end, pc);
+        } else {
+            emitInstruction(instr, liveFlags[pc - start]);
+            if (pc + 1 == end)
+                emitExit(end, pc);
+        }
+    }
+
+    for (uint8_t* rel32 : pendingChains[start])
+        chain(rel32, block.entry);
+    pendingChains[start].clear();
+}
+
+// Emits a jump over the taken-branch exit, i.e. to the not-taken path.
+// Note JC shares JNC's condition, mirroring CPU::JC.
+void Compiler::emitCondition(MicroOp op){
+    switch (op){
+        case MicroOp::JZ_L:
+        case MicroOp::JZ_M:
+            emit({0x45, 0x85, 0xED});           // test r13d, r13d
+            emit({0x0F, 0x84});                 // jz not_taken
+            break;
+        case MicroOp::JNZ_L:
+        case MicroOp::JNZ_M:
+            emit({0x45, 0x85, 0xED});           // test r13d, r13d
+            emit({0x0F, 0x85});                 // jnz not_taken
+            break;
+        default:
+            emit({0x45, 0x85, 0xF6});           // test r14d, r14d
+            emit({0x0F, 0x85});                 // jnz not_taken
+            break;
+    }
+    emit32(0);
+}
+
+void Compiler::emitExit(uint32_t target, uint32_t lastPC){
+    emit({0x41, 0xB8});                         // mov r8d, target
+    emit32(target);
+    emit({0x41, 0xB9});                         // mov r9d, lastPC
+    emit32(lastPC);
+    emit({0xE9});                               // jmp block or exit
+    emit32(0);
+    uint8_t* rel32 = cursor - 4;
+
+    const Block& block = blocks[target];
+    if (block.compiled && block.entry){
+        chain(rel32, block.entry);
+    } else {
+        chain(rel32, exitStub);
+        if (!block.compiled)
+            pendingChains[target].push_back(rel32);
+    }
+}
+
+// A jump through memory leaves to run(), which looks the target block up.
+void Compiler::emitIndirectExit(const DecodedInstruction& instr, uint32_t lastPC){
+    uint32_t imemEnd = static_cast<uint32_t>(program.size() - 1);
+    emit({0x48, 0x8B, 0x85});                   // mov rax, [rbp+page]
+    emit32((instr.operand >> pageShift) * 8);
+    emit({0x8B, 0x88});                         // mov ecx, [rax+address]
+    emit32((instr.operand & ((1u << pageShift) - 1)) * 4);
+    emit({0xBA});                               // mov edx, imemEnd
+    emit32(imemEnd);
+    emit({0x39, 0xD1});                         // cmp ecx, edx
+    emit({0x0F, 0x47, 0xCA});                   // cmova ecx, edx
+    emit({0x41, 0x89, 0xC8});                   // mov r8d, ecx
+    emit({0x41, 0xB9});                         // mov r9d, lastPC
+    emit32(lastPC);
+    emit({0xE9});                               // jmp exit
+    emit32(0);
+    chain(cursor - 4, exitStub);
+}
+
+// STORE_M and LOADI_M. An address outside DMEM refunds the rest of the
+// block and leaves before the instruction retires, so the interpreter
+// raises the fault.
+void Compiler::emitIndirect(const DecodedInstruction& instr, uint8_t liveFlags, uint32_t pc, uint32_t refund, uint32_t lastPC){
+    emit({0x48, 0x8B, 0x85});                   // mov rax, [rbp+page]
+    emit32((instr.operand >> pageShift) * 8);
+    emit({0x8B, 0x88});                         // mov ecx, [rax+address]
+    emit32((instr.operand & ((1u << pageShift) - 1)) * 4);
+    emit({0x81, 0xF9});                         // cmp ecx, dmemSize
+    emit32(static_cast<uint32_t>(dmemSize));
+    emit({0x0F, 0x82});                         // jb inside
+    emit32(0);
+    uint8_t* inside = cursor - 4;
+
+    emit({0x49, 0x81, 0xC7});                   // add r15, refund
+    emit32(refund);
+    emit({0x41, 0xB8});                         // mov r8d, pc
+    emit32(pc);
+    if (lastPC != NO_PC){
+        emit({0x41, 0xB9});                     // mov r9d, lastPC
+        emit32(lastPC);
+    }
+    emit({0x41, 0xC6, 0x44, 0x24, OFFSET_TRAPPED, 0x01});  // mov byte [r12+trapped], 1
+    emit({0xE9});                               // jmp exit
+    emit32(0);
+    chain(cursor - 4, exitStub);
+
+    chain(inside, cursor);
+    emit({0x89, 0xCA});                         // mov edx, ecx
+    emit({0xC1, 0xEA, static_cast<uint8_t>(pageShift)});   // shr edx, pageShift
+    emit({0x81, 0xE1});                         // and ecx, pageMask
+    emit32((1u << pageShift) - 1);
+    emit({0x48, 0x8B, 0x44, 0xD5, 0x00});       // mov rax, [rbp+rdx*8]
+    if (instr.op == MicroOp::STORE_M){
+        emit({0x89, 0x1C, 0x88});               // mov [rax+rcx*4], ebx
+    } else {
+        emit({0x8B, 0x1C, 0x88});               // mov ebx, [rax+rcx*4]
+        if (liveFlags & LIVE_Z){
+            emit({0x85, 0xDB});                 // test ebx, ebx
+            emit({0x41, 0x0F, 0x94, 0xC5});     // setz r13b
+        }
+    }
+}
+
+void Compiler::emitInstruction(const DecodedInstruction& instr, uint8_t liveFlags){
+    const uint32_t value = instr.operand;
+    const uint32_t address = (instr.operand & ((1u << pageShift) - 1)) * 4;
+
+    auto page = [&](){
+        emit({0x48, 0x8B, 0x85});               // mov rax, [rbp+page]
+        emit32((instr.operand >> pageShift) * 8);
+    };
+    const bool zLive = liveFlags & LIVE_Z;
+    const bool cLive = liveFlags & LIVE_C;
+
+    auto setZ = [&](){
+        if (zLive)
+            emit({0x41, 0x0F, 0x94, 0xC5});     // setz r13b
+    };
+    auto setCZ = [&](){
+        if (cLive)
+            emit({0x41, 0x0F, 0x92, 0xC6});     // setc r14b
+        setZ();
+    };
+    auto testAcc = [&](){
+        if (zLive)
+            emit({0x85, 0xDB});                 // test ebx, ebx
+    };
+    auto zeroShift = [&](){
+        if (cLive)
+            emit({0x45, 0x31, 0xF6});           // xor r14d, r14d
+        testAcc();
+        setZ();
+    };
+    auto dynamicShift = [&](uint8_t modrm){
+        page();
+        emit({0x8B, 0x88});                     // mov ecx, [rax+address]
+        emit32(address);
+        emit({0x83, 0xE1, 0x1F});               // and ecx, 31
+        emit({0x0F, 0x84});                     // jz zero
+        emit32(0);
+        uint8_t* zero = cursor - 4;
+        emit({0xD3, modrm});                    // shl/shr ebx, cl
+        setCZ();
+        emit({0xE9});                           // jmp done
+        emit32(0);
+        uint8_t* done = cursor - 4;
+        chain(zero, cursor);
+        zeroShift();
+        chain(done, cursor);
+    };
+
+    switch (instr.op){
+        case MicroOp::NOP:
+            break;
+
+        case MicroOp::LOAD_L:
+            emit({0xBB});                       // mov ebx, imm32
+            emit32(value);
+            if (zLive){
+                emit({0x41, 0xBD});             // mov r13d, imm32
+                emit32(value == 0);
+            }
+            break;
+        case MicroOp::LOAD_M:
+        case MicroOp::LOADI_L:
+            page();
+            emit({0x8B, 0x98});                 // mov ebx, [rax+address]
+            emit32(address);
+            testAcc();
+            setZ();
+            break;
+        case MicroOp::STORE_L:
+            page();
+            emit({0x89, 0x98});                 // mov [rax+address], ebx
+            emit32(address);
+            break;
+
+        case MicroOp::ADD_L:
+            emit({0x81, 0xC3});                 // add ebx, imm32
+            emit32(value);
+            setCZ();
+            break;
+        case MicroOp::ADD_M:
+            page();
+            emit({0x03, 0x98});                 // add ebx, [rax+address]
+            emit32(address);
+            setCZ();
+            break;
+        case MicroOp::SUB_L:
+            emit({0x81, 0xEB});                 // sub ebx, imm32
+            emit32(value);
+            setCZ();
+            break;
+        case MicroOp::SUB_M:
+            page();
+            emit({0x2B, 0x98});                 // sub ebx, [rax+address]
+            emit32(address);
+            setCZ();
+            break;
+        case MicroOp::INC:
+            emit({0x83, 0xC3, 0x01});           // add ebx, 1
+            setCZ();
+            break;
+        case MicroOp::DEC:
+            emit({0x83, 0xEB, 0x01});           // sub ebx, 1
+            setCZ();
+            break;
+
+        case MicroOp::AND_L:
+            emit({0x81, 0xE3});                 // and ebx, imm32
+            emit32(value);
+            setZ();
+            break;
+        case MicroOp::AND_M:
+            page();
+            emit({0x23, 0x98});                 // and ebx, [rax+address]
+            emit32(address);
+            setZ();
+            break;
+        case MicroOp::OR_L:
+            emit({0x81, 0xCB});                 // or ebx, imm32
+            emit32(value);
+            setZ();
+            break;
+        case MicroOp::OR_M:
+            page();
+            emit({0x0B, 0x98});                 // or ebx, [rax+address]
+            emit32(address);
+            setZ();
+            break;
+        case MicroOp::XOR_L:
+            emit({0x81, 0xF3});                 // xor ebx, imm32
+            emit32(value);
+            setZ();
+            break;
+        case MicroOp::XOR_M:
+            page();
+            emit({0x33, 0x98});                 // xor ebx, [rax+address]
+            emit32(address);
+            setZ();
+            break;
+        case MicroOp::NOT:
+            emit({0x85, 0xDB});                 // test ebx, ebx
+            emit({0x0F, 0x94, 0xC0});           // setz al
+            if (zLive)
+                emit({0x41, 0x0F, 0x95, 0xC5}); // setnz r13b
+            emit({0x0F, 0xB6, 0xD8});           // movzx ebx, al
+            break;
+
+        case MicroOp::SHL_L:
+            if (value == 0){
+                zeroShift();
+            } else {
+                emit({0xC1, 0xE3, static_cast<uint8_t>(value)});    // shl ebx, imm8
+                setCZ();
+            }
+            break;
+        case MicroOp::SHR_L:
+            if (value == 0){
+                zeroShift();
+            } else {
+                emit({0xC1, 0xEB, static_cast<uint8_t>(value)});    // shr ebx, imm8
+                setCZ();
+            }
+            break;
+        case MicroOp::SHL_M:
+            dynamicShift(0xE3);
+            break;
+        case MicroOp::SHR_M:
+            dynamicShift(0xEB);
+            break;
+
+        default:
+            break;
+    }
+}
+
+Compiler::Result Compiler::run(uint32_t& PC, uint32_t& ACC, bool& Z, bool& C, uint32_t* const* pages, size_t budget){
+    MachineState state{PC, ACC, Z, C, 0, 0, NO_PC, budget, pages};
+    Result result;
+
+    while (state.budget > 0){
+        Block& block = blockAt(state.PC);
+        if (!block.entry){
+            result.fallback = true;
+            break;
+        }
+        if (block.length > state.budget)
+            break;
+        enter(&state, block.entry);
+        if (state.trapped){
+            result.fallback = true;
+            break;
+        }
+    }
+
+    PC = state.PC;
+    ACC = state.ACC;
+    Z = state.Z;
+    C = state.C;
+    result.executed = budget - state.budget;
+    result.lastPC = state.lastPC;
+    return result;
+}
+
+}
+
+#endif
@@ -7,13 +7,31 @@
 #include "cpu.h"
 #include "clock_generator.h"
 #include <format>
+#include <fstream>
 
 #include "cpu_state_out.h"
 #include "file.h"
 #include "data_reader.h"
+#include "batch_runner.h"
+#include "trace.h"
+#include "async_display.h"
+#include "profiler.h"
+#include "loop_detector.h"
+#include "image_cache.h"
+#include "program_image.h"
+#include "optimizer.h"
+#include "checkpoint.h"
 
 #include "CLI11.hpp"
 
+ClockGenerator::TimingMode multiplexTimingFlags(bool isMaxSpeed, bool isVirtualTime){
+    if (isMaxSpeed)
+        return ClockGenerator::TimingMode::MAX_SPEED;
+    if (isVirtualTime)
+        return ClockGenerator::TimingMode::VIRTUAL_TIME;
+    return ClockGenerator::TimingMode::REAL_TIME;
+}
+
 ClockGenerator::DisplayMode multiplexDisplayFlags(bool isFPS, bool isResultOnly, bool isEveryStep){
     if (isFPS)
         return ClockGenerator::DisplayMode::FIXED_FPS;
@@ -26,6 +44,38 @@ ClockGenerator::DisplayMode multiplexDisplayFlags(bool isFPS, bool isResultOnly,
     return ClockGenerator::DisplayMode::EVERY_FRAME;
 }
 
+std::shared_ptr<const ImageCache> openImageCache(bool enabled, const std::optional<std::string>& directory){
+    if (directory)
+        return std::make_shared<const ImageCache>(*directory);
+    if (!enabled)
+        return nullptr;
+    auto defaultDirectory = ImageCache::defaultDirectory();
+    if (!defaultDirectory){
+        std::cerr << "No cache directory: set XDG_CACHE_HOME or HOME, or pass --cache-dir\n";
+        return nullptr;
+    }
+    return std::make_shared<const ImageCache>(*defaultDirectory);
+}
+
+// An existing file, or "-" for stdin, which file::map reads.
+const CLI::Validator ExistingFileOrStdin(
+    [](std::string& path){return path == "-" ? std::string() : CLI::ExistingFile(path);}, "FILE|-");
+
+template<uint32_t DMEM_SIZE>
+std::optional<std::array<uint32_t, DMEM_SIZE>> readDataFile(const std::string& path){
+    auto expectedDataSource = file::map(path);
+    if (!expectedDataSource){
+        std::cerr << file::toStr(expectedDataSource.error());
+        return std::nullopt;
+    }
+    auto expectedData = DataReader::parseData<DMEM_SIZE>(expectedDataSource->view());
+    if (!expectedData){
+        std::cerr << DataReader::toStr(expectedData.error().code);
+        return std::nullopt;
+    }
+    return *expectedData;
+}
+
 int main(int argc, char** argv){
 
     CLI::App app{"CPU Emulator"};
@@ -33,13 +83,13 @@ int main(int argc, char** argv){
     CLI::App* runCmd = app.add_subcommand("run", "Run assembly program");
 
     std::string assemblyPath;
-    runCmd->add_option("assembly", assemblyPath, "Assembly program file")
-        ->required()
-        ->check(CLI::ExistingFile);
+    auto assembly_option = runCmd->add_option("assembly", assemblyPath,
+        "Assembly program file or image written by 'assemble' ('-' for stdin)")
+        ->check(ExistingFileOrStdin);
 
     std::optional<std::string> dataPath;
-    runCmd->add_option("--datafile", dataPath, "Data file")
-        ->check(CLI::ExistingFile);
+    auto datafile_option = runCmd->add_option("--datafile", dataPath, "Data file ('-' for stdin)")
+        ->check(ExistingFileOrStdin);
 
     double hz = 100000;
     runCmd->add_option<double,unsigned int>("--hz", hz);
@@ -61,70 +111,535 @@ int main(int argc, char** argv){
     every_step_flag->excludes("--fps");
     every_step_flag->excludes("--result");
 
+    bool isLossless = false;
+    auto lossless_flag = runCmd->add_flag("--lossless", isLossless,
+        "With --fps, make the simulation wait for a slow terminal instead of dropping frames");
+    lossless_flag->needs(fps_option);
+
+    bool isMaxSpeed = false;
+    bool isVirtualTime = false;
+    auto max_speed_flag = runCmd->add_flag("--max-speed", isMaxSpeed, "Run unthrottled, ignoring --hz");
+    auto virtual_time_flag = runCmd->add_flag("--virtual-time", isVirtualTime,
+        "Run unthrottled and report the time the program would take at --hz");
+
+    max_speed_flag->excludes("--virtual-time");
+    virtual_time_flag->excludes("--max-speed");
+
+    bool useJit = false;
+    runCmd->add_flag("--jit", useJit, "Use the x86-64 JIT backend in --max-speed/--virtual-time runs");
+
+    bool useFusion = false;
+    runCmd->add_flag("--fuse", useFusion, "Fuse frequent instruction sequences into superinstructions");
+
+    bool useLoopAcceleration = false;
+    runCmd->add_flag("--accelerate-loops", useLoopAcceleration, "Run simple counted loops in closed form");
+
+    bool useOptimizer = false;
+    runCmd->add_flag("-O,--optimize", useOptimizer, "Optimize an assembly program before flashing it");
+
     bool showStep = false;
     runCmd->add_flag("--show-step,--ss", showStep, "Show CPU simulation step number");
+
+    std::optional<std::string> tracePath;
+    auto trace_option = runCmd->add_option("--trace", tracePath,
+        "Run unthrottled, recording every step to a binary trace file");
+    trace_option->excludes(fps_option);
+    trace_option->excludes(every_step_flag);
+    trace_option->excludes("--jit");
+
+    bool isProfile = false;
+    auto profile_flag = runCmd->add_flag("--profile", isProfile,
+        "Run unthrottled and print per-address, opcode, branch and DMEM counts at the end");
+    profile_flag->excludes(fps_option);
+    profile_flag->excludes(every_step_flag);
+    profile_flag->excludes(trace_option);
+    profile_flag->excludes("--jit");
+
+    bool detectLoops = false;
+    auto detect_loops_flag = runCmd->add_flag("--detect-loops", detectLoops,
+        "Run unthrottled and fail as soon as the program's state repeats");
+    detect_loops_flag->excludes(fps_option);
+    detect_loops_flag->excludes(every_step_flag);
+    detect_loops_flag->excludes(trace_option);
+    detect_loops_flag->excludes(profile_flag);
+    detect_loops_flag->excludes("--jit");
+
+    std::optional<size_t> checkpointEvery;
+    auto checkpoint_every_option = runCmd->add_option("--checkpoint-every", checkpointEvery,
+        "Run unthrottled, checkpointing the machine every N steps")
+        ->check(CLI::PositiveNumber);
+    std::optional<std::string> checkpointPath;
+    auto checkpoint_option = runCmd->add_option("--checkpoint", checkpointPath,
+        "Checkpoint file (default: the --resume file, or the program path with .checkpoint appended)");
+    checkpoint_option->needs(checkpoint_every_option);
+
+    std::optional<std::string> resumePath;
+    auto resume_option = runCmd->add_option("--resume", resumePath,
+        "Run unthrottled from the last checkpoint in a checkpoint file")
+        ->check(CLI::ExistingFile);
+    resume_option->excludes(assembly_option);
+    resume_option->excludes(datafile_option);
+
+    for (CLI::Option* option : std::initializer_list<CLI::Option*>{checkpoint_every_option, resume_option}){
+        option->excludes(fps_option);
+        option->excludes(every_step_flag);
+        option->excludes(trace_option);
+        option->excludes(profile_flag);
+        option->excludes(detect_loops_flag);
+    }
+
+    bool useCache = false;
+    runCmd->add_flag("--cache", useCache, "Reuse assembled images from the on-disk cache");
+
+    std::optional<std::string> cacheDir;
+    runCmd->add_option("--cache-dir", cacheDir, "Image cache directory (implies --cache)");
     
 
+    CLI::App* batchCmd = app.add_subcommand("batch", "Run many program/data jobs in parallel");
+
+    std::optional<std::string> manifestPath;
+    auto manifest_option = batchCmd->add_option("--manifest", manifestPath, "File of 'PROGRAM DATAFILE [BUDGET]' lines")
+        ->check(CLI::ExistingFile);
+
+    std::optional<std::string> batchProgramPath;
+    auto batch_program_option = batchCmd->add_option("--program", batchProgramPath, "Assembly program run on every file of --data-dir")
+        ->check(CLI::ExistingFile);
+
+    std::optional<std::string> dataDirPath;
+    auto data_dir_option = batchCmd->add_option("--data-dir", dataDirPath, "Directory of data files")
+        ->check(CLI::ExistingDirectory);
+
+    manifest_option->excludes(batch_program_option);
+    manifest_option->excludes(data_dir_option);
+    batch_program_option->needs(data_dir_option);
+    data_dir_option->needs(batch_program_option);
+
+    std::string outputPath;
+    batchCmd->add_option("--output,-o", outputPath, "Result file")
+        ->required();
+
+    size_t threadCount = 0;
+    batchCmd->add_option("--threads,-j", threadCount, "Worker threads (default: all cores)");
+
+    size_t stepBudget = 0;
+    batchCmd->add_option("--budget", stepBudget, "Default step budget per job");
+
+    size_t timeoutMs = 0;
+    batchCmd->add_option("--timeout", timeoutMs, "Wall-clock limit per job in milliseconds");
+
+    bool batchFusion = false;
+    batchCmd->add_flag("--fuse", batchFusion, "Fuse frequent instruction sequences into superinstructions");
+
+    bool batchLoopAcceleration = false;
+    batchCmd->add_flag("--accelerate-loops", batchLoopAcceleration, "Run simple counted loops in closed form");
+
+    bool batchOptimizer = false;
+    batchCmd->add_flag("-O,--optimize", batchOptimizer, "Optimize programs before flashing them");
+
+    bool batchLockstep = false;
+    auto lockstep_flag = batchCmd->add_flag("--lockstep", batchLockstep,
+        "Run jobs sharing a program together on the SIMD lockstep engine");
+    lockstep_flag->excludes("--fuse");
+    lockstep_flag->excludes("--accelerate-loops");
+
+    bool batchDetectLoops = false;
+    batchCmd->add_flag("--detect-loops", batchDetectLoops, "End jobs whose state repeats with status LOOP")
+        ->excludes(lockstep_flag);
+
+    bool batchCache = false;
+    batchCmd->add_flag("--cache", batchCache, "Reuse assembled images from the on-disk cache");
+
+    std::optional<std::string> batchCacheDir;
+    batchCmd->add_option("--cache-dir", batchCacheDir, "Image cache directory (implies --cache)");
+
+
+
+    CLI::App* assembleCmd = app.add_subcommand("assemble", "Assemble a program and its data into a binary image");
+
+    std::string assembleSourcePath;
+    assembleCmd->add_option("assembly", assembleSourcePath, "Assembly program file ('-' for stdin)")
+        ->required()
+        ->check(ExistingFileOrStdin);
+
+    std::optional<std::string> assembleDataPath;
+    assembleCmd->add_option("--datafile", assembleDataPath, "Data file stored as the initial DMEM ('-' for stdin)")
+        ->check(ExistingFileOrStdin);
+
+    std::string assembleOutputPath;
+    assembleCmd->add_option("--output,-o", assembleOutputPath, "Image file")
+        ->required();
+
+    bool assembleOptimizer = false;
+    assembleCmd->add_flag("-O,--optimize", assembleOptimizer, "Optimize the program before flashing it");
+
+
+    CLI::App* traceCmd = app.add_subcommand("trace", "Work with binary execution traces");
+    traceCmd->require_subcommand(1);
+    CLI::App* traceDumpCmd = traceCmd->add_subcommand("dump", "Print a trace as the --every-step table");
+
+    std::string traceDumpPath;
+    traceDumpCmd->add_option("trace", traceDumpPath, "Trace file written by 'run --trace'")
+        ->required()
+        ->check(CLI::ExistingFile);
+
+
     CLI11_PARSE(app, argc, argv);
 
+    if (traceDumpCmd->parsed()) {
+        coutCPU::displaySimulationStep = true;
+        coutCPU::logTableHeader();
+        auto expectedCount = trace::replay(traceDumpPath, [](const trace::Record& record){
+            CPU<>::Instruction ir;
+            ir.raw = record.IR;
+            coutCPU::logTableRow(record.step, record.PC, ir, record.ACC,
+                record.flags & trace::Record::Z, record.flags & trace::Record::C);
+        });
+        coutCPU::logTableFooter();
+        if (!expectedCount) {
+            std::cerr << trace::toStr(expectedCount.error()) << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (assembleCmd->parsed()) {
+        constexpr uint32_t IMEM_SIZE = 1024;
+        constexpr uint32_t DMEM_SIZE = 1024;
+
+        if (assembleSourcePath == "-" && assembleDataPath == "-"){
+            std::cerr << "Only one of the program and --datafile can be read from stdin\n";
+            return 1;
+        }
+
+        auto expectedAssemblySource = file::map(assembleSourcePath);
+        if (!expectedAssemblySource){
+            std::cerr << file::toStr(expectedAssemblySource.error());
+            return 1;
+        }
+        auto expectedAssembly = Assembler{}.translate(expectedAssemblySource->view());
+        if (!expectedAssembly){
+            std::cerr << Assembler::toStr(expectedAssembly.error());
+            return 1;
+        }
+        if (assembleOptimizer)
+            std::cout << optimizeAssembly(*expectedAssembly, DMEM_SIZE).summary();
+        std::array<uint32_t, DMEM_SIZE> data{};
+        if (assembleDataPath){
+            auto expectedData = readDataFile<DMEM_SIZE>(*assembleDataPath);
+            if (!expectedData)
+                return 1;
+            data = *expectedData;
+        }
+
+        auto written = image::save<IMEM_SIZE, DMEM_SIZE>(assembleOutputPath,
+            flashAssembly<IMEM_SIZE, DMEM_SIZE>(*expectedAssembly), data);
+        if (!written){
+            std::cerr << image::toStr(written.error()) << "\n";
+            return 1;
+        }
+        std::cout << std::format("Wrote {}: {} instructions, {} bytes\n",
+            assembleOutputPath, expectedAssembly->size(), *written);
+        return 0;
+    }
+
+    if (batchCmd->parsed()) {
+        std::vector<BatchRunner::Job> jobs;
+        if (manifestPath) {
+            auto expectedManifest = file::read(*manifestPath);
+            if (!expectedManifest) {
+                std::cerr << file::toStr(expectedManifest.error());
+                return 1;
+            }
+            auto expectedJobs = BatchRunner::parseManifest(*expectedManifest,
+                std::filesystem::path(*manifestPath).parent_path());
+            if (!expectedJobs) {
+                std::cerr << BatchRunner::toStr(expectedJobs.error());
+                return 1;
+            }
+            jobs = std::move(*expectedJobs);
+        } else if (batchProgramPath) {
+            jobs = BatchRunner::jobsForDirectory(*batchProgramPath, *dataDirPath);
+        } else {
+            std::cerr << "Either --manifest or --program with --data-dir is required\n";
+            return 1;
+        }
+
+        std::ofstream output(outputPath);
+        if (!output) {
+            std::cerr << "Cannot open output file: " << outputPath << "\n";
+            return 1;
+        }
+
+        BatchRunner runner(threadCount);
+        if (stepBudget)
+            runner.setStepBudget(stepBudget);
+        runner.setTimeout(std::chrono::milliseconds(timeoutMs));
+        runner.setFusion(batchFusion);
+        runner.setLoopAcceleration(batchLoopAcceleration);
+        runner.setOptimization(batchOptimizer);
+        runner.setLockstep(batchLockstep);
+        runner.setLoopDetection(batchDetectLoops);
+        runner.setImageCache(openImageCache(batchCache, batchCacheDir));
+
+        auto start = std::chrono::steady_clock::now();
+        auto summary = runner.run(jobs, output);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::string loops = batchDetectLoops ? std::format(", {} looping", summary.loops) : "";
+        std::cout << std::format("{} jobs on {} threads: {} halted, {} failed{}, {} steps in {:.3f} s\n",
+            summary.jobs, runner.getThreadCount(), summary.halted, summary.failed, loops, summary.steps, elapsed.count());
+        return summary.failed ? 1 : 0;
+    }
+
     if (!runCmd->parsed()) {
         std::cout << "Use 'cpuemul --help' for usage information\n";
         return 1;
     }
     
+    if (assemblyPath.empty() && !resumePath){
+        std::cerr << "Either an assembly program or --resume is required\n";
+        return 1;
+    }
+    // The checkpoint carries its own DMEM.
+    if (resumePath && dataPath){
+        std::cerr << "--datafile cannot be used with --resume\n";
+        return 1;
+    }
+    if (assemblyPath == "-" && dataPath == "-"){
+        std::cerr << "Only one of the program and --datafile can be read from stdin\n";
+        return 1;
+    }
+    if (checkpointEvery && !checkpointPath && assemblyPath == "-"){
+        std::cerr << "--checkpoint is required when the program is read from stdin\n";
+        return 1;
+    }
+
     bool isFPS = runCmd->count("--fps");
 
     constexpr uint32_t IMEM_SIZE = 1024;
     constexpr uint32_t DMEM_SIZE = 1024;
 
-    Assembler assembler;
+    std::array<CPU<>::Instruction, IMEM_SIZE> program{};
+    std::array<uint32_t, DMEM_SIZE> data;
+    data.fill(0);
 
-    auto expectedAssemblySource = file::read(assemblyPath);
-    if (!expectedAssemblySource){
-        std::cerr << file::toStr(expectedAssemblySource.error());
-        return 1;
-    }
+    std::optional<checkpoint::Loaded> resumed;
+    if (resumePath){
+        auto expectedCheckpoint = checkpoint::read(*resumePath, IMEM_SIZE, DMEM_SIZE);
+        if (!expectedCheckpoint){
+            std::cerr << checkpoint::toStr(expectedCheckpoint.error()) << "\n";
+            return 1;
+        }
+        resumed = std::move(*expectedCheckpoint);
+    } else if (image::isImage(assemblyPath)){
+        auto expectedProgram = image::load<IMEM_SIZE, DMEM_SIZE>(assemblyPath);
+        if (!expectedProgram){
+            std::cerr << image::toStr(expectedProgram.error()) << "\n";
+            return 1;
+        }
+        program = expectedProgram->IMEM;
+        data = expectedProgram->DMEM;
+    } else{
+        auto expectedAssemblySource = file::map(assemblyPath);
+        if (!expectedAssemblySource){
+            std::cerr << file::toStr(expectedAssemblySource.error());
+            return 1;
+        }
 
-    auto expectedAssembly = assembler.translate(*expectedAssemblySource);
-    if (!expectedAssembly){
-        std::cerr << Assembler::toStr(expectedAssembly.error());
-        return 0;
+        auto cache = openImageCache(useCache, cacheDir);
+        std::optional<ImageCache::Entry<IMEM_SIZE>> cached;
+        if (cache)
+            cached = cache->load<IMEM_SIZE, DMEM_SIZE>(expectedAssemblySource->view(), useOptimizer);
+        if (cached){
+            program = cached->image;
+            // The optimizer's report, so a warm cache prints what a cold one does.
+            if (useOptimizer)
+                std::cout << cached->note;
+        } else{
+            Assembler assembler;
+            auto expectedAssembly = assembler.translate(expectedAssemblySource->view());
+            if (!expectedAssembly){
+                std::cerr << Assembler::toStr(expectedAssembly.error());
+                return 0;
+            }
+            std::string note;
+            if (useOptimizer){
+                note = optimizeAssembly(*expectedAssembly, DMEM_SIZE).summary();
+                std::cout << note;
+            }
+            program = flashAssembly<IMEM_SIZE, DMEM_SIZE>(*expectedAssembly);
+            if (cache)
+                cache->store<IMEM_SIZE, DMEM_SIZE>(expectedAssemblySource->view(), program, useOptimizer, note);
+        }
     }
     
-    std::array<uint32_t, DMEM_SIZE> data;
+    // A data file replaces the DMEM an image carries.
     if (dataPath){
-        auto expectedDataSource = file::read(*dataPath);
-        if (!expectedDataSource){
-            std::cerr << file::toStr(expectedDataSource.error());
+        auto expectedData = readDataFile<DMEM_SIZE>(*dataPath);
+        if (!expectedData)
+            return 1;
+        data = *expectedData;
+    }
+
+    auto cpu = std::make_shared<CPU<1024, 1024>>();
+    if (resumed){
+        checkpoint::restore(*cpu, *resumed);
+        std::cout << std::format("Resumed {} at step {}\n", *resumePath, resumed->registers.step);
+    } else{
+        cpu->loadIMEM(program);
+        cpu->loadDMEM(data);
+    }
+    if (useFusion){
+        const FusionReport& report = cpu->enableFusion();
+        std::cout << std::format("Fused superinstructions: {} ({})\n", report.total(), report.toString());
+    }
+    if (useLoopAcceleration){
+        const LoopReport& report = cpu->enableLoopAcceleration();
+        std::cout << std::format("Accelerated loops: {} ({})\n", report.total(), report.toString());
+    }
+    if (useJit && !cpu->enableJit()){
+        std::cerr << "JIT backend is not available, falling back to the interpreter\n";
+    }
+
+    if (tracePath){
+        auto expectedWriter = trace::Writer::open(*tracePath);
+        if (!expectedWriter){
+            std::cerr << trace::toStr(expectedWriter.error()) << "\n";
             return 1;
         }
-        auto expectedData = DataReader::parseData<DMEM_SIZE>(*expectedDataSource);
-        if (!expectedData){
-            std::cerr << DataReader::toStr(expectedData.error().code);
+        trace::Writer& writer = **expectedWriter;
+
+        int status = 0;
+        cpu->start();
+        try{
+            trace::run(*cpu, writer);
+        } catch (const std::exception& e){
+            std::cerr << e.what() << "\n";
+            status = 1;
+        }
+        if (auto closed = writer.close(); !closed){
+            std::cerr << trace::toStr(closed.error()) << "\n";
             return 1;
         }
-        data = *expectedData;
-    } else{
-        data.fill(0);
+
+        coutCPU::displaySimulationStep = true;
+        coutCPU::logTableHeader();
+        coutCPU::logTableRow(*cpu);
+        coutCPU::logTableFooter();
+        std::cout << std::format("Traced {} steps to {} ({} bytes)\n",
+            writer.getRecordCount(), *tracePath, writer.getBytesWritten());
+        return status;
     }
 
-    
+    if (isProfile){
+        Profiler<IMEM_SIZE, DMEM_SIZE> profiler;
+        int status = 0;
+        cpu->start();
+        try{
+            profiler.run(*cpu);
+        } catch (const std::exception& e){
+            std::cerr << e.what() << "\n";
+            status = 1;
+        }
+
+        coutCPU::displaySimulationStep = true;
+        coutCPU::logTableHeader();
+        coutCPU::logTableRow(*cpu);
+        coutCPU::logTableFooter();
+        std::cout << "\n" << profiler.report();
+        return status;
+    }
+
+    if (detectLoops){
+        LoopDetector<IMEM_SIZE, DMEM_SIZE> detector;
+        int status = 0;
+        cpu->start();
+        try{
+            if (detector.run(*cpu) == Simulator::RunStatus::BREAKPOINT)
+                status = 1;
+        } catch (const std::exception& e){
+            std::cerr << e.what() << "\n";
+            status = 1;
+        }
+
+        coutCPU::displaySimulationStep = true;
+        coutCPU::logTableHeader();
+        coutCPU::logTableRow(*cpu);
+        coutCPU::logTableFooter();
+        if (detector.getLoop())
+            std::cerr << detector.getLoop()->toString() << "\n";
+        return status;
+    }
+
+    // ClockGenerator restarts the simulation from step 0, so checkpointed and
+    // resumed runs drive the CPU themselves.
+    if (checkpointEvery || resumed){
+        std::unique_ptr<checkpoint::Writer<IMEM_SIZE, DMEM_SIZE>> writer;
+        std::string path = checkpointPath ? *checkpointPath : resumePath ? *resumePath : assemblyPath + ".checkpoint";
+        if (!resumed)
+            cpu->start();
+        if (checkpointEvery)
+            writer = std::make_unique<checkpoint::Writer<IMEM_SIZE, DMEM_SIZE>>(path, *cpu);
+
+        int status = 0;
+        try{
+            while (cpu->getState() == Simulator::State::RUNNING){
+                cpu->runFor(checkpointEvery ? *checkpointEvery : SIZE_MAX);
+                if (writer && cpu->getState() == Simulator::State::RUNNING)
+                    writer->submit(*cpu);
+            }
+        } catch (const std::exception& e){
+            std::cerr << e.what() << "\n";
+            status = 1;
+        }
+
+        coutCPU::displaySimulationStep = true;
+        coutCPU::logTableHeader();
+        coutCPU::logTableRow(*cpu);
+        coutCPU::logTableFooter();
+        if (writer){
+            if (auto closed = writer->close(); !closed){
+                std::cerr << checkpoint::toStr(closed.error()) << "\n";
+                return 1;
+            }
+            std::cout << std::format("Wrote {} checkpoints to {} ({} skipped, {} bytes)\n",
+                writer->getCheckpointCount(), path, writer->getSkippedCount(), writer->getBytesWritten());
+        }
+        return status;
+    }
 
-    auto cpu = std::make_shared<CPU<1024, 1024>>();
-    cpu->loadIMEM(flashAssembly<IMEM_SIZE, DMEM_SIZE>(*expectedAssembly));
-    cpu->loadDMEM(data);
     ClockGenerator clock(hz, fps);
     clock.setDisplayMode(multiplexDisplayFlags(isFPS, isResultOnly, isEveryStep));
+    clock.setTimingMode(multiplexTimingFlags(isMaxSpeed, isVirtualTime));
 
     clock.setSimulator(cpu);
     
     coutCPU::displaySimulationStep = true;
     coutCPU::logTableHeader();
-    clock.setDisplayCallback([&cpu, &clock]() {
-        coutCPU::logTableRow(*cpu);
-        cpu->getStep();
+
+    // Every-step output must not lose rows, so only --fps may drop frames.
+    AsyncDisplay<coutCPU::Frame> display(
+        [](const coutCPU::Frame& frame){ coutCPU::logTableRow(frame); },
+        []{ std::cout.flush(); },
+        isLossless || !isFPS);
+    clock.setDisplayCallback([&cpu, &display]() {
+        display.publish(coutCPU::Frame::capture(*cpu));
     });
     
-    clock.run();
+    try{
+        clock.run();
+    } catch (const std::exception& e){
+        display.finish();
+        coutCPU::logTableRow(*cpu);
+        coutCPU::logTableFooter();
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    display.finish();
     coutCPU::logTableFooter();
+
+    if (isVirtualTime){
+        std::cout << std::format("Virtual time: {:.6f} s at {} Hz\n",
+            clock.getVirtualTime().count(), clock.getSimulationFrequency());
+    }
 }
\ No newline at end of file
@@ -0,0 +1,670 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <bitset>
+#include <deque>
+#include <map>
+#include <optional>
+
+#include "cpu.h"
+#include "micro_op.h"
+
+namespace {
+    // Literal operands are 10 bits, so no instruction names a word past this.
+    constexpr size_t WORDS = size_t{1} << Assembly::VALUE_BITS_COUNT;
+
+    using Core = CPUCore<1024>;
+    using Words = std::bitset<WORDS>;
+
+    bool isJump(MicroOp op){
+        return op >= MicroOp::JMP_L && op <= MicroOp::JNC_M;
+    }
+    bool isBranch(MicroOp op){
+        return op == MicroOp::JZ_L || op == MicroOp::JNZ_L || op == MicroOp::JC_L || op == MicroOp::JNC_L;
+    }
+    bool isArithmetic(MicroOp op){
+        return op >= MicroOp::ADD_L && op <= MicroOp::SHR_M;
+    }
+    bool writesCarry(MicroOp op){
+        switch (op){
+            case MicroOp::ADD_L: case MicroOp::ADD_M:
+            case MicroOp::SUB_L: case MicroOp::SUB_M:
+            case MicroOp::INC:   case MicroOp::DEC:
+            case MicroOp::SHL_L: case MicroOp::SHL_M:
+            case MicroOp::SHR_L: case MicroOp::SHR_M:
+                return true;
+            default:
+                return false;
+        }
+    }
+    // Instructions whose operand is a DMEM address read or written directly.
+    bool addressesMemory(MicroOp op){
+        switch (op){
+            case MicroOp::LOAD_M:  case MicroOp::STORE_L: case MicroOp::STORE_M:
+            case MicroOp::LOADI_L: case MicroOp::LOADI_M:
+            case MicroOp::ADD_M:   case MicroOp::SUB_M:
+            case MicroOp::AND_M:   case MicroOp::OR_M:    case MicroOp::XOR_M:
+            case MicroOp::SHL_M:   case MicroOp::SHR_M:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void apply(MicroOp op, Core::Registers& r, uint32_t value){
+        switch (op){
+            case MicroOp::ADD_L: case MicroOp::ADD_M: Core::ADD(r, value); break;
+            case MicroOp::SUB_L: case MicroOp::SUB_M: Core::SUB(r, value); break;
+            case MicroOp::INC:                        Core::INC(r);        break;
+            case MicroOp::DEC:                        Core::DEC(r);        break;
+            case MicroOp::AND_L: case MicroOp::AND_M: Core::AND(r, value); break;
+            case MicroOp::OR_L:  case MicroOp::OR_M:  Core::OR(r, value);  break;
+            case MicroOp::XOR_L: case MicroOp::XOR_M: Core::XOR(r, value); break;
+            case MicroOp::NOT:                        Core::NOT(r);        break;
+            case MicroOp::SHL_L: case MicroOp::SHL_M: Core::SHL(r, value); break;
+            case MicroOp::SHR_L: case MicroOp::SHR_M: Core::SHR(r, value); break;
+            default: break;
+        }
+    }
+
+    // Whether a branch is taken when its flag (Z or C) has the given value,
+    // asked of the CPU's own semantics rather than restated here.
+    bool takenIf(MicroOp op, bool flag){
+        Core::Registers r{1, 0, flag, flag};
+        switch (op){
+            case MicroOp::JZ_L:  Core::JZ(r, 0);  break;
+            case MicroOp::JNZ_L: Core::JNZ(r, 0); break;
+            case MicroOp::JC_L:  Core::JC(r, 0);  break;
+            case MicroOp::JNC_L: Core::JNC(r, 0); break;
+            default: break;
+        }
+        return r.PC != 1;
+    }
+
+    // What is known about the machine before an instruction, on every path
+    // that reaches it.
+    struct Facts{
+        bool reached = false;
+        std::optional<uint32_t> ACC;
+        std::optional<bool> Z;
+        std::optional<bool> C;
+        bool zMatchesAcc = false;
+        Words equalsAcc;
+        std::map<uint32_t, uint32_t> words;
+
+        bool operator==(const Facts&) const = default;
+
+        bool zConsistent() const{
+            return zMatchesAcc || (ACC && Z && *Z == (*ACC == 0));
+        }
+        std::optional<uint32_t> word(uint32_t address) const{
+            auto it = words.find(address);
+            if (it == words.end())
+                return std::nullopt;
+            return it->second;
+        }
+        bool holdsAcc(uint32_t address) const{
+            return equalsAcc[address] || (ACC && word(address) == ACC);
+        }
+        void setAcc(std::optional<uint32_t> value){
+            ACC = value;
+            Z = value ? std::optional<bool>(*value == 0) : std::nullopt;
+            zMatchesAcc = true;
+            equalsAcc.reset();
+            if (value){
+                for (const auto& [address, word] : words){
+                    if (word == *value)
+                        equalsAcc.set(address);
+                }
+            }
+        }
+    };
+
+    Facts join(const Facts& a, const Facts& b){
+        if (!a.reached)
+            return b;
+        if (!b.reached)
+            return a;
+        Facts result;
+        result.reached = true;
+        result.ACC = a.ACC == b.ACC ? a.ACC : std::nullopt;
+        result.Z = a.Z == b.Z ? a.Z : std::nullopt;
+        result.C = a.C == b.C ? a.C : std::nullopt;
+        result.zMatchesAcc = a.zConsistent() && b.zConsistent();
+        result.equalsAcc = a.equalsAcc & b.equalsAcc;
+        for (const auto& [address, word] : a.words){
+            if (b.word(address) == word)
+                result.words.emplace(address, word);
+        }
+        return result;
+    }
+
+    // Registers and words whose current value a later instruction may read.
+    struct Live{
+        bool ACC = false;
+        bool Z = false;
+        bool C = false;
+        Words words;
+
+        bool operator==(const Live&) const = default;
+
+        static Live all(){
+            Live live{true, true, true, {}};
+            live.words.set();
+            return live;
+        }
+        Live& operator|=(const Live& other){
+            ACC |= other.ACC;
+            Z |= other.Z;
+            C |= other.C;
+            words |= other.words;
+            return *this;
+        }
+    };
+
+    // ACC (and C) after an arithmetic instruction, where they can be told.
+    struct Outcome{
+        std::optional<uint32_t> ACC;
+        std::optional<bool> C;
+        bool unchanged = false;
+    };
+
+    class Optimizer{
+    public:
+        Optimizer(std::vector<Assembly>& program, size_t dmemSize)
+            : program(program), dmemSize(std::min(dmemSize, WORDS)), removed(program.size(), false){}
+
+        OptimizationReport run(){
+            report.before = program.size();
+            report.after = program.size();
+            for (const Assembly& instruction : program){
+                MicroOp op = decodeMicroOp(instruction.instructionCode, instruction.isLiteral);
+                if (op == MicroOp::BAD || (isJump(op) && !instruction.isLiteral)){
+                    report.skipped = true;
+                    return report;
+                }
+            }
+
+            // Rewrites that keep every register and word as it was run
+            // together; folding and dead-code removal change values nothing
+            // reads, which could invalidate facts other rewrites rely on, so
+            // each runs alone on fresh analyses.
+            while (simplify() || fold() || eliminateDead()){
+            }
+            compact();
+            return report;
+        }
+
+    private:
+        std::vector<Assembly>& program;
+        size_t dmemSize;
+        std::vector<bool> removed;
+        OptimizationReport report;
+
+        size_t size() const{
+            return program.size();
+        }
+        MicroOp opAt(size_t i) const{
+            return decodeMicroOp(program[i].instructionCode, program[i].isLiteral);
+        }
+        uint32_t operandAt(size_t i) const{
+            return program[i].value;
+        }
+        bool inRange(uint32_t address) const{
+            return address < dmemSize;
+        }
+        // Instructions that may stop the run on a bad address, where the
+        // whole machine state is observable, like at HLT.
+        bool mayFault(size_t i) const{
+            MicroOp op = opAt(i);
+            if (op == MicroOp::STORE_M || op == MicroOp::LOADI_M)
+                return true;
+            return addressesMemory(op) && !inRange(operandAt(i));
+        }
+        bool isPinned(size_t i) const{
+            MicroOp op = opAt(i);
+            return op == MicroOp::HLT || isJump(op) || mayFault(i);
+        }
+        void remove(size_t i, size_t& counter){
+            removed[i] = true;
+            ++counter;
+            --report.after;
+        }
+        void rewrite(size_t i, uint16_t code, uint16_t value){
+            program[i].instructionCode = code;
+            program[i].isLiteral = true;
+            program[i].value = value;
+        }
+
+        // First kept instruction at or after `at`; addresses past the end
+        // of the program stand for themselves.
+        size_t firstKept(size_t at) const{
+            while (at < size() && removed[at])
+                ++at;
+            return at;
+        }
+
+        std::optional<uint32_t> operandValue(size_t i, const Facts& facts) const{
+            MicroOp op = opAt(i);
+            if (op == MicroOp::INC || op == MicroOp::DEC || op == MicroOp::NOT)
+                return 0;
+            if (!addressesMemory(op))
+                return operandAt(i);
+            if (!inRange(operandAt(i)))
+                return std::nullopt;
+            return facts.word(operandAt(i));
+        }
+
+        Outcome evaluate(size_t i, const Facts& facts) const{
+            MicroOp op = opAt(i);
+            Outcome outcome;
+            outcome.C = writesCarry(op) ? std::nullopt : facts.C;
+            std::optional<uint32_t> value = operandValue(i, facts);
+            if (!value)
+                return outcome;
+            if (facts.ACC){
+                Core::Registers r{0, *facts.ACC, false, facts.C.value_or(false)};
+                apply(op, r, *value);
+                outcome.ACC = r.ACC;
+                outcome.unchanged = r.ACC == *facts.ACC;
+                if (writesCarry(op))
+                    outcome.C = r.C;
+                return outcome;
+            }
+            switch (op){
+                case MicroOp::ADD_L: case MicroOp::ADD_M:
+                case MicroOp::SUB_L: case MicroOp::SUB_M:
+                case MicroOp::OR_L:  case MicroOp::OR_M:
+                case MicroOp::XOR_L: case MicroOp::XOR_M:
+                    outcome.unchanged = *value == 0;
+                    break;
+                case MicroOp::SHL_L: case MicroOp::SHL_M:
+                case MicroOp::SHR_L: case MicroOp::SHR_M:
+                    outcome.unchanged = (*value & 0b00011111) == 0;
+                    break;
+                case MicroOp::AND_L: case MicroOp::AND_M:
+                    if (*value == 0)
+                        outcome.ACC = 0;
+                    break;
+                default:
+                    break;
+            }
+            // Adding, subtracting or shifting by zero clears C.
+            if (outcome.unchanged && writesCarry(op))
+                outcome.C = false;
+            return outcome;
+        }
+
+        Facts transfer(size_t i, Facts facts) const{
+            if (removed[i])
+                return facts;
+            MicroOp op = opAt(i);
+            uint32_t operand = operandAt(i);
+            switch (op){
+                case MicroOp::LOAD_L:
+                    facts.setAcc(operand);
+                    break;
+                case MicroOp::LOAD_M:
+                case MicroOp::LOADI_L:
+                    if (!inRange(operand)){
+                        facts.setAcc(std::nullopt);
+                        break;
+                    }
+                    facts.setAcc(facts.word(operand));
+                    facts.equalsAcc.set(operand);
+                    break;
+                case MicroOp::LOADI_M:
+                    facts.setAcc(std::nullopt);
+                    break;
+                case MicroOp::STORE_L:
+                    if (!inRange(operand))
+                        break;
+                    if (facts.ACC)
+                        facts.words[operand] = *facts.ACC;
+                    else
+                        facts.words.erase(operand);
+                    facts.equalsAcc.set(operand);
+                    break;
+                case MicroOp::STORE_M:
+                    // Whatever word is hit now holds ACC, so equalsAcc stands.
+                    std::erase_if(facts.words, [&](const auto& entry){
+                        return !facts.ACC || entry.second != *facts.ACC;
+                    });
+                    break;
+                default:
+                    if (!isArithmetic(op))
+                        break;
+                    Outcome outcome = evaluate(i, facts);
+                    if (outcome.unchanged){
+                        bool consistent = facts.zConsistent();
+                        if (!consistent)
+                            facts.Z = facts.ACC ? std::optional<bool>(*facts.ACC == 0) : std::nullopt;
+                        facts.zMatchesAcc = true;
+                    } else{
+                        facts.setAcc(outcome.ACC);
+                    }
+                    facts.C = outcome.C;
+                    break;
+            }
+            return facts;
+        }
+
+        // Narrows the facts along one edge of a branch; nullopt when the
+        // known flag rules the edge out.
+        std::optional<Facts> refine(size_t i, Facts facts, bool taken) const{
+            MicroOp op = opAt(i);
+            bool onZ = op == MicroOp::JZ_L || op == MicroOp::JNZ_L;
+            bool value = takenIf(op, true) == taken;
+            std::optional<bool>& flag = onZ ? facts.Z : facts.C;
+            if (flag && *flag != value)
+                return std::nullopt;
+            if (onZ && value && facts.zConsistent() && !facts.ACC){
+                Words equal = facts.equalsAcc;
+                facts.setAcc(0);
+                facts.equalsAcc |= equal;
+            }
+            flag = value;
+            return facts;
+        }
+
+        template<class Visit>
+        void forEachSuccessor(size_t i, Visit&& visit) const{
+            MicroOp op = opAt(i);
+            if (removed[i] || !isJump(op)){
+                if (removed[i] || op != MicroOp::HLT)
+                    visit(i + 1, std::optional<bool>{});
+                return;
+            }
+            if (op == MicroOp::JMP_L){
+                visit(operandAt(i), std::optional<bool>{});
+                return;
+            }
+            visit(operandAt(i), std::optional<bool>{true});
+            visit(i + 1, std::optional<bool>{false});
+        }
+
+        std::vector<Facts> analyseFacts() const{
+            std::vector<Facts> in(size());
+            if (in.empty())
+                return in;
+            in[0].reached = true;
+            in[0].ACC = 0;
+            in[0].Z = false;
+            in[0].C = false;
+
+            std::deque<size_t> worklist{0};
+            std::vector<bool> queued(size(), false);
+            queued[0] = true;
+            while (!worklist.empty()){
+                size_t i = worklist.front();
+                worklist.pop_front();
+                queued[i] = false;
+                Facts out = transfer(i, in[i]);
+                forEachSuccessor(i, [&](size_t next, std::optional<bool> taken){
+                    if (next >= size())
+                        return;
+                    std::optional<Facts> edge = out;
+                    if (taken && !removed[i])
+                        edge = refine(i, out, *taken);
+                    if (!edge)
+                        return;
+                    Facts merged = join(in[next], *edge);
+                    if (merged == in[next])
+                        return;
+                    in[next] = std::move(merged);
+                    if (!queued[next]){
+                        queued[next] = true;
+                        worklist.push_back(next);
+                    }
+                });
+            }
+            return in;
+        }
+
+        Live liveBefore(size_t i, Live live) const{
+            if (removed[i])
+                return live;
+            if (opAt(i) == MicroOp::HLT || mayFault(i))
+                return Live::all();
+            MicroOp op = opAt(i);
+            uint32_t operand = operandAt(i);
+            bool inside = inRange(operand);
+            switch (op){
+                case MicroOp::NOP:
+                case MicroOp::JMP_L:
+                    break;
+                case MicroOp::JZ_L: case MicroOp::JNZ_L:
+                    live.Z = true;
+                    break;
+                case MicroOp::JC_L: case MicroOp::JNC_L:
+                    live.C = true;
+                    break;
+                case MicroOp::LOAD_L:
+                    live.ACC = live.Z = false;
+                    break;
+                case MicroOp::LOAD_M:
+                case MicroOp::LOADI_L:
+                    live.ACC = live.Z = false;
+                    if (inside)
+                        live.words.set(operand);
+                    break;
+                case MicroOp::STORE_L:
+                    if (inside)
+                        live.words.reset(operand);
+                    live.ACC = true;
+                    break;
+                default:
+                    live.Z = false;
+                    if (writesCarry(op))
+                        live.C = false;
+                    live.ACC = true;
+                    if (addressesMemory(op) && inside)
+                        live.words.set(operand);
+                    break;
+            }
+            return live;
+        }
+
+        // Live registers and words after each instruction.
+        std::vector<Live> analyseLiveness() const{
+            std::vector<Live> out(size());
+            std::vector<Live> in(size());
+            bool changed = true;
+            while (changed){
+                changed = false;
+                for (size_t i = size(); i-- > 0;){
+                    Live after;
+                    if (!removed[i] && opAt(i) == MicroOp::HLT){
+                        after = Live::all();
+                    } else{
+                        forEachSuccessor(i, [&](size_t next, std::optional<bool>){
+                            after |= next >= size() ? Live::all() : in[next];
+                        });
+                    }
+                    Live before = liveBefore(i, after);
+                    if (after != out[i] || before != in[i]){
+                        out[i] = after;
+                        in[i] = before;
+                        changed = true;
+                    }
+                }
+            }
+            return out;
+        }
+
+        // Drops unreachable code, NOPs and instructions that change nothing,
+        // and resolves, threads or drops jumps.
+        bool simplify(){
+            std::vector<Facts> facts = analyseFacts();
+            bool changed = false;
+            for (size_t i = 0; i < size(); ++i){
+                if (removed[i])
+                    continue;
+                const Facts& before = facts[i];
+                if (!before.reached){
+                    remove(i, report.unreachable);
+                    changed = true;
+                    continue;
+                }
+                MicroOp op = opAt(i);
+                uint32_t operand = operandAt(i);
+                if (op == MicroOp::NOP){
+                    remove(i, report.nops);
+                    changed = true;
+                    continue;
+                }
+                if (isJump(op) || isPinned(i))
+                    continue;
+
+                switch (op){
+                    case MicroOp::LOAD_L:
+                        if (before.ACC == operand && before.zConsistent()){
+                            remove(i, report.redundantLoads);
+                            changed = true;
+                        }
+                        break;
+                    case MicroOp::LOAD_M:
+                    case MicroOp::LOADI_L:
+                        if (before.holdsAcc(operand) && before.zConsistent()){
+                            remove(i, report.redundantLoads);
+                            changed = true;
+                        }
+                        break;
+                    case MicroOp::STORE_L:
+                        if (before.holdsAcc(operand)){
+                            remove(i, report.redundantStores);
+                            changed = true;
+                        }
+                        break;
+                    default:{
+                        if (!isArithmetic(op))
+                            break;
+                        Outcome outcome = evaluate(i, before);
+                        if (outcome.unchanged && before.zConsistent()
+                            && (!writesCarry(op) || (outcome.C && before.C == outcome.C))){
+                            remove(i, report.identities);
+                            changed = true;
+                        }
+                        break;
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < size(); ++i){
+                if (removed[i] || !isJump(opAt(i)))
+                    continue;
+                MicroOp op = opAt(i);
+                if (isBranch(op)){
+                    bool onZ = op == MicroOp::JZ_L || op == MicroOp::JNZ_L;
+                    std::optional<bool> flag = onZ ? facts[i].Z : facts[i].C;
+                    if (flag){
+                        if (takenIf(op, *flag)){
+                            rewrite(i, Asm::JMP, program[i].value);
+                            ++report.branchesResolved;
+                        } else{
+                            remove(i, report.branchesResolved);
+                        }
+                        changed = true;
+                        continue;
+                    }
+                }
+
+                size_t target = threadTarget(operandAt(i));
+                if (target != operandAt(i)){
+                    program[i].value = target;
+                    ++report.jumpsThreaded;
+                    changed = true;
+                }
+                if (firstKept(target) == firstKept(i + 1)){
+                    remove(i, report.jumpsRemoved);
+                    changed = true;
+                }
+            }
+            return changed;
+        }
+
+        // Follows a chain of JMPs from `target` to where it finally lands.
+        size_t threadTarget(size_t target) const{
+            std::vector<bool> visited(size(), false);
+            while (true){
+                size_t at = firstKept(target);
+                if (at >= size() || opAt(at) != MicroOp::JMP_L || visited[at])
+                    return target;
+                visited[at] = true;
+                target = operandAt(at);
+            }
+        }
+
+        // Replaces arithmetic on known values by a LOAD of the result.
+        bool fold(){
+            std::vector<Facts> facts = analyseFacts();
+            std::vector<Live> live = analyseLiveness();
+            bool changed = false;
+            for (size_t i = 0; i < size(); ++i){
+                if (removed[i] || !facts[i].reached || isPinned(i) || !isArithmetic(opAt(i)))
+                    continue;
+                Outcome outcome = evaluate(i, facts[i]);
+                if (!outcome.ACC || *outcome.ACC >> Assembly::VALUE_BITS_COUNT != 0)
+                    continue;
+                if (writesCarry(opAt(i)) && live[i].C)
+                    continue;
+                rewrite(i, Asm::LOAD, *outcome.ACC);
+                ++report.folded;
+                changed = true;
+            }
+            return changed;
+        }
+
+        // Drops instructions none of whose results are read.
+        bool eliminateDead(){
+            std::vector<Live> live = analyseLiveness();
+            bool changed = false;
+            for (size_t i = 0; i < size(); ++i){
+                if (removed[i] || isPinned(i))
+                    continue;
+                MicroOp op = opAt(i);
+                const Live& after = live[i];
+                bool dead = op == MicroOp::STORE_L
+                    ? !after.words[operandAt(i)]
+                    : !after.ACC && !after.Z && (!writesCarry(op) || !after.C);
+                if (dead){
+                    remove(i, report.dead);
+                    changed = true;
+                }
+            }
+            return changed;
+        }
+
+        // Drops removed instructions and remaps jump targets onto the next
+        // kept one.
+        void compact(){
+            std::vector<uint16_t> remap(size() + 1);
+            uint16_t kept = 0;
+            for (size_t i = 0; i < size(); ++i){
+                remap[i] = kept;
+                if (!removed[i])
+                    ++kept;
+            }
+            remap[size()] = kept;
+            size_t dropped = size() - kept;
+
+            std::vector<Assembly> result;
+            result.reserve(kept);
+            for (size_t i = 0; i < size(); ++i){
+                if (removed[i])
+                    continue;
+                Assembly instruction = program[i];
+                if (isJump(opAt(i))){
+                    size_t target = instruction.value;
+                    instruction.value = target <= size() ? remap[target] : target - dropped;
+                }
+                result.push_back(instruction);
+            }
+            program = std::move(result);
+        }
+    };
+}
+
+OptimizationReport optimizeAssembly(std::vector<Assembly>& program, size_t dmemSize){
+    return Optimizer(program, dmemSize).run();
+}
@@ -0,0 +1,169 @@
+#include "program_image.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "file.h"
+
+namespace {
+    constexpr char MAGIC[8] = {'C', 'P', 'U', 'P', 'R', 'O', 'G', 'M'};
+    constexpr size_t HEADER_BYTES = 40;
+    constexpr size_t RUN_HEADER_WORDS = 2;
+
+    template<class T>
+    T toLittle(T value){
+        if constexpr (std::endian::native == std::endian::big)
+            return std::byteswap(value);
+        return value;
+    }
+
+    template<class T>
+    void put(std::vector<unsigned char>& bytes, T value){
+        value = toLittle(value);
+        const unsigned char* raw = reinterpret_cast<const unsigned char*>(&value);
+        bytes.insert(bytes.end(), raw, raw + sizeof(T));
+    }
+
+    template<class T>
+    T get(const unsigned char* bytes){
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return toLittle(value);
+    }
+
+    uint64_t fnv1a(const unsigned char* bytes, size_t size){
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; ++i){
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    struct Run{
+        size_t address;
+        size_t length;
+    };
+
+    // Non-zero stretches of DMEM. Zero gaps shorter than a run header stay
+    // inside the run, since splitting there would make the file bigger.
+    std::vector<Run> findRuns(std::span<const uint32_t> DMEM){
+        std::vector<Run> runs;
+        size_t i = 0;
+        while (i < DMEM.size()){
+            if (DMEM[i] == 0){
+                ++i;
+                continue;
+            }
+            size_t begin = i;
+            size_t end = i + 1;
+            for (size_t next = end; next < DMEM.size() && next - end <= RUN_HEADER_WORDS; ++next){
+                if (DMEM[next] != 0)
+                    end = next + 1;
+            }
+            runs.push_back(Run{begin, end - begin});
+            i = end;
+        }
+        return runs;
+    }
+}
+
+bool image::isImage(const std::filesystem::path& path){
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+std::expected<size_t, image::ImageError> image::write(const std::filesystem::path& path,
+    std::span<const uint16_t> IMEM, std::span<const uint32_t> DMEM){
+
+    size_t imemCount = IMEM.size();
+    while (imemCount > 0 && IMEM[imemCount - 1] == 0)
+        --imemCount;
+    std::vector<Run> runs = findRuns(DMEM);
+
+    std::vector<unsigned char> payload;
+    for (size_t i = 0; i < imemCount; ++i)
+        put<uint16_t>(payload, IMEM[i]);
+    payload.resize((payload.size() + 3) & ~size_t{3}, 0);
+    for (const Run& run : runs){
+        put<uint32_t>(payload, run.address);
+        put<uint32_t>(payload, run.length);
+        for (size_t i = 0; i < run.length; ++i)
+            put<uint32_t>(payload, DMEM[run.address + i]);
+    }
+
+    std::vector<unsigned char> bytes(MAGIC, MAGIC + sizeof(MAGIC));
+    put<uint32_t>(bytes, VERSION);
+    put<uint32_t>(bytes, IMEM.size());
+    put<uint32_t>(bytes, DMEM.size());
+    put<uint32_t>(bytes, imemCount);
+    put<uint32_t>(bytes, runs.size());
+    put<uint32_t>(bytes, payload.size());
+    put<uint64_t>(bytes, fnv1a(payload.data(), payload.size()));
+    bytes.insert(bytes.end(), payload.begin(), payload.end());
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return std::unexpected(ImageError::CannotOpen);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    out.close();
+    if (!out)
+        return std::unexpected(ImageError::WriteError);
+    return bytes.size();
+}
+
+std::expected<void, image::ImageError> image::read(const std::filesystem::path& path,
+    std::span<uint16_t> IMEM, std::span<uint32_t> DMEM){
+
+    auto mapping = file::map(path);
+    if (!mapping){
+        return std::unexpected(mapping.error() == file::FileError::EmptyFile
+            ? ImageError::BadHeader : ImageError::CannotOpen);
+    }
+    const unsigned char* bytes = mapping->bytes().data();
+    size_t size = mapping->bytes().size();
+
+    if (size < HEADER_BYTES || std::memcmp(bytes, MAGIC, sizeof(MAGIC)) != 0
+        || get<uint32_t>(bytes + 8) != VERSION)
+        return std::unexpected(ImageError::BadHeader);
+    if (get<uint32_t>(bytes + 12) != IMEM.size() || get<uint32_t>(bytes + 16) != DMEM.size())
+        return std::unexpected(ImageError::SizeMismatch);
+    size_t imemCount = get<uint32_t>(bytes + 20);
+    size_t runCount = get<uint32_t>(bytes + 24);
+    size_t payloadSize = get<uint32_t>(bytes + 28);
+    if (imemCount > IMEM.size())
+        return std::unexpected(ImageError::BadHeader);
+    if (size - HEADER_BYTES < payloadSize)
+        return std::unexpected(ImageError::Truncated);
+
+    const unsigned char* payload = bytes + HEADER_BYTES;
+    if (fnv1a(payload, payloadSize) != get<uint64_t>(bytes + 32))
+        return std::unexpected(ImageError::BadChecksum);
+
+    size_t offset = (imemCount * sizeof(uint16_t) + 3) & ~size_t{3};
+    if (offset > payloadSize)
+        return std::unexpected(ImageError::Truncated);
+    for (size_t i = 0; i < IMEM.size(); ++i)
+        IMEM[i] = i < imemCount ? get<uint16_t>(payload + i * sizeof(uint16_t)) : 0;
+
+    std::fill(DMEM.begin(), DMEM.end(), 0);
+    for (size_t run = 0; run < runCount; ++run){
+        if (payloadSize - offset < RUN_HEADER_WORDS * sizeof(uint32_t))
+            return std::unexpected(ImageError::Truncated);
+        size_t address = get<uint32_t>(payload + offset);
+        size_t length = get<uint32_t>(payload + offset + 4);
+        offset += RUN_HEADER_WORDS * sizeof(uint32_t);
+        if (address > DMEM.size() || length > DMEM.size() - address)
+            return std::unexpected(ImageError::BadHeader);
+        if ((payloadSize - offset) / sizeof(uint32_t) < length)
+            return std::unexpected(ImageError::Truncated);
+        for (size_t i = 0; i < length; ++i)
+            DMEM[address + i] = get<uint32_t>(payload + offset + i * sizeof(uint32_t));
+        offset += length * sizeof(uint32_t);
+    }
+    return {};
+}
@@ -0,0 +1,211 @@
+#include "trace.h"
+
+#include <cstring>
+
+namespace {
+    constexpr char MAGIC[8] = {'C', 'P', 'U', 'T', 'R', 'A', 'C', 'E'};
+    constexpr uint8_t VERSION = 1;
+
+    // Each record starts with a tag byte: the Record flags in the low bits,
+    // then bits saying which fields match the usual case and were left out.
+    // Everything else follows as LEB128 varints, signed deltas zigzagged.
+    constexpr uint8_t FLAG_MASK = trace::Record::Z | trace::Record::C | trace::Record::STORE;
+    constexpr uint8_t NEXT_STEP = 8;
+    constexpr uint8_t NEXT_PC = 16;
+    constexpr uint8_t SAME_ACC = 32;
+    constexpr uint8_t SAME_IR = 64;
+
+    uint32_t zigzag(uint32_t delta){
+        return (delta << 1) ^ (0u - (delta >> 31));
+    }
+    uint32_t unzigzag(uint32_t value){
+        return (value >> 1) ^ (0u - (value & 1));
+    }
+
+    void putVarint(std::vector<char>& bytes, uint64_t value){
+        while (value >= 0x80){
+            bytes.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back(static_cast<char>(value));
+    }
+
+    // Encoder and decoder both start from an all-zero previous record.
+    void encode(std::vector<char>& bytes, const trace::Record& record, trace::Record& previous){
+        uint8_t tag = record.flags & FLAG_MASK;
+        if (record.step == previous.step + 1)
+            tag |= NEXT_STEP;
+        if (record.PC == previous.PC + 1)
+            tag |= NEXT_PC;
+        if (record.ACC == previous.ACC)
+            tag |= SAME_ACC;
+        if (record.IR == previous.IR)
+            tag |= SAME_IR;
+
+        bytes.push_back(static_cast<char>(tag));
+        if (!(tag & NEXT_STEP))
+            putVarint(bytes, record.step - previous.step);
+        if (!(tag & NEXT_PC))
+            putVarint(bytes, zigzag(record.PC - previous.PC));
+        if (!(tag & SAME_ACC))
+            putVarint(bytes, zigzag(record.ACC - previous.ACC));
+        if (!(tag & SAME_IR))
+            putVarint(bytes, record.IR);
+        if (tag & trace::Record::STORE){
+            putVarint(bytes, record.address);
+            putVarint(bytes, zigzag(record.value - record.ACC));
+        }
+        previous = record;
+    }
+
+    class Decoder{
+    public:
+        Decoder(std::ifstream& in) : in(in){}
+
+        // Returns false at a clean end of file.
+        std::expected<bool, trace::TraceError> next(trace::Record& record){
+            int tag = in.get();
+            if (tag == std::char_traits<char>::eof())
+                return false;
+
+            record = previous;
+            record.flags = tag & FLAG_MASK;
+            record.address = 0;
+            record.value = 0;
+            bool complete = true;
+            auto varint = [&](){
+                uint64_t value = 0;
+                for (int shift = 0; shift < 64; shift += 7){
+                    int byte = in.get();
+                    if (byte == std::char_traits<char>::eof())
+                        break;
+                    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                    if (!(byte & 0x80))
+                        return value;
+                }
+                complete = false;
+                return value;
+            };
+
+            record.step = tag & NEXT_STEP ? previous.step + 1 : previous.step + varint();
+            record.PC = tag & NEXT_PC ? previous.PC + 1 : previous.PC + unzigzag(varint());
+            if (!(tag & SAME_ACC))
+                record.ACC = previous.ACC + unzigzag(varint());
+            if (!(tag & SAME_IR))
+                record.IR = varint();
+            if (tag & trace::Record::STORE){
+                record.address = varint();
+                record.value = record.ACC + unzigzag(varint());
+            }
+            if (!complete)
+                return std::unexpected(trace::TraceError::Truncated);
+            previous = record;
+            return true;
+        }
+
+    private:
+        std::ifstream& in;
+        trace::Record previous{};
+    };
+}
+
+namespace trace{
+
+    std::expected<std::unique_ptr<Writer>, TraceError> Writer::open(const std::filesystem::path& path){
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return std::unexpected(TraceError::CannotOpen);
+        out.write(MAGIC, sizeof(MAGIC));
+        out.put(static_cast<char>(VERSION));
+        if (!out)
+            return std::unexpected(TraceError::WriteError);
+        return std::unique_ptr<Writer>(new Writer(std::move(out)));
+    }
+
+    Writer::Writer(std::ofstream out) : out(std::move(out)){
+        bytesWritten = sizeof(MAGIC) + 1;
+        filling.reserve(BUFFER_RECORDS);
+        draining.reserve(BUFFER_RECORDS);
+        thread = std::thread(&Writer::drain, this);
+    }
+
+    Writer::~Writer(){
+        (void)close();
+    }
+
+    void Writer::submit(){
+        std::unique_lock lock(mutex);
+        wake.wait(lock, [this]{return !busy;});
+        recordCount += filling.size();
+        std::swap(filling, draining);
+        filling.clear();
+        busy = true;
+        wake.notify_all();
+    }
+
+    std::expected<void, TraceError> Writer::close(){
+        if (thread.joinable()){
+            if (!filling.empty())
+                submit();
+            {
+                std::lock_guard lock(mutex);
+                closing = true;
+            }
+            wake.notify_all();
+            thread.join();
+            out.close();
+            failed |= out.fail();
+        }
+        if (failed)
+            return std::unexpected(TraceError::WriteError);
+        return {};
+    }
+
+    void Writer::drain(){
+        Record previous{};
+        std::vector<char> bytes;
+        std::unique_lock lock(mutex);
+        while (true){
+            wake.wait(lock, [this]{return busy || closing;});
+            if (!busy)
+                return;
+
+            lock.unlock();
+            bytes.clear();
+            for (const Record& record : draining)
+                encode(bytes, record, previous);
+            out.write(bytes.data(), bytes.size());
+            lock.lock();
+
+            failed |= !out;
+            bytesWritten += bytes.size();
+            busy = false;
+            wake.notify_all();
+        }
+    }
+
+    std::expected<size_t, TraceError> replay(const std::filesystem::path& path,
+        const std::function<void(const Record&)>& visit){
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return std::unexpected(TraceError::CannotOpen);
+
+        char header[sizeof(MAGIC) + 1];
+        if (!in.read(header, sizeof(header)) || std::memcmp(header, MAGIC, sizeof(MAGIC)) != 0
+            || static_cast<uint8_t>(header[sizeof(MAGIC)]) != VERSION)
+            return std::unexpected(TraceError::BadHeader);
+
+        Decoder decoder(in);
+        Record record;
+        size_t count = 0;
+        while (true){
+            auto more = decoder.next(record);
+            if (!more)
+                return std::unexpected(more.error());
+            if (!*more)
+                return count;
+            visit(record);
+            ++count;
+        }
+    }
+}
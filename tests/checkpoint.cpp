@@ -0,0 +1,285 @@
+#include <iostream>
+#include <format>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <span>
+#include <filesystem>
+#include <algorithm>
+#include <optional>
+#include <cstdio>
+
+#include "assembler.h"
+#include "checkpoint.h"
+#include "sparse_memory.h"
+
+// Checkpoints a run part way, resumes from the file and checks that the
+// resumed CPU matches an uninterrupted run, both at the step it resumed
+// from and where the program halts. Files written by checkpoint::Writer
+// cover both memory backends and the JIT; files written frame by frame
+// cover a trailing delta torn or corrupted at every byte, which the reader
+// must drop in favour of the frame before it. Exits non-zero on the first
+// mismatch.
+
+namespace{
+    constexpr uint16_t IMEM_SIZE = 64;
+    constexpr uint32_t DMEM_SIZE = 1024;
+
+    // Writes a scattered word each iteration, so every frame has pages to list.
+    constexpr std::string_view SOURCE = R"(
+        LOAD *0
+        AND 511
+        ADD 100
+        STORE 1
+        LOAD *3
+        SHL 7
+        XOR *3
+        STORE 3
+        STORE *1
+        LOAD *0
+        DEC
+        STORE 0
+        JNZ 0
+        HLT
+    )";
+    constexpr uint32_t ITERATIONS = 20000;
+
+    using Image = std::array<CPU<>::Instruction, IMEM_SIZE>;
+    using Data = std::array<uint32_t, DMEM_SIZE>;
+
+    template<class Memory>
+    using Machine = CPU<IMEM_SIZE, DMEM_SIZE, Memory>;
+
+    std::filesystem::path checkpointPath(){
+        return std::filesystem::temp_directory_path() / "cpuemul_checkpoint_test.ckpt";
+    }
+
+    template<class Memory>
+    void load(Machine<Memory>& cpu, const Image& image, const Data& data){
+        cpu.loadIMEM(image);
+        cpu.loadDMEM(data);
+    }
+
+    // Empty when both CPUs are in the same state, otherwise the first difference.
+    template<class Memory>
+    std::string compare(const Machine<Memory>& expected, const Machine<Memory>& actual){
+        if (expected.getStep() != actual.getStep())
+            return std::format("step {} != {}", expected.getStep(), actual.getStep());
+        if (expected.getState() != actual.getState())
+            return "running state differs";
+        if (expected.getPC() != actual.getPC() || expected.getACC() != actual.getACC()
+            || expected.getZ() != actual.getZ() || expected.getC() != actual.getC()
+            || expected.getIR().raw != actual.getIR().raw)
+            return std::format("at step {}: PC {} ACC {} Z {} C {} != PC {} ACC {} Z {} C {}", expected.getStep(),
+                expected.getPC(), expected.getACC(), expected.getZ(), expected.getC(),
+                actual.getPC(), actual.getACC(), actual.getZ(), actual.getC());
+        for (uint32_t address = 0; address < DMEM_SIZE; ++address){
+            if (expected.readDMEM(address) != actual.readDMEM(address))
+                return std::format("at step {}: DMEM[{}] {} != {}", expected.getStep(), address,
+                    expected.readDMEM(address), actual.readDMEM(address));
+        }
+        return {};
+    }
+
+    // Restores the checkpoint and checks it against the program run
+    // uninterrupted to the same step, then, with `toEnd`, both run to the end.
+    template<class Memory>
+    std::string resume(const Image& image, const Data& data, bool jit, size_t frames, size_t step, bool toEnd = true){
+        auto loaded = checkpoint::read(checkpointPath(), IMEM_SIZE, DMEM_SIZE);
+        if (!loaded)
+            return "read failed: " + checkpoint::toStr(loaded.error());
+        if (loaded->frames != frames)
+            return std::format("read {} frames, expected {}", loaded->frames, frames);
+
+        Machine<Memory> resumed;
+        checkpoint::restore(resumed, *loaded);
+        if (step != SIZE_MAX && resumed.getStep() != step)
+            return std::format("resumed at step {}, expected {}", resumed.getStep(), step);
+
+        Machine<Memory> uninterrupted;
+        load(uninterrupted, image, data);
+        uninterrupted.start();
+        uninterrupted.runFor(resumed.getStep());
+        if (std::string difference = compare(uninterrupted, resumed); !difference.empty())
+            return "on resume, " + difference;
+        if (!toEnd)
+            return {};
+
+        if (jit && !resumed.enableJit())
+            return "the JIT could not be enabled after a restore";
+        if (resumed.getState() == Simulator::State::RUNNING)
+            resumed.runFor(SIZE_MAX);
+        if (uninterrupted.getState() == Simulator::State::RUNNING)
+            uninterrupted.runFor(SIZE_MAX);
+        if (std::string difference = compare(uninterrupted, resumed); !difference.empty())
+            return "at the end, " + difference;
+        return {};
+    }
+
+    // Checkpoints every `every` steps through a Writer until `stopAt`. The
+    // Writer may skip snapshots, so whatever it wrote last is resumed.
+    template<class Memory>
+    std::string writerRoundTrip(const Image& image, const Data& data, size_t every, size_t stopAt, bool jit){
+        size_t written = 0;
+        {
+            Machine<Memory> cpu;
+            load(cpu, image, data);
+            if (jit && !cpu.enableJit())
+                return {};
+            cpu.start();
+            checkpoint::Writer<IMEM_SIZE, DMEM_SIZE, Memory> writer(checkpointPath(), cpu);
+            while (cpu.getStep() < stopAt && cpu.getState() == Simulator::State::RUNNING){
+                cpu.runFor(every);
+                writer.submit(cpu);
+            }
+            if (auto closed = writer.close(); !closed)
+                return "close failed: " + checkpoint::toStr(closed.error());
+            written = writer.getCheckpointCount();
+            if (written == 0)
+                return "nothing was written";
+        }
+        // The file holds the last full frame and the deltas after it.
+        auto loaded = checkpoint::read(checkpointPath(), IMEM_SIZE, DMEM_SIZE);
+        if (!loaded)
+            return "read failed: " + checkpoint::toStr(loaded.error());
+        if (loaded->frames == 0 || loaded->frames > written)
+            return std::format("read {} frames of {} written", loaded->frames, written);
+        return resume<Memory>(image, data, jit, loaded->frames, SIZE_MAX);
+    }
+
+    // Every page for a full frame; for a delta, the pages stored to since
+    // `previous`, which no longer share it.
+    template<class Memory>
+    std::vector<checkpoint::Page> pages(const typename Machine<Memory>::Snapshot& snapshot,
+        const typename Machine<Memory>::Snapshot* previous){
+        std::vector<checkpoint::Page> pages;
+        for (size_t page = 0; page < Memory::PAGE_COUNT; ++page){
+            if (previous && snapshot.DMEM.page(page) == previous->DMEM.page(page))
+                continue;
+            size_t words = std::min(Memory::PAGE_WORDS, DMEM_SIZE - page * Memory::PAGE_WORDS);
+            pages.push_back(checkpoint::Page{static_cast<uint32_t>(page),
+                std::span<const uint32_t>(snapshot.DMEM.page(page), words)});
+        }
+        return pages;
+    }
+
+    template<class Memory>
+    checkpoint::Registers registers(const typename Machine<Memory>::Snapshot& snapshot){
+        return checkpoint::Registers{snapshot.PC, snapshot.ACC, snapshot.Z, snapshot.C, snapshot.IR.raw,
+            snapshot.step, snapshot.state == Simulator::State::RUNNING};
+    }
+
+    // Writes a full frame and two deltas at fixed steps, then corrupts the
+    // last delta at each of its bytes and cuts it short by each length;
+    // resuming must land on the delta before it.
+    template<class Memory>
+    std::string tornDelta(const Image& image, const Data& data){
+        constexpr std::array<size_t, 3> STEPS{1000, 2503, 4001};
+        size_t fileSize = 0;
+        size_t lastDelta = 0;
+        {
+            Machine<Memory> cpu;
+            load(cpu, image, data);
+            cpu.start();
+            std::array<uint16_t, IMEM_SIZE> IMEM;
+            for (size_t i = 0; i < IMEM_SIZE; ++i)
+                IMEM[i] = cpu.readIMEM(i).raw;
+
+            checkpoint::File file(checkpointPath(), IMEM_SIZE, DMEM_SIZE, Memory::PAGE_WORDS);
+            std::optional<typename Machine<Memory>::Snapshot> previous;
+            for (size_t frame = 0; frame < STEPS.size(); ++frame){
+                cpu.runFor(STEPS[frame] - cpu.getStep());
+                auto snapshot = cpu.snapshot();
+                auto bytes = frame == 0
+                    ? file.writeFull(registers<Memory>(snapshot), IMEM, pages<Memory>(snapshot, nullptr))
+                    : file.appendDelta(registers<Memory>(snapshot), pages<Memory>(snapshot, &*previous));
+                if (!bytes)
+                    return "write failed: " + checkpoint::toStr(bytes.error());
+                fileSize = frame == 0 ? *bytes : fileSize + *bytes;
+                lastDelta = *bytes;
+                previous = std::move(snapshot);
+            }
+        }
+        if (std::filesystem::file_size(checkpointPath()) != fileSize)
+            return "the file size does not add up to the frames written";
+        if (std::string failure = resume<Memory>(image, data, false, 3, STEPS[2]); !failure.empty())
+            return "intact file: " + failure;
+
+        // Each byte of the last delta is flipped in place and flipped back.
+        auto flip = [&](size_t at){
+            std::FILE* file = std::fopen(checkpointPath().c_str(), "r+b");
+            if (!file)
+                return false;
+            int byte = std::fseek(file, at, SEEK_SET) == 0 ? std::fgetc(file) : EOF;
+            bool flipped = byte != EOF && std::fseek(file, at, SEEK_SET) == 0 && std::fputc(byte ^ 0x20, file) != EOF;
+            return std::fclose(file) == 0 && flipped;
+        };
+        for (size_t at = fileSize - lastDelta; at < fileSize; ++at){
+            if (!flip(at))
+                return "cannot corrupt the file";
+            std::string failure = resume<Memory>(image, data, false, 2, STEPS[1], false);
+            if (!flip(at))
+                return "cannot repair the file";
+            if (!failure.empty())
+                return std::format("delta corrupted at byte {}: {}", at - (fileSize - lastDelta), failure);
+        }
+
+        for (size_t cut = 1; cut <= lastDelta; ++cut){
+            std::error_code error;
+            std::filesystem::resize_file(checkpointPath(), fileSize - cut, error);
+            if (error)
+                return "cannot truncate the file";
+            if (std::string failure = resume<Memory>(image, data, false, 2, STEPS[1], cut == lastDelta); !failure.empty())
+                return std::format("delta cut by {} bytes: {}", cut, failure);
+        }
+        return {};
+    }
+
+    struct Case{
+        std::string_view name;
+        std::string (*run)(const Image&, const Data&);
+    };
+
+    const std::array<Case, 7> CASES{{
+        {"paged writer", [](const Image& image, const Data& data){
+            return writerRoundTrip<PagedMemory<DMEM_SIZE>>(image, data, 10007, 150000, false);}},
+        {"paged writer, small steps", [](const Image& image, const Data& data){
+            return writerRoundTrip<PagedMemory<DMEM_SIZE>>(image, data, 37, 100000, false);}},
+        {"paged writer past the halt", [](const Image& image, const Data& data){
+            return writerRoundTrip<PagedMemory<DMEM_SIZE>>(image, data, 50000, SIZE_MAX, false);}},
+        {"paged writer, jit", [](const Image& image, const Data& data){
+            return writerRoundTrip<PagedMemory<DMEM_SIZE>>(image, data, 3001, 120000, true);}},
+        {"sparse writer", [](const Image& image, const Data& data){
+            return writerRoundTrip<SparseMemory<DMEM_SIZE>>(image, data, 50000, 200000, false);}},
+        {"paged torn delta", [](const Image& image, const Data& data){
+            return tornDelta<PagedMemory<DMEM_SIZE>>(image, data);}},
+        {"sparse torn delta", [](const Image& image, const Data& data){
+            return tornDelta<SparseMemory<DMEM_SIZE>>(image, data);}},
+    }};
+}
+
+int main(){
+    auto assembly = Assembler{}.translate(SOURCE);
+    if (!assembly){
+        std::cerr << "The test program does not assemble\n";
+        return 1;
+    }
+    Image image = flashAssembly<IMEM_SIZE, DMEM_SIZE>(*assembly);
+    Data data{};
+    data[0] = ITERATIONS;
+    data[3] = 12345;
+
+    int status = 0;
+    for (const Case& c : CASES){
+        if (std::string failure = c.run(image, data); !failure.empty()){
+            std::cerr << std::format("{}: {}\n", c.name, failure);
+            status = 1;
+            break;
+        }
+    }
+    std::filesystem::remove(checkpointPath());
+    if (status == 0)
+        std::cout << std::format("{} checkpoint round trips resume where they left off\n", CASES.size());
+    return status;
+}
@@ -0,0 +1,171 @@
+#include <iostream>
+#include <format>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <optional>
+#include <utility>
+
+#include "data_reader.h"
+
+// Feeds DataReader one data file per case and checks the words it sets, or
+// the error code and line it stops at. Every case goes through both
+// parseData and parseWords, which must agree. Exits non-zero on the first
+// mismatch.
+
+namespace{
+    constexpr uint32_t DMEM_SIZE = 16;
+
+    using Code = DataReader::TranslationError::Code;
+    using Words = std::vector<DataReader::Word>;
+
+    struct Case{
+        std::string_view source;
+        // The words set, in file order, when the file parses.
+        Words words;
+        std::optional<Code> error;
+        size_t line = 0;
+    };
+
+    Case valid(std::string_view source, Words words){
+        return Case{source, std::move(words), std::nullopt, 0};
+    }
+    Case invalid(std::string_view source, Code error, size_t line = 1){
+        return Case{source, {}, error, line};
+    }
+
+    const std::vector<Case> CASES{
+        // Single words, number bases, comments and blank lines.
+        valid("", {}),
+        valid("0 5\n3 0x10\n4 010\n", {{0, 5}, {3, 16}, {4, 8}}),
+        valid("# header\n\n  1 7 # trailing\n\t2\t0\n", {{1, 7}, {2, 0}}),
+        valid("1 2\r\n3 4\r\n", {{1, 2}, {3, 4}}),
+        valid("15 4294967295", {{15, 4294967295u}}),
+        valid("+1 -0", {{1, 0}}),
+        valid("0X1 0XfF", {{1, 255}}),
+
+        // Runs of consecutive words.
+        valid("2: 1 2 0x3", {{2, 1}, {3, 2}, {4, 3}}),
+        valid("14: 7 8", {{14, 7}, {15, 8}}),
+        valid("0:x 0000000A DEADBEEF", {{0, 10}, {1, 0xDEADBEEF}}),
+        valid("4:x 0000000100000002 # two words", {{4, 1}, {5, 2}}),
+
+        // Fills.
+        valid("0..2 = 9", {{0, 9}, {1, 9}, {2, 9}}),
+        valid("5..5 = 0x1", {{5, 1}}),
+        valid("0..15 = 3\n", [](){
+            Words words;
+            for (uint32_t address = 0; address < DMEM_SIZE; ++address)
+                words.emplace_back(address, 3);
+            return words;
+        }()),
+        valid("0..1 = 1\n2: 2 3\n4:x 00000004\n5 5", {{0, 1}, {1, 1}, {2, 2}, {3, 3}, {4, 4}, {5, 5}}),
+
+        invalid("1", Code::INVALID_FORMAT),
+        invalid("1 2 3", Code::INVALID_FORMAT),
+        invalid("0 1\n\n7", Code::INVALID_FORMAT, 3),
+        invalid("0..3 9", Code::INVALID_FORMAT),
+        invalid("0..3 =", Code::INVALID_FORMAT),
+        invalid("0..3 = 1 2", Code::INVALID_FORMAT),
+        invalid("2:", Code::INVALID_FORMAT),
+        invalid("2: # nothing", Code::INVALID_FORMAT),
+        invalid("2:x", Code::INVALID_FORMAT),
+
+        invalid("a 1", Code::INVALID_ADDRESS),
+        invalid("0x 1", Code::INVALID_ADDRESS),
+        invalid("1x: 2", Code::INVALID_ADDRESS),
+        invalid("3..1 = 0", Code::INVALID_ADDRESS),
+        invalid("1..b = 0", Code::INVALID_ADDRESS),
+        invalid("08 1", Code::INVALID_ADDRESS),
+
+        invalid("1 z", Code::INVALID_VALUE),
+        invalid("1 0x", Code::INVALID_VALUE),
+        invalid("2: 1 q", Code::INVALID_VALUE),
+        invalid("0:x 123", Code::INVALID_VALUE),
+        invalid("0:x 0000000G", Code::INVALID_VALUE),
+        invalid("0:x +0000001", Code::INVALID_VALUE),
+
+        invalid("16 1", Code::ADDRESS_OUT_OF_RANGE),
+        invalid("-1 1", Code::ADDRESS_OUT_OF_RANGE),
+        invalid("99999999999999999999 1", Code::ADDRESS_OUT_OF_RANGE),
+        invalid("15: 1 2", Code::ADDRESS_OUT_OF_RANGE),
+        invalid("15:x 0000000000000000", Code::ADDRESS_OUT_OF_RANGE),
+        invalid("14..16 = 0", Code::ADDRESS_OUT_OF_RANGE),
+        invalid("16: 1", Code::ADDRESS_OUT_OF_RANGE),
+
+        invalid("1 4294967296", Code::VALUE_OUT_OF_RANGE),
+        invalid("1 0x100000000", Code::VALUE_OUT_OF_RANGE),
+        invalid("1 99999999999999999999", Code::VALUE_OUT_OF_RANGE),
+        invalid("1 -1", Code::VALUE_OUT_OF_RANGE),
+        invalid("0..3 = -5", Code::VALUE_OUT_OF_RANGE),
+        invalid("2: 1 4294967296", Code::VALUE_OUT_OF_RANGE),
+
+        invalid("1 1\n1 2", Code::DUPLICATE_ADDRESS, 2),
+        invalid("1 1\n01 2", Code::DUPLICATE_ADDRESS, 2),
+        invalid("0..3 = 1\n# gap\n2: 5", Code::DUPLICATE_ADDRESS, 3),
+        invalid("1: 1 2\n2 3", Code::DUPLICATE_ADDRESS, 2),
+        invalid("0:x 00000001\n0 1", Code::DUPLICATE_ADDRESS, 2),
+        invalid("4 0\n0..7 = 1", Code::DUPLICATE_ADDRESS, 2),
+        // A duplicate address is reported before a bad value on the same line.
+        invalid("1 1\n1 x", Code::DUPLICATE_ADDRESS, 2),
+    };
+
+    std::string describe(const std::optional<DataReader::TranslationError>& error){
+        if (!error)
+            return "success";
+        return std::format("'{}' on line {}", DataReader::toStr(error->code), error->line);
+    }
+
+    // Empty when the case holds, otherwise what went wrong.
+    std::string check(const Case& c){
+        auto data = DataReader::parseData<DMEM_SIZE>(c.source);
+        auto words = DataReader::parseWords<DMEM_SIZE>(c.source);
+        std::optional<DataReader::TranslationError> dataError;
+        std::optional<DataReader::TranslationError> wordsError;
+        if (!data)
+            dataError = data.error();
+        if (!words)
+            wordsError = words.error();
+
+        if (c.error){
+            std::string expected = describe(DataReader::TranslationError{*c.error, c.line});
+            if (describe(dataError) != expected)
+                return std::format("parseData: expected {}, got {}", expected, describe(dataError));
+            if (describe(wordsError) != expected)
+                return std::format("parseWords: expected {}, got {}", expected, describe(wordsError));
+            return {};
+        }
+
+        if (!data)
+            return std::format("parseData: expected success, got {}", describe(dataError));
+        if (!words)
+            return std::format("parseWords: expected success, got {}", describe(wordsError));
+        if (*words != c.words)
+            return "parseWords returned different words";
+        std::array<uint32_t, DMEM_SIZE> expected{};
+        for (auto [address, value] : c.words)
+            expected[address] = value;
+        if (*data != expected)
+            return "parseData returned a different DMEM";
+        return {};
+    }
+}
+
+int main(){
+    // Every code, the unused UNKNOWN_ERROR included, has a message.
+    for (size_t code = 0; code <= static_cast<size_t>(Code::UNKNOWN_ERROR); ++code){
+        if (std::string_view(DataReader::toStr(static_cast<Code>(code))).empty()){
+            std::cerr << std::format("error code {} has no message\n", code);
+            return 1;
+        }
+    }
+
+    for (const Case& c : CASES){
+        if (std::string failure = check(c); !failure.empty()){
+            std::cerr << std::format("{}\nin:\n{}\n", failure, c.source);
+            return 1;
+        }
+    }
+    std::cout << std::format("{} data files parse as expected\n", CASES.size());
+}
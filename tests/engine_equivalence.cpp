@@ -0,0 +1,212 @@
+#include <iostream>
+#include <format>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <cstdlib>
+
+#include "assembly.h"
+#include "cpu.h"
+#include "optimizer.h"
+
+// Runs random programs through every execution engine and checks that each
+// ends in the state the plain interpreter reaches in one uninterrupted run.
+// Engines run in randomly sized chunks, so budget exits in the middle of
+// fused sequences, closed-form loops and JIT blocks are covered too. The
+// optimized program of every run that ends on its own must end the same
+// way, with the same ACC, Z, C and DMEM, and halt in no more steps. Exits
+// non-zero on the first mismatch, printing the program.
+
+namespace{
+    constexpr uint16_t IMEM_SIZE = 64;
+    // Every 10-bit direct operand is a valid address; indirect ones are not.
+    constexpr uint32_t DMEM_SIZE = 1024;
+    constexpr size_t PROGRAMS = 20000;
+    constexpr size_t BUDGET = 20000;
+
+    using Machine = CPU<IMEM_SIZE, DMEM_SIZE>;
+    using Image = std::array<Machine::Instruction, IMEM_SIZE>;
+    using Data = std::array<uint32_t, DMEM_SIZE>;
+
+    struct Outcome{
+        bool halted;
+        bool faulted;
+        size_t step;
+        uint32_t PC;
+        uint32_t ACC;
+        bool Z;
+        bool C;
+        Data DMEM;
+
+        bool operator==(const Outcome& other) const{
+            return halted == other.halted && faulted == other.faulted && step == other.step
+                && PC == other.PC && sameResult(other);
+        }
+        // What an optimized program must preserve; its PC and steps move.
+        bool sameResult(const Outcome& other) const{
+            return ACC == other.ACC && Z == other.Z && C == other.C && DMEM == other.DMEM;
+        }
+        std::string toString() const{
+            return std::format("{} step {} PC {} ACC {} Z {} C {}",
+                halted ? "halt" : faulted ? "fault" : "budget", step, PC, ACC, Z, C);
+        }
+    };
+
+    struct Engine{
+        std::string_view name;
+        // False when the engine is not available in this build.
+        bool (*enable)(Machine&);
+    };
+
+    constexpr std::array<Engine, 7> ENGINES{{
+        {"interpreter", [](Machine&){return true;}},
+        {"jit", [](Machine& cpu){return cpu.enableJit();}},
+        {"fusion", [](Machine& cpu){cpu.enableFusion(); return true;}},
+        {"fusion+jit", [](Machine& cpu){cpu.enableFusion(); return cpu.enableJit();}},
+        {"loops", [](Machine& cpu){cpu.enableLoopAcceleration(); return true;}},
+        {"fusion+loops", [](Machine& cpu){cpu.enableFusion(); cpu.enableLoopAcceleration(); return true;}},
+        {"all", [](Machine& cpu){cpu.enableFusion(); cpu.enableLoopAcceleration(); return cpu.enableJit();}},
+    }};
+
+    // Without an engine, runs the plain interpreter to the budget in one go.
+    std::optional<Outcome> run(const Image& image, const Data& data, const Engine* engine, std::mt19937& rng){
+        Machine cpu;
+        cpu.loadIMEM(image);
+        cpu.loadDMEM(data);
+        if (engine && !engine->enable(cpu))
+            return std::nullopt;
+        cpu.start();
+
+        bool faulted = false;
+        try{
+            while (cpu.getState() == Simulator::State::RUNNING && cpu.getStep() < BUDGET){
+                size_t left = BUDGET - cpu.getStep();
+                cpu.runFor(engine ? std::min<size_t>(left, 1 + rng() % 64) : left);
+            }
+        } catch (const std::runtime_error&){
+            faulted = true;
+        }
+        bool halted = !faulted && cpu.getState() == Simulator::State::STOPPED;
+        return Outcome{halted, faulted, cpu.getStep(), cpu.getPC(), cpu.getACC(), cpu.getZ(), cpu.getC(), cpu.getDMEM()};
+    }
+
+    Assembly instruction(uint16_t code, bool isLiteral, uint16_t value){
+        Assembly assembly;
+        assembly.instructionCode = code;
+        assembly.isLiteral = isLiteral;
+        assembly.value = value;
+        return assembly;
+    }
+
+    // Mostly small addresses, so instructions meet each other's data, and
+    // the shapes the superinstruction and loop passes look for.
+    std::vector<Assembly> randomProgram(std::mt19937& rng){
+        std::vector<Assembly> program;
+        size_t length = 1 + rng() % (IMEM_SIZE - 8);
+        auto address = [&]() -> uint16_t{return rng() % 16 == 0 ? rng() % DMEM_SIZE : rng() % 8;};
+        auto target = [&]() -> uint16_t{return rng() % (length + 2);};
+
+        while (program.size() < length){
+            uint16_t here = program.size();
+            uint16_t a = address();
+            uint16_t c = address();
+            switch (rng() % 8){
+                case 0:
+                    program.push_back(instruction(Asm::LOAD, false, a));
+                    program.push_back(instruction(rng() % 2 ? Asm::ADD : Asm::SUB, rng() % 2, rng() % 4));
+                    program.push_back(instruction(Asm::STORE, true, a));
+                    break;
+                case 1:
+                    program.push_back(instruction(Asm::DEC, false, 0));
+                    program.push_back(instruction(Asm::JNZ, true, rng() % 2 ? here : target()));
+                    break;
+                case 2:
+                    program.push_back(instruction(Asm::LOAD, false, c));
+                    program.push_back(instruction(Asm::DEC, false, 0));
+                    program.push_back(instruction(Asm::STORE, true, c));
+                    program.push_back(instruction(Asm::JNZ, true, here));
+                    break;
+                case 3:
+                    program.push_back(instruction(Asm::LOAD, false, a));
+                    program.push_back(instruction(rng() % 2 ? Asm::ADD : Asm::SUB, true, rng() % 1024));
+                    program.push_back(instruction(Asm::STORE, true, a));
+                    program.push_back(instruction(Asm::LOAD, false, c));
+                    program.push_back(instruction(Asm::DEC, false, 0));
+                    program.push_back(instruction(Asm::STORE, true, c));
+                    program.push_back(instruction(Asm::JNZ, true, here));
+                    break;
+                case 4:
+                    program.push_back(instruction(Asm::LOAD, false, a));
+                    program.push_back(instruction(rng() % 2 ? Asm::JZ : Asm::JNZ, true, target()));
+                    break;
+                default:{
+                    uint16_t code = rng() % (Asm::HLT + 2);
+                    bool isJump = code >= Asm::JMP && code <= Asm::JNC;
+                    bool isLiteral = isJump ? rng() % 8 != 0 : rng() % 2;
+                    uint16_t value = isJump && isLiteral ? target() : isLiteral ? rng() % 16 : a;
+                    program.push_back(instruction(code, isLiteral, value));
+                    break;
+                }
+            }
+        }
+        program.resize(std::min<size_t>(program.size(), IMEM_SIZE - 1));
+        if (rng() % 2)
+            program.push_back(instruction(Asm::HLT, false, 0));
+        return program;
+    }
+
+    // Small loop counters, so most runs halt inside the budget, with the
+    // odd word large enough to be a bad indirect address.
+    Data randomData(std::mt19937& rng){
+        Data data{};
+        for (size_t address = 0; address < 8; ++address)
+            data[address] = rng() % 8 == 0 ? rng() : rng() % 300;
+        return data;
+    }
+
+    void print(const std::vector<Assembly>& program){
+        for (const Assembly& assembly : program)
+            std::cerr << "  " << assembly.toString() << "\n";
+    }
+}
+
+int main(int argc, char** argv){
+    std::mt19937 rng(argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1);
+
+    for (size_t i = 0; i < PROGRAMS; ++i){
+        std::vector<Assembly> program = randomProgram(rng);
+        Image image = flashAssembly<IMEM_SIZE, DMEM_SIZE>(program);
+        Data data = randomData(rng);
+        Outcome expected = *run(image, data, nullptr, rng);
+
+        for (const Engine& engine : ENGINES){
+            std::optional<Outcome> actual = run(image, data, &engine, rng);
+            if (actual && *actual != expected){
+                std::cerr << std::format("{} differs on program {}: expected {}, got {}\n",
+                    engine.name, i, expected.toString(), actual->toString());
+                print(program);
+                return 1;
+            }
+        }
+
+        if (!expected.halted && !expected.faulted)
+            continue;
+        std::vector<Assembly> optimized = program;
+        optimizeAssembly(optimized, DMEM_SIZE);
+        Outcome actual = *run(flashAssembly<IMEM_SIZE, DMEM_SIZE>(optimized), data, nullptr, rng);
+        if (actual.halted != expected.halted || actual.faulted != expected.faulted || !actual.sameResult(expected)
+            || (expected.halted && actual.step > expected.step)){
+            std::cerr << std::format("optimizer differs on program {}: expected {}, got {}\n",
+                i, expected.toString(), actual.toString());
+            print(program);
+            std::cerr << "optimized to\n";
+            print(optimized);
+            return 1;
+        }
+    }
+    std::cout << std::format("{} programs agree on {} engines and the optimizer\n", PROGRAMS, ENGINES.size());
+}
@@ -0,0 +1,207 @@
+#include <iostream>
+#include <format>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <utility>
+#include <filesystem>
+#include <stdexcept>
+
+#include "assembler.h"
+#include "trace.h"
+
+// Records a program with trace::run, decodes the file with trace::replay
+// and checks every decoded record against a second CPU stepped one
+// instruction at a time: the step number, PC, ACC, IR and flags after the
+// step, and the address and value of every store. Runs that halt, run out
+// of budget, fault and outgrow the writer's buffer are covered. Exits
+// non-zero on the first mismatch.
+
+namespace{
+    constexpr uint16_t IMEM_SIZE = 64;
+    constexpr uint32_t DMEM_SIZE = 1024;
+
+    using Machine = CPU<IMEM_SIZE, DMEM_SIZE>;
+    using Data = std::array<uint32_t, DMEM_SIZE>;
+
+    std::filesystem::path tracePath(){
+        return std::filesystem::temp_directory_path() / "cpuemul_trace_test.trace";
+    }
+
+    struct Case{
+        std::string_view name;
+        std::string_view source;
+        std::vector<std::pair<uint32_t, uint32_t>> data;
+        size_t budget = SIZE_MAX;
+    };
+
+    const std::array<Case, 5> CASES{{
+        // Direct and indirect stores, shifts and every kind of branch.
+        {"mixed", R"(
+            LOAD 40     #  0: DMEM[1] is a pointer
+            STORE 1
+            LOAD *0     #  2: loop while DMEM[0] counts down
+            DEC
+            STORE 0
+            JZ 14
+            LOAD *1
+            INC
+            STORE 1
+            SHL 3
+            XOR *0
+            STORE *1    # 11: DMEM[DMEM[1]] = ACC
+            JNC 2
+            JMP 2
+            HLT         # 14
+        )", {{0, 900}}},
+
+        // An indirect store through a pointer to itself.
+        {"self store", R"(
+            LOADI 2     # 0: ACC = DMEM[2]
+            ADD 7
+            STORE *1    # 2: DMEM[1] points at DMEM[1]
+            LOAD *3
+            DEC
+            STORE 3
+            JNZ 0
+            HLT
+        )", {{1, 1}, {2, 5}, {3, 50}}},
+
+        // Enough steps to fill the writer's buffer twice over.
+        {"long loop", R"(
+            LOAD *0
+            DEC
+            STORE 0
+            JNZ 0
+            HLT
+        )", {{0, 40000}}},
+
+        {"budget", R"(
+            LOAD *0
+            DEC
+            STORE 0
+            JNZ 0
+            HLT
+        )", {{0, 1000}}, 1234},
+
+        // The pointer walks off the end of DMEM, so the indirect store faults.
+        {"fault", R"(
+            LOAD 1000
+            STORE 1
+            LOAD *1     # 2
+            INC
+            STORE 1
+            STORE *1    # 5: DMEM[DMEM[1]] = ACC
+            JMP 2
+        )", {}},
+    }};
+
+    // Empty when the trace decodes to what a stepped CPU does, otherwise
+    // the first difference.
+    std::string check(const Case& c){
+        auto assembly = Assembler{}.translate(c.source);
+        if (!assembly)
+            return std::format("does not assemble: {}", Assembler::toStr(assembly.error()));
+        auto image = flashAssembly<IMEM_SIZE, DMEM_SIZE>(*assembly);
+        Data data{};
+        for (auto [address, value] : c.data)
+            data[address] = value;
+
+        Machine recorded;
+        recorded.loadIMEM(image);
+        recorded.loadDMEM(data);
+        recorded.start();
+        bool faulted = false;
+        size_t records = 0;
+        {
+            auto writer = trace::Writer::open(tracePath());
+            if (!writer)
+                return "cannot open the trace: " + trace::toStr(writer.error());
+            try{
+                trace::run(recorded, **writer, c.budget);
+            } catch (const std::runtime_error&){
+                faulted = true;
+            }
+            if (auto closed = (*writer)->close(); !closed)
+                return "cannot close the trace: " + trace::toStr(closed.error());
+            records = (*writer)->getRecordCount();
+        }
+        if (records != recorded.getStep())
+            return std::format("{} records for {} steps", records, recorded.getStep());
+
+        Machine stepped;
+        stepped.loadIMEM(image);
+        stepped.loadDMEM(data);
+        stepped.start();
+        std::string failure;
+        auto visit = [&](const trace::Record& record){
+            if (!failure.empty())
+                return;
+            if (stepped.getState() != Simulator::State::RUNNING){
+                failure = std::format("a record after the halt at step {}", stepped.getStep());
+                return;
+            }
+            Data before = stepped.getDMEM();
+            stepped.step();
+
+            uint8_t flags = (stepped.getZ() ? trace::Record::Z : 0) | (stepped.getC() ? trace::Record::C : 0);
+            if (record.step != stepped.getStep() || record.PC != stepped.getPC() || record.ACC != stepped.getACC()
+                || record.IR != stepped.getIR().raw || (record.flags & ~trace::Record::STORE) != flags){
+                failure = std::format("step {}: recorded step {} PC {} ACC {} IR {:#06x} flags {}, "
+                    "stepped PC {} ACC {} IR {:#06x} flags {}", stepped.getStep(),
+                    record.step, record.PC, record.ACC, record.IR, record.flags & ~trace::Record::STORE,
+                    stepped.getPC(), stepped.getACC(), stepped.getIR().raw, flags);
+                return;
+            }
+
+            Machine::Instruction IR = stepped.getIR();
+            bool isStore = IR.fields.code == Asm::STORE;
+            if (isStore != static_cast<bool>(record.flags & trace::Record::STORE)){
+                failure = std::format("step {}: store flag {} on {}", record.step,
+                    static_cast<bool>(record.flags & trace::Record::STORE), isStore ? "a STORE" : "no STORE");
+                return;
+            }
+            if (!isStore)
+                return;
+            uint32_t address = IR.fields.isLiteral ? IR.fields.value : before[IR.fields.value];
+            if (record.address != address || record.value != stepped.readDMEM(address))
+                failure = std::format("step {}: recorded store of {} to {}, stepped store of {} to {}", record.step,
+                    record.value, record.address, stepped.readDMEM(address), address);
+        };
+        auto replayed = trace::replay(tracePath(), visit);
+        if (!replayed)
+            return "cannot replay the trace: " + trace::toStr(replayed.error());
+        if (!failure.empty())
+            return failure;
+        if (*replayed != records)
+            return std::format("replayed {} records of {}", *replayed, records);
+
+        // The stepped CPU must end where the recorded one did.
+        if (stepped.getState() != recorded.getState() || stepped.getStep() != recorded.getStep())
+            return std::format("the recording ended at step {}, the replay at step {}",
+                recorded.getStep(), stepped.getStep());
+        if (faulted){
+            try{
+                stepped.step();
+                return std::format("the recording faulted at step {}, the stepped CPU did not", recorded.getStep());
+            } catch (const std::runtime_error&){}
+        }
+        return {};
+    }
+}
+
+int main(){
+    int status = 0;
+    for (const Case& c : CASES){
+        if (std::string failure = check(c); !failure.empty()){
+            std::cerr << std::format("{}: {}\n", c.name, failure);
+            status = 1;
+            break;
+        }
+    }
+    std::filesystem::remove(tracePath());
+    if (status == 0)
+        std::cout << std::format("{} traces decode to the stepped CPU\n", CASES.size());
+    return status;
+}